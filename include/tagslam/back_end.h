@@ -0,0 +1,49 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_BACK_END_H
+#define TAGSLAM_BACK_END_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace tagslam {
+  //
+  // Worker thread that runs one job at a time, used to take the
+  // isam update off the frame processing path. There is no job
+  // queue: the caller checks isBusy() and only submits when the
+  // previous job has finished. The number of completed jobs
+  // serves as version for handing results back.
+  //
+  class BackEnd {
+  public:
+    typedef std::function<void()> Job;
+    BackEnd() {}
+    ~BackEnd();
+    BackEnd(const BackEnd&) = delete;
+    BackEnd& operator=(const BackEnd&) = delete;
+
+    void start();
+    void stop();
+    bool isRunning() const { return (thread_.joinable()); }
+    bool isBusy() const;
+    // throws if the previous job is still running
+    void submit(const Job &job);
+    void waitUntilIdle();
+    unsigned int getNumCompleted() const;
+  private:
+    void run();
+    // ------------ variables
+    std::thread                  thread_;
+    mutable std::mutex           mutex_;
+    std::condition_variable      cv_;
+    Job                          job_;
+    bool                         busy_{false};
+    bool                         keepRunning_{false};
+    unsigned int                 numCompleted_{0};
+  };
+}
+
+#endif
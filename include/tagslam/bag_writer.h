@@ -0,0 +1,64 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_BAG_WRITER_H
+#define TAGSLAM_BAG_WRITER_H
+
+#include "tagslam/profiler.h"
+#include <rosbag/bag.h>
+#include <boost/make_shared.hpp>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <string>
+
+namespace tagslam {
+  //
+  // Writes messages to a bag on a separate thread, so disk stalls
+  // don't hold up processing. The queue is bounded: when it is
+  // full, write() blocks until the writer thread has caught up.
+  // The writer drains the whole queue per batch. The time spent
+  // in the bag (serialization, chunk compression and I/O) is
+  // recorded in the writer's profiler.
+  //
+  class BagWriter {
+  public:
+    BagWriter(size_t maxQueueSize = 100);
+    ~BagWriter();
+    BagWriter(const BagWriter&) = delete;
+    BagWriter& operator=(const BagWriter&) = delete;
+
+    // "none", "lz4" or "bz2", throws std::runtime_error otherwise
+    static rosbag::compression::CompressionType
+    parse_compression(const std::string &name);
+
+    void open(const std::string &fname,
+              rosbag::compression::CompressionType compression);
+    // writes all queued messages and closes the bag
+    void close();
+    template<typename T>
+    void write(const std::string &topic, const ros::Time &t, const T &msg) {
+      const boost::shared_ptr<const T> m = boost::make_shared<T>(msg);
+      push([topic, t, m](rosbag::Bag *bag) { bag->write(topic, t, m); });
+    }
+    // only valid after close()
+    const Profiler &getProfiler() const { return (profiler_); }
+  private:
+    typedef std::function<void(rosbag::Bag *)> Write;
+    void push(const Write &w);
+    void run();
+    // ------------ variables
+    rosbag::Bag                  bag_;
+    size_t                       maxQueueSize_;
+    std::deque<Write>            queue_;
+    Profiler                     profiler_;
+    std::thread                  thread_;
+    std::mutex                   mutex_;
+    std::condition_variable      cv_;
+    bool                         keepRunning_{false};
+  };
+}
+
+#endif
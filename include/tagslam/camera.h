@@ -7,9 +7,9 @@
 #include "tagslam/camera_intrinsics.h"
 #include "tagslam/camera_extrinsics.h"
 #include "tagslam/pose_estimate.h"
-#include "gtsam_equidistant/Cal3FS2.h"
+#include "tagslam/projector.h"
+#include "tagslam/undistortion_table.h"
 #include <gtsam/geometry/Pose3.h>
-#include <gtsam/geometry/Cal3DS2.h>
 #include <Eigen/Dense>
 #include <ros/ros.h>
 #include <memory>
@@ -28,14 +28,15 @@ namespace tagslam {
     std::string       rostopic;
     std::string       tagtopic;
     std::string       frame_id;
+    bool              isShmClient{false}; // detections come via shared memory
     bool              hasPosePrior{false};
     PoseEstimate      poseEstimate; // T_r_c
     gtsam::Pose3      optimizedPose;
     int               lastFrameNumber{-1};
     std::string       rig_body; // string with name
     std::shared_ptr<RigidBody>        rig;
-    boost::shared_ptr<Cal3FS2>        equidistantModel;
-    boost::shared_ptr<gtsam::Cal3DS2> radtanModel;
+    ProjectorPtr                      projector;
+    UndistortionTablePtr              undistortionTable;
     typedef std::shared_ptr<Camera> CameraPtr;
     typedef std::shared_ptr<const Camera> CameraConstPtr;
     typedef std::vector<CameraPtr> CameraVec;
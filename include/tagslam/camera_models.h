@@ -0,0 +1,95 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_CAMERA_MODELS_H
+#define TAGSLAM_CAMERA_MODELS_H
+
+namespace tagslam {
+  //
+  // Distortion model policies for ProjectorT. Each policy maps
+  // undistorted normalized coordinates (x, y) to distorted
+  // normalized coordinates (xd, yd). The arguments are Eigen arrays
+  // in structure-of-arrays layout, k points to the 5 distortion
+  // coefficients (unused ones are zero). J (if non-null) points to 4 arrays that receive
+  // the row-major 2x2 jacobian d(xd,yd)/d(x,y).
+  //
+  // To add a new model, write a policy struct, instantiate
+  // ProjectorT with it in projector.cpp, and add its name(s)
+  // to Projector::make().
+  //
+
+  // no distortion at all
+  struct PinholeModel {
+    static const char *name() { return ("pinhole"); }
+    static const int MAX_COEFF = 5; // all ignored
+    template <typename A>
+    static void distort(const double *k, const A &x, const A &y,
+                        A *xd, A *yd, A *J) {
+      (void) k;
+      *xd = x;
+      *yd = y;
+      if (J) {
+        J[0] = A::Ones(x.size());
+        J[1] = A::Zero(x.size());
+        J[2] = J[1];
+        J[3] = J[0];
+      }
+    }
+  };
+
+  // same as opencv plumb_bob, coefficients k1, k2, p1, p2, k3
+  struct RadTanModel {
+    static const char *name() { return ("radtan"); }
+    static const int MAX_COEFF = 5;
+    template <typename A>
+    static void distort(const double *k, const A &x, const A &y,
+                        A *xd, A *yd, A *J) {
+      const double k1(k[0]), k2(k[1]), p1(k[2]), p2(k[3]), k3(k[4]);
+      const A xx = x.square(), yy = y.square(), xy = x * y;
+      const A r2 = xx + yy;
+      const A g  = 1.0 + r2 * (k1 + r2 * (k2 + r2 * k3));
+      *xd = g * x + 2.0 * p1 * xy + p2 * (r2 + 2.0 * xx);
+      *yd = g * y + p1 * (r2 + 2.0 * yy) + 2.0 * p2 * xy;
+      if (J) {
+        const A dg = 2.0 * (k1 + r2 * (2.0 * k2 + 3.0 * k3 * r2)); // 2 * dg/d(r^2)
+        J[0] = g + dg * xx + 2.0 * p1 * y + 6.0 * p2 * x;
+        J[1] = dg * xy + 2.0 * p1 * x + 2.0 * p2 * y;
+        J[2] = J[1];
+        J[3] = g + dg * yy + 6.0 * p1 * y + 2.0 * p2 * x;
+      }
+    }
+  };
+
+  // same as opencv fisheye/Cal3FS2
+  struct EquidistantModel {
+    static const char *name() { return ("equidistant"); }
+    static const int MAX_COEFF = 4;
+    template <typename A>
+    static void distort(const double *k, const A &x, const A &y,
+                        A *xd, A *yd, A *J) {
+      const double k1(k[0]), k2(k[1]), k3(k[2]), k4(k[3]);
+      const A xx = x.square(), yy = y.square(), xy = x * y;
+      const A r2  = xx + yy;
+      const A r   = r2.sqrt();
+      const A th  = r.atan();
+      const A th2 = th.square();
+      const A thd = th * (1.0 + th2 * (k1 + th2 * (k2 + th2 * (k3 + th2 * k4))));
+      // s = theta_d / r, goes to 1 for r -> 0
+      const A s = (r < 1e-9).select(1.0, thd / r);
+      *xd = s * x;
+      *yd = s * y;
+      if (J) {
+        const A dthd = 1.0 + th2 * (3.0 * k1 + th2 * (5.0 * k2 + th2 *
+                                                      (7.0 * k3 + th2 * 9.0 * k4)));
+        // ds = (ds/dr) / r, vanishes for r -> 0
+        const A ds = (r < 1e-9).select(0.0, (dthd / (1.0 + r2) - s) / r2);
+        J[0] = s + ds * xx;
+        J[1] = ds * xy;
+        J[2] = J[1];
+        J[3] = s + ds * yy;
+      }
+    }
+  };
+}
+
+#endif
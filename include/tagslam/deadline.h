@@ -0,0 +1,30 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_DEADLINE_H
+#define TAGSLAM_DEADLINE_H
+
+#include <chrono>
+
+namespace tagslam {
+  //
+  // Point in (monotonic) time by which some work should be done.
+  // A default-constructed deadline never expires.
+  //
+  class Deadline {
+  public:
+    Deadline() {}
+    // expires "seconds" from now, never if seconds <= 0
+    explicit Deadline(double seconds) :
+      isSet_(seconds > 0),
+      time_(Clock::now() + std::chrono::duration_cast<Clock::duration>(
+              std::chrono::duration<double>(seconds))) {}
+    bool isExpired() const { return (isSet_ && Clock::now() > time_); }
+  private:
+    typedef std::chrono::steady_clock Clock;
+    bool              isSet_{false};
+    Clock::time_point time_;
+  };
+}
+
+#endif
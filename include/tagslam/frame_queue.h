@@ -0,0 +1,85 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_FRAME_QUEUE_H
+#define TAGSLAM_FRAME_QUEUE_H
+
+#include <apriltag_msgs/ApriltagArrayStamped.h>
+#include <ros/time.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace tagslam {
+  //
+  // Explicit input queue for live operation. The subscriber
+  // callbacks push synchronized tag bundles, and a worker thread
+  // pops and processes them. Each source (e.g. a sync group) has
+  // its own queue, and the worker takes turns between them, so one
+  // fast source cannot starve the others. When processing falls
+  // behind, frames are dropped per source according to the policy:
+  //
+  //  LATEST: only the most recent bundle is kept.
+  //  THIN:   up to maxDepth bundles are kept. On overflow the oldest
+  //          unprotected bundle is dropped. Protected are bundles with
+  //          tags never seen before, and bundles at least keepInterval
+  //          seconds after the previous protected one, so the
+  //          time-based keyframes survive.
+  //
+  class FrameQueue {
+  public:
+    enum Policy { LATEST, THIN };
+    typedef std::vector<apriltag_msgs::ApriltagArrayStamped::ConstPtr> Frame;
+    typedef std::function<void(const Frame &)> Callback;
+
+    FrameQueue(Policy policy, size_t maxDepth, double keepInterval);
+    ~FrameQueue();
+    FrameQueue(const FrameQueue&) = delete;
+    FrameQueue& operator=(const FrameQueue&) = delete;
+
+    // throws std::runtime_error on unknown policy name
+    static Policy parse_policy(const std::string &name);
+
+    void start(const Callback &cb);
+    void stop();
+    void push(const Frame &frame, unsigned int source = 0);
+    // total over all sources
+    size_t getDepth() const;
+    unsigned int getNumDropped() const;
+  private:
+    struct Entry {
+      Frame frame;
+      bool  isProtected{false};
+    };
+    struct Source {
+      std::deque<Entry> queue;
+      ros::Time         lastProtectedTime{0};
+    };
+    bool isProtected(Source *src, const Frame &frame);
+    void dropOne(Source *src);
+    bool popNext(Frame *frame);
+    void run();
+    // ------------ variables
+    Policy                       policy_;
+    size_t                       maxDepth_;
+    double                       keepInterval_;
+    std::set<int>                seenTags_;
+    std::map<unsigned int, Source> sources_;
+    unsigned int                 nextSource_{0}; // round robin
+    size_t                       depth_{0};
+    unsigned int                 numDropped_{0};
+    Callback                     callback_;
+    std::thread                  thread_;
+    mutable std::mutex           mutex_;
+    std::condition_variable      cv_;
+    bool                         keepRunning_{false};
+  };
+}
+
+#endif
@@ -8,8 +8,8 @@
 #include "tagslam/rigid_body.h"
 #include "tagslam/pose_estimate.h"
 #include "tagslam/camera.h"
-#include <gtsam/nonlinear/Values.h>
-#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include "tagslam/resection_solver.h"
+#include "tagslam/deadline.h"
 #include <opencv2/core.hpp>
 #include <vector>
 #include <memory>
@@ -31,28 +31,42 @@ namespace tagslam {
       initRelPixErr_ = maxErr;
     }
 
+    // The random restarts stop once the deadline has expired,
+    // returning the best pose found so far.
+
     // returns T_w_c
     PoseEstimate
     estimateCameraPose(const CameraPtr &camera,
                        const std::vector<gtsam::Point3> &wp,
                        const std::vector<gtsam::Point2> &ip,
                        const PoseEstimate &initialPose,
-                       double *errorLimit) const;
+                       double *errorLimit,
+                       const Deadline &deadline = Deadline()) const;
     PoseEstimate
     estimateBodyPose(const CameraVec &cams,
                      const ImageVec &imgs,
                      unsigned int frameNum,
                      const RigidBodyConstPtr &rb,
                      const gtsam::Pose3 &initialPose,
-                     double *errorLimit) const;
+                     double *errorLimit,
+                     const Deadline &deadline = Deadline()) const;
+    // returns T_w_b, solver must be set up for T_w_b
+    PoseEstimate
+    estimateBodyPose(const ResectionSolver &solver,
+                     const gtsam::Pose3 &initialPose,
+                     double *errorLimit,
+                     const Deadline &deadline = Deadline()) const;
 
   private:
+    // runs solver from startPose and random restarts. If wp is
+    // non-empty, the solution is taken to be T_c_w, and all wp
+    // must be in front of the camera.
     PoseEstimate
     optimizeGraph(const gtsam::Pose3 &startPose,
-                  const gtsam::Values &startValues,
-                  gtsam::NonlinearFactorGraph *graph,
+                  const ResectionSolver &solver,
                   double errorLimit, double *adjErrorLimit,
-                  const std::vector<gtsam::Point3> &wp) const;
+                  const std::vector<gtsam::Point3> &wp,
+                  const Deadline &deadline) const;
     // --- variables--------------
     double initRelPixErr_{0.005};
   };
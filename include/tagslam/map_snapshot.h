@@ -0,0 +1,39 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_MAP_SNAPSHOT_H
+#define TAGSLAM_MAP_SNAPSHOT_H
+
+#include <gtsam/geometry/Pose3.h>
+#include <ros/time.h>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace tagslam {
+  //
+  // Immutable copy of the static map, made after each
+  // optimization. Readers hold on to a shared pointer, so a new
+  // snapshot can be swapped in without waiting for them.
+  //
+  struct MapSnapshot {
+    struct Entry {
+      Entry(const gtsam::Pose3 &p = gtsam::Pose3(),
+            const gtsam::Matrix6 &c = gtsam::Matrix6::Zero()) :
+        pose(p), covariance(c) {}
+      gtsam::Pose3   pose;       // T_w_x
+      gtsam::Matrix6 covariance; // marginal, gtsam order: rotation, translation.
+                                 // Zero if unknown, e.g. for a frozen map.
+      double         size{0};    // tag size, 0 for bodies
+    };
+    typedef std::map<int, Entry>         TagMap;
+    typedef std::map<std::string, Entry> BodyMap;
+    unsigned int frameNum{0};
+    ros::Time    time{0};
+    TagMap       tags;   // by tag id
+    BodyMap      bodies; // static bodies by name
+  };
+  using MapSnapshotConstPtr = std::shared_ptr<const MapSnapshot>;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_MOTION_PREDICTOR_H
+#define TAGSLAM_MOTION_PREDICTOR_H
+
+#include <gtsam/geometry/Pose3.h>
+#include <ros/ros.h>
+
+namespace tagslam {
+  //
+  // Constant-velocity motion model for a dynamic body. The
+  // velocity is kept as a body-frame twist, computed from
+  // the last two optimized poses.
+  //
+  class MotionPredictor {
+  public:
+    void reset() { numUpdates_ = 0; }
+    // record optimized pose T_w_b at time t
+    void update(const gtsam::Pose3 &T_w_b, const ros::Time &t);
+    // predict pose at time t, returns false if there is
+    // no velocity yet or if the last update is too old
+    bool predict(const ros::Time &t, gtsam::Pose3 *T_w_b) const;
+    void setMaxTimeGap(double dt) { maxTimeGap_ = dt; }
+  private:
+    gtsam::Pose3   lastPose_;
+    ros::Time      lastTime_;
+    gtsam::Vector6 velocity_{gtsam::Vector6::Zero()}; // per second
+    int            numUpdates_{0};
+    double         maxTimeGap_{0.5};
+  };
+}
+
+#endif
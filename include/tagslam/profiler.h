@@ -31,6 +31,15 @@ namespace tagslam {
       last_ = now;
       return (usec.count());
     }
+    // counts an event without affecting the timing
+    void count(const char *label) {
+      ProfilerMap::iterator i = map_.find(label);
+      if (i == map_.end()) {
+        map_[label] = PTimer(Duration(0), 1);
+      } else {
+        map_[label] = PTimer(Duration(0), i->second, 1);
+      }
+    }
     friend std::ostream &operator<<(std::ostream& os, const Profiler &p);
   private:
     typedef boost::chrono::duration<long long, boost::micro> Duration;
@@ -0,0 +1,142 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_PROJECTOR_H
+#define TAGSLAM_PROJECTOR_H
+
+#include "tagslam/camera_models.h"
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/geometry/Point2.h>
+#include <gtsam/geometry/Point3.h>
+#include <gtsam/base/OptionalJacobian.h>
+#include <gtsam/nonlinear/Expression.h>
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <stdexcept>
+
+namespace tagslam {
+  //
+  // Batch projection kernel, one instantiation per camera model
+  // (see camera_models.h). The model is picked once when the
+  // cameras are parsed, so there is no per-point dispatch.
+  //
+  // Points are transformed and distorted in structure-of-arrays
+  // layout, such that Eigen's packet math can vectorize the inner
+  // loops with whatever instruction set (SSE, AVX, NEON) the
+  // compiler targets. The single-point version runs through
+  // the same code path, so graph factors, error statistics and
+  // the initial pose checks all agree on the projection.
+  //
+  class Projector {
+  public:
+    typedef Eigen::Matrix<double, 2, 6> Matrix26;
+    typedef std::vector<Matrix26, Eigen::aligned_allocator<Matrix26>> Matrix26Vec;
+    typedef boost::shared_ptr<Projector> ProjectorPtr;
+    typedef boost::shared_ptr<const Projector> ProjectorConstPtr;
+    virtual ~Projector() {}
+    //
+    // Creates projector for distortion model distModel,
+    // K = [fx, fy, cx, cy], D = distortion coefficients (up to 5).
+    // Throws if the distortion model is unknown.
+    //
+    static ProjectorPtr make(const std::string &distModel,
+                             const std::vector<double> &K,
+                             const std::vector<double> &D);
+    //
+    // Projects world points wp into the image, given the
+    // world-to-camera transform T_c_w. If H is non-null, it receives
+    // for each point the 2x6 jacobian with respect to a perturbation
+    // xi = (omega, v) that is multiplied from the left: exp(xi) * T_c_w
+    //
+    virtual void project(const gtsam::Pose3 &T_c_w,
+                         const std::vector<gtsam::Point3> &wp,
+                         std::vector<gtsam::Point2> *ip,
+                         Matrix26Vec *H = NULL) const = 0;
+    //
+    // Projects a point X_c given in camera coordinates. Signature
+    // is such that it can be used directly in gtsam expressions.
+    //
+    // Points at or behind the camera plane (z <= 0) cannot be seen.
+    // Here and in project() their image coordinates are NaN, check
+    // with is_projected().
+    //
+    virtual gtsam::Point2 projectPoint(const gtsam::Point3 &X_c,
+                                       gtsam::OptionalJacobian<2, 3> H =
+                                       boost::none) const = 0;
+    //
+    // Maps undistorted normalized coordinates to distorted
+    // normalized coordinates, with optional 2x2 jacobian.
+    //
+    virtual gtsam::Point2 distort(const gtsam::Point2 &xn,
+                                  gtsam::OptionalJacobian<2, 2> H =
+                                  boost::none) const = 0;
+    virtual const char *getModelName() const = 0;
+    static bool is_projected(const gtsam::Point2 &uv) {
+      return (std::isfinite(uv.x()) && std::isfinite(uv.y())); }
+    //
+    // average pixel distance between projected wp and ip
+    //
+    double reprojectionError(const gtsam::Pose3 &T_c_w,
+                             const std::vector<gtsam::Point3> &wp,
+                             const std::vector<gtsam::Point2> &ip) const;
+    //
+    // Makes gtsam expression that projects the camera-frame
+    // point X_c into the image. Used by the graph factors. Like
+    // gtsam's own camera projection, it throws CheiralityException
+    // for points behind the camera.
+    //
+    static gtsam::Expression<gtsam::Point2>
+    make_expression(const ProjectorConstPtr &proj,
+                    const gtsam::Expression<gtsam::Point3> &X_c);
+
+    double fx() const { return (fx_); }
+    double fy() const { return (fy_); }
+    double cx() const { return (cx_); }
+    double cy() const { return (cy_); }
+    const double *getDistortion() const { return (k_); }
+  protected:
+    Projector(const std::vector<double> &K, const std::vector<double> &D);
+    // ------------ variables
+    double fx_, fy_, cx_, cy_;
+    double k_[5]{0, 0, 0, 0, 0};
+  };
+  using ProjectorPtr = Projector::ProjectorPtr;
+  using ProjectorConstPtr = Projector::ProjectorConstPtr;
+
+  template <class Model>
+  class ProjectorT : public Projector {
+  public:
+    ProjectorT(const std::vector<double> &K, const std::vector<double> &D) :
+      Projector(K, D) {
+      for (size_t i = Model::MAX_COEFF; i < D.size(); i++) {
+        if (D[i] != 0) {
+          throw std::runtime_error(std::string("too many dist coeff for ") +
+                                   Model::name());
+        }
+      }
+    }
+    void project(const gtsam::Pose3 &T_c_w,
+                 const std::vector<gtsam::Point3> &wp,
+                 std::vector<gtsam::Point2> *ip,
+                 Matrix26Vec *H = NULL) const override;
+    gtsam::Point2 projectPoint(const gtsam::Point3 &X_c,
+                               gtsam::OptionalJacobian<2, 3> H =
+                               boost::none) const override;
+    gtsam::Point2 distort(const gtsam::Point2 &xn,
+                          gtsam::OptionalJacobian<2, 2> H =
+                          boost::none) const override;
+    const char *getModelName() const override { return (Model::name()); }
+  private:
+    // J (if non-null) points to 6 arrays that receive the
+    // row-major 2x3 jacobian d(u,v)/d(x,y,z)
+    template <typename A>
+    void projectSoA(const A &x, const A &y, const A &z,
+                    A *u, A *v, A *J) const;
+  };
+}
+
+#endif
@@ -0,0 +1,70 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_RESECTION_SOLVER_H
+#define TAGSLAM_RESECTION_SOLVER_H
+
+#include "tagslam/projector.h"
+#include "tagslam/pose_estimate.h"
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/geometry/Point2.h>
+#include <gtsam/geometry/Point3.h>
+#include <vector>
+
+namespace tagslam {
+  //
+  // Damped Gauss-Newton solver for a single 6-DoF pose T, given
+  // points X that are observed by one or more cameras as
+  //
+  //     X_c = T_c_x * T * X
+  //
+  // The 6x6 normal equations are fixed size and live on the stack,
+  // jacobians come analytically from the camera's projector. The
+  // observations are stored once, so repeated solves from different
+  // starting poses do not allocate.
+  //
+  class ResectionSolver {
+  public:
+    // adds points X with image coordinates ip, seen by a camera
+    // with projector proj and fixed transform T_c_x
+    void addObservations(const ProjectorConstPtr &proj,
+                         const gtsam::Pose3 &T_c_x,
+                         const std::vector<gtsam::Point3> &X,
+                         const std::vector<gtsam::Point2> &ip);
+    //
+    // Optimizes T, starting from startPose. The error of the
+    // returned estimate is 0.5 * (sum of squared pixel errors) / (num
+    // points), which is what a gtsam graph with unit pixel noise
+    // reports as error per factor. If the solve fails, the
+    // estimate is invalid.
+    //
+    PoseEstimate solve(const gtsam::Pose3 &startPose,
+                       int maxIter = 100) const;
+    // error of pose T in the same metric as solve(), no optimization
+    PoseEstimate evaluate(const gtsam::Pose3 &T) const;
+    // true if all points are in front of their cameras at pose T.
+    // Poses that fail this have infinite error and are never
+    // returned as valid by solve().
+    bool isInFront(const gtsam::Pose3 &T) const;
+    size_t size() const { return (X_.size()); }
+    const std::vector<gtsam::Point2> &getImagePoints() const { return (ip_); }
+  private:
+    struct Block {
+      ProjectorConstPtr proj;
+      gtsam::Pose3      T_c_x;
+      size_t            begin;
+      size_t            end;
+    };
+    double error(const gtsam::Pose3 &T) const;
+    // computes J^T * J, J^T * r and error at T, returns false
+    // if any residual is not finite.
+    bool linearize(const gtsam::Pose3 &T, gtsam::Matrix6 *H,
+                   gtsam::Vector6 *g, double *err) const;
+    // ------------ variables
+    std::vector<Block>         blocks_;
+    std::vector<gtsam::Point3> X_;
+    std::vector<gtsam::Point2> ip_;
+  };
+}
+
+#endif
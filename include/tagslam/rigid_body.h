@@ -7,6 +7,7 @@
 
 #include "tagslam/pose_estimate.h"
 #include "tagslam/tag.h"
+#include "tagslam/motion_predictor.h"
 #include <apriltag_msgs/ApriltagArrayStamped.h>
 #include <map>
 #include <unordered_map>
@@ -66,7 +67,12 @@ namespace tagslam {
     CamToTagVec         observedTags;
     double              defaultTagSize{0};
     bool                hasPosePrior{false};
+    bool                fixKnownTagPoses{false}; // no graph variables for known tags
     std::set<int>       ignoreTags;
+    // Motion models for dynamic bodies, one per observing rig
+    // (see TagSlam::getFrameRig()), because separately
+    // synchronized rigs do not share a clock.
+    std::map<int, MotionPredictor> motion;
     // -------- static functions
     static RigidBodyPtr parse_body(const std::string &name,
                                    XmlRpc::XmlRpcValue bodyDefaults,
@@ -0,0 +1,114 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_SHM_MAP_H
+#define TAGSLAM_SHM_MAP_H
+
+#include "tagslam/map_snapshot.h"
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <cstdint>
+
+namespace tagslam {
+  //
+  // Shared memory link between the mapping process (server) and
+  // tracking clients on the same host. The segment holds:
+  //
+  //  - the static map, written by the server after each
+  //    optimization under a sequence lock: readers never block the
+  //    writer, and retry if the map changed while they copied it.
+  //  - a bounded multi-producer ring of detection frames that the
+  //    clients fill in place and the server drains.
+  //
+  // A client claims a ring slot, fills it and then publishes it.
+  // Should it die in between, the slot would block the ring for
+  // good, so the server drops a slot that stays claimed longer
+  // than a timeout. A client that is merely that slow loses its
+  // frame: publishing fails. The timeout must be well above the
+  // time it takes to fill a frame, else a client could still be
+  // writing when the slot comes around again.
+  //
+  // Everything in the segment is plain data of fixed size, there
+  // is no serialization.
+  //
+  namespace shm {
+    const uint32_t MAX_TAGS   = 1024;  // tags in map
+    const uint32_t MAX_BODIES = 64;    // static bodies in map
+    const uint32_t MAX_DETECTIONS = 128; // tags per detection frame
+    const uint32_t RING_SIZE  = 64;    // detection frames, power of 2
+    const uint32_t NAME_LEN   = 64;
+
+    struct PoseRecord {
+      int32_t id;              // tag id, -1 for bodies
+      char    name[NAME_LEN];  // body name, empty for tags
+      double  size;            // tag size, 0 for bodies
+      double  pose[12];        // rotation (row major), translation
+      double  covariance[36];  // gtsam order: rotation, translation
+    };
+    struct TagDetection {
+      int32_t id;
+      int32_t bits;
+      double  corners[8];      // u0, v0, u1, v1, ...
+    };
+    struct DetectionFrame {
+      uint32_t     camera;     // camera index in the server config
+      int64_t      stamp;      // nanoseconds
+      uint32_t     numTags;
+      TagDetection tags[MAX_DETECTIONS];
+    };
+    struct Segment;
+  }
+
+  class ShmMapServer {
+  public:
+    // creates the segment, replacing any stale one of the same name.
+    // staleSlotTimeout: seconds before an unpublished slot is dropped
+    explicit ShmMapServer(const std::string &name,
+                          double staleSlotTimeout = 1.0);
+    ~ShmMapServer();
+    ShmMapServer(const ShmMapServer&) = delete;
+    ShmMapServer& operator=(const ShmMapServer&) = delete;
+
+    void writeMap(const MapSnapshot &snap);
+    // calls func for the oldest pending detection frame,
+    // returns false if there is none
+    bool popDetections(const std::function<void(const shm::DetectionFrame &)> &func);
+    // number of slots dropped because a client never published them
+    uint64_t getNumStaleSlots() const { return (numStaleSlots_); }
+  private:
+    std::string                               name_;
+    boost::interprocess::shared_memory_object shm_;
+    boost::interprocess::mapped_region        region_;
+    shm::Segment                             *segment_{NULL};
+    std::chrono::duration<double>             staleSlotTimeout_;
+    uint64_t                                  claimedPos_{UINT64_MAX};
+    std::chrono::steady_clock::time_point     claimedSince_;
+    uint64_t                                  numStaleSlots_{0};
+  };
+
+  class ShmMapClient {
+  public:
+    // throws if the server has not created the segment yet
+    explicit ShmMapClient(const std::string &name);
+    ShmMapClient(const ShmMapClient&) = delete;
+    ShmMapClient& operator=(const ShmMapClient&) = delete;
+
+    // copies the latest map, returns false if none has been written
+    bool readMap(MapSnapshot *snap) const;
+    // map version, changes whenever the server writes a new map
+    uint64_t getMapVersion() const;
+    // func fills the frame in place, returns false if the ring is
+    // full, or if the server dropped the slot because func took
+    // longer than the stale slot timeout
+    bool pushDetections(const std::function<void(shm::DetectionFrame *)> &func);
+  private:
+    boost::interprocess::shared_memory_object shm_;
+    boost::interprocess::mapped_region        region_;
+    shm::Segment                             *segment_{NULL};
+  };
+}
+
+#endif
@@ -0,0 +1,55 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#ifndef TAGSLAM_SHM_TRACKING_CLIENT_H
+#define TAGSLAM_SHM_TRACKING_CLIENT_H
+
+#include "tagslam/shm_map.h"
+#include "tagslam/camera.h"
+#include "tagslam/initial_pose_graph.h"
+#include "tagslam/pose_estimate.h"
+#include <ros/ros.h>
+#include <apriltag_msgs/ApriltagArrayStamped.h>
+#include <memory>
+#include <string>
+
+namespace tagslam {
+  //
+  // Lightweight tracker for one camera that runs in its own process.
+  // It forwards the camera's tag detections to the mapping process
+  // through shared memory, and localizes the camera against the
+  // latest map found there.
+  //
+  class ShmTrackingClient {
+  public:
+    ShmTrackingClient(const ros::NodeHandle &pnh);
+    ShmTrackingClient(const ShmTrackingClient&) = delete;
+    ShmTrackingClient& operator=(const ShmTrackingClient&) = delete;
+
+    bool initialize();
+
+  private:
+    typedef apriltag_msgs::ApriltagArrayStamped TagArray;
+    void callback(const TagArray::ConstPtr &msg);
+    bool connect();
+    void forwardDetections(const TagArray &msg);
+    void localize(const TagArray &msg);
+    // ------------ variables
+    ros::NodeHandle               nh_;
+    ros::Subscriber               sub_;
+    ros::Publisher                odomPub_;
+    std::string                   shmName_;
+    std::string                   fixedFrame_;
+    std::unique_ptr<ShmMapClient> client_;
+    CameraPtr                     camera_;
+    unsigned int                  cameraIndex_{0};
+    MapSnapshot                   map_;
+    uint64_t                      mapVersion_{0};
+    InitialPoseGraph              poseGraph_;
+    PoseEstimate                  lastPose_; // T_w_c
+    unsigned int                  numDropped_{0};
+  };
+}
+
+#endif
@@ -0,0 +1,93 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_SMART_TAG_FACTOR_H
+#define TAGSLAM_SMART_TAG_FACTOR_H
+
+#include "tagslam/projector.h"
+#include <gtsam/nonlinear/NonlinearFactor.h>
+#include <gtsam/nonlinear/Values.h>
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/geometry/Point2.h>
+#include <gtsam/geometry/Point3.h>
+#include <boost/shared_ptr.hpp>
+#include <vector>
+
+namespace tagslam {
+  //
+  // Factor for all observations of a single tag, in the spirit of
+  // gtsam's SmartProjectionFactor: the tag pose T_b_o is not a
+  // variable in the graph. Instead, it is triangulated from the
+  // current rig, camera and body poses whenever the factor is
+  // evaluated, and eliminated from the linearized system with a
+  // Schur complement. The resulting Hessian factor only connects
+  // the rig, camera and body poses that observed the tag.
+  //
+  // Each observation predicts the tag corners as
+  //
+  //     X_c = T_r_c^-1 * T_w_r^-1 * T_w_b * T_b_o * X_o
+  //
+  // Repeated static observations (all keys frame-independent) are
+  // folded into one with averaged corners and a weight, like the
+  // aggregated projection factors. Of the frame-dependent ones only
+  // the most recent maxDynamicObs are kept.
+  //
+  // Evaluation does not modify the factor: triangulation always
+  // starts from the pose given at construction.
+  //
+  class SmartTagFactor : public gtsam::NonlinearFactor {
+  public:
+    typedef boost::shared_ptr<SmartTagFactor> shared_ptr;
+    // objCorners: tag corners in tag coordinates, sigma: pixel noise,
+    // T_b_o: starting point for triangulation
+    SmartTagFactor(const std::vector<gtsam::Point3> &objCorners,
+                   double sigma, const gtsam::Pose3 &T_b_o,
+                   size_t maxDynamicObs = 50);
+    // copy of factor f, with new starting point for triangulation
+    SmartTagFactor(const SmartTagFactor &f, const gtsam::Pose3 &T_b_o);
+
+    void addObservation(const ProjectorConstPtr &proj,
+                        gtsam::Key T_w_r, gtsam::Key T_r_c,
+                        gtsam::Key T_w_b, bool isStatic,
+                        const std::vector<gtsam::Point2> &measured);
+    // True if f has the same observations, up to small changes of
+    // the static averages: no corner moved more than pixTol and no
+    // count grew by more than a factor countTol.
+    bool isSimilar(const SmartTagFactor &f, double pixTol,
+                   double countTol) const;
+    // tag pose that best explains the observations, given values
+    gtsam::Pose3 triangulate(const gtsam::Values &values) const;
+    const gtsam::Pose3 &getStartPose() const { return (T_b_o_); }
+
+    double error(const gtsam::Values &values) const override;
+    size_t dim() const override {
+      return (2 * X_o_.size() * obs_.size()); }
+    boost::shared_ptr<gtsam::GaussianFactor>
+    linearize(const gtsam::Values &values) const override;
+    gtsam::NonlinearFactor::shared_ptr clone() const override {
+      return (boost::make_shared<SmartTagFactor>(*this)); }
+  private:
+    struct Observation {
+      ProjectorConstPtr proj;
+      gtsam::Key T_w_r;
+      gtsam::Key T_r_c;
+      gtsam::Key T_w_b;
+      size_t idx_w_r; // index into keys_
+      size_t idx_r_c;
+      size_t idx_w_b;
+      bool isStatic;
+      unsigned int count; // number of observations averaged
+      std::vector<gtsam::Point2> measured;
+    };
+    void updateKeys();
+    // ------------ variables
+    std::vector<gtsam::Point3> X_o_;
+    std::vector<Observation>   obs_;
+    double                     sigma_;
+    gtsam::Pose3               T_b_o_;
+    size_t                     maxDynamicObs_;
+  };
+  using SmartTagFactorPtr = SmartTagFactor::shared_ptr;
+}
+
+#endif
@@ -6,6 +6,9 @@
 #define TAGSLAM_SYNC_AND_DETECT_H
 
 #include "tagslam/bag_sync.h"
+#include "tagslam/tag_tracker.h"
+#include "tagslam/bag_writer.h"
+#include "tagslam/profiler.h"
 #include <ros/ros.h>
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/CompressedImage.h>
@@ -31,17 +34,31 @@ namespace tagslam {
     bool initialize();
 
   private:
+    TagTracker::TagVec detect(const cv::Mat &grey);
+    TagTracker::TagVec detectTags(int cam, const cv::Mat &grey);
+    TagTracker::TagVec detectDecimated(int cam, const cv::Mat &grey);
+    void compareToFullResolution(int cam, const cv::Mat &grey,
+                                 const TagTracker::TagVec &tags);
+    void printDecimationBenchmark() const;
+    struct BayerPattern {
+      int       toGrey; // opencv conversion codes
+      int       toBGR;
+      cv::Point red;    // location within each 2x2 block
+      cv::Point blue;
+    };
+    static BayerPattern parse_bayer_pattern(const std::string &pattern);
+    void bayerToGrey(const cv::Mat &raw, cv::Mat *grey) const;
     void processImages(const std::vector<ImageConstPtr> &msgvec);
     void processCompressedImages(const std::vector<CompressedImageConstPtr> &msgvec);
     void processCVMat(const std::vector<std_msgs::Header> &headers,
                       const std::vector<cv::Mat> &grey,
                       const std::vector<cv::Mat> &imgs);
     void processBag(const std::string &fname);
+    void printProfile() const;
     template<typename T>
     void iterate_through_bag(
       const std::vector<std::string> &topics,
       rosbag::View *view,
-      rosbag::Bag *bag,
       const std::function<void(const std::vector<boost::shared_ptr<T const>> &)> &callback)
       {
       BagSync<T> sync(topics, callback);
@@ -59,15 +76,29 @@ namespace tagslam {
     // ----------------------------------------------------------
     ros::NodeHandle                     nh_;
     unsigned int                        fnum_{0};
-    rosbag::Bag                         outbag_;
+    BagWriter                           outbag_;
+    Profiler                            profiler_;
     std::vector<std::string>            tagTopics_;
     std::vector<std::string>            imageTopics_;
     std::vector<std::string>            imageOutputTopics_;
     bool                                imagesAreCompressed_{false};
     bool                                annotateImages_{false};
     int                                 maxFrameNumber_;
-    apriltag_ros::ApriltagDetector::Ptr detector_;
+    std::vector<apriltag_ros::ApriltagDetector::Ptr> detectors_; // per family
     std::string                         detectorType_;
+    BayerPattern                        bayerPattern_;
+    bool                                halfResolution_{false};
+    bool                                roiTracking_{false};
+    std::vector<TagTracker>             trackers_;
+    std::vector<int>                    decimation_; // per camera
+    bool                                benchmarkDecimation_{false};
+    struct DecimationStats {
+      unsigned int numFull{0};    // tags found at full resolution
+      unsigned int numFound{0};   // ... of which found with decimation
+      unsigned int numCorners{0};
+      double       cornerError{0}; // sum of corner distances [pixel]
+    };
+    std::vector<DecimationStats>        decimationStats_;
   };
 }
 
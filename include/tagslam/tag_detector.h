@@ -0,0 +1,51 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#ifndef TAGSLAM_TAG_DETECTOR_H
+#define TAGSLAM_TAG_DETECTOR_H
+
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <apriltag_ros/apriltag_detector.h>
+#include <string>
+#include <memory>
+#include <vector>
+
+namespace tagslam {
+  //
+  // Detects tags in the images of one camera and publishes them
+  // as shared pointer, so subscribers in the same nodelet manager
+  // get the detections without serialization.
+  //
+  class TagDetector {
+  public:
+    typedef apriltag_ros::ApriltagDetector::Ptr DetectorPtr;
+    TagDetector(const ros::NodeHandle &nh, const std::string &imageTopic,
+                const std::string &tagTopic, const std::string &detectorType,
+                const std::vector<std::string> &families, int borderWidth);
+    TagDetector(const TagDetector&) = delete;
+    TagDetector& operator=(const TagDetector&) = delete;
+    //
+    // Makes one detector per tag family ("36h11", "25h9", "16h5").
+    // The apriltag detectors have no way to share the quad search,
+    // so each family is a full detection pass, and the cost grows
+    // linearly with the number of families. Throws on an invalid
+    // detector type or family.
+    //
+    static std::vector<DetectorPtr>
+    make_detectors(const std::string &detectorType,
+                   const std::vector<std::string> &families,
+                   int borderWidth);
+  private:
+    void callback(const sensor_msgs::ImageConstPtr &img);
+    // ------------ variables
+    ros::NodeHandle                     nh_;
+    ros::Subscriber                     sub_;
+    ros::Publisher                      pub_;
+    std::vector<DetectorPtr>            detectors_; // per family
+  };
+  using TagDetectorPtr = std::shared_ptr<TagDetector>;
+}
+
+#endif
@@ -12,6 +12,7 @@
 #include "tagslam/rigid_body.h"
 #include "tagslam/pose_estimate.h"
 #include "tagslam/pose_noise.h"
+#include "tagslam/smart_tag_factor.h"
 #include <gtsam/nonlinear/Values.h>
 #include <gtsam/nonlinear/ISAM2.h>
 #include <gtsam/inference/Symbol.h>
@@ -19,6 +20,7 @@
 #include <gtsam/nonlinear/ExpressionFactorGraph.h>
 #include <opencv2/core/core.hpp>
 #include <map>
+#include <tuple>
 #include <vector>
 #include <memory>
 #include <string>
@@ -35,6 +37,11 @@ namespace tagslam {
     double getError() { return (optimizerError_); }
     int    getIterations() { return (optimizerIterations_); }
     void   setPixelNoise(double numPix);
+    // eliminate the poses of tags without known pose from the
+    // graph, see SmartTagFactor. Must be set before adding tags.
+    void   setUseSmartTagFactors(bool b) { useSmartTagFactors_ = b; }
+    // window size for frame-dependent observations of a smart tag
+    void   setSmartTagMaxObservations(size_t n) { smartTagMaxObs_ = n; }
 
     void addTags(const RigidBodyPtr &rb, const TagVec &tags);
     void addCamera(const CameraConstPtr &cam);
@@ -52,9 +59,23 @@ namespace tagslam {
                       unsigned int frame_num);
     void optimize();
     void computeMarginals();
+    // Marginal covariances of T_w_b for a static body and of T_b_o
+    // for a tag, computed from isam on each call. Zero for fixed
+    // and smart tags, and for variables not yet optimized.
+    gtsam::Matrix6 getStaticBodyCovariance(const RigidBodyConstPtr &rb) const;
+    gtsam::Matrix6 getTagCovariance(int tagId) const;
 
     PoseEstimate getCameraPose(const CameraPtr &cam) const;
-    bool getTagRelPose(const RigidBodyPtr &rb, int tagId,
+    bool hasCameraPose(const CameraConstPtr &cam) const;
+    size_t getNumValues() const { return (values_.size()); }
+    // size of isam's factor graph, including empty slots
+    size_t getNumFactorSlots() const {
+      return (graph_.getFactorsUnsafe().size()); }
+    // grows whenever tags, bodies or cameras are added, including
+    // tags that have no variable (smart and fixed tags)
+    size_t getNumObjects() const {
+      return (values_.size() + smartTags_.size() + fixedTagPoses_.size()); }
+    bool getTagRelPose(const RigidBodyConstPtr &rb, int tagId,
                        gtsam::Pose3 *pose) const;
     unsigned int  getMaxNumBodies() const;
     
@@ -78,6 +99,36 @@ namespace tagslam {
                         unsigned int frame_num);
 
   private:
+    // factor that gets replaced whenever new observations arrive
+    struct ReplaceableFactor {
+      bool          isPending{false}; // factor is in newGraph_ but not in isam
+      bool          isInGraph{false}; // factor is in isam
+      size_t        newGraphIndex{0}; // valid while pending
+      size_t        factorIndex{0};   // index in isam, valid if in graph
+    };
+    // key for repeated observations: camera index, tag id, corner
+    typedef std::tuple<int, int, int> ObsKey;
+    struct AggregatedObservation: public ReplaceableFactor {
+      gtsam::Point2 mean{0, 0};
+      unsigned int  count{0};
+    };
+    struct SmartTag: public ReplaceableFactor {
+      SmartTagFactorPtr factor;
+      SmartTagFactorPtr updated; // new observations, not yet in the graph
+    };
+    // replaces the smart tag factors whose observations changed
+    void flushSmartTags();
+    void replaceFactor(ReplaceableFactor *rf,
+                       const gtsam::NonlinearFactor::shared_ptr &factor);
+    // tag pose T_b_o, either from the graph or a fixed one
+    bool hasTagPose(int tagId) const;
+    bool getTagPose(int tagId, gtsam::Pose3 *T_b_o) const;
+    gtsam::Matrix6 getMarginalCovariance(const gtsam::Symbol &sym) const;
+    bool hasTagPoseExpression(int tagId) const;
+    gtsam::Expression<gtsam::Pose3> tagPoseExpression(int tagId) const;
+    void aggregateObservation(const ObsKey &key,
+                              const gtsam::Expression<gtsam::Point2> &predict,
+                              const gtsam::Point2 &measured);
     bool findInitialTagPose(const Tag &tag, gtsam::Pose3 *pose,
                             PoseNoise *noise) const;
     double tryOptimization(gtsam::Values *result,
@@ -95,6 +146,14 @@ namespace tagslam {
     std::map<gtsam::Symbol, gtsam::Matrix> covariances_;
     gtsam::ExpressionFactorGraph  newGraph_;
     gtsam::Values                 newValues_;
+    std::map<ObsKey, AggregatedObservation> aggregatedObs_;
+    std::map<int, gtsam::Pose3>   fixedTagPoses_; // known tags without variable
+    std::map<int, SmartTag>       smartTags_;
+    mutable std::map<int, gtsam::Pose3> smartTagPoses_; // cache, cleared by optimize()
+    bool                          useSmartTagFactors_{false};
+    size_t                        smartTagMaxObs_{50};
+    std::vector<ReplaceableFactor *> pendingFactors_;
+    gtsam::FastVector<size_t>     factorsToRemove_;
   };
 }
 
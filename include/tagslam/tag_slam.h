@@ -11,18 +11,32 @@
 #include "tagslam/distance_measurement.h"
 #include "tagslam/position_measurement.h"
 #include "tagslam/initial_pose_graph.h"
+#include "tagslam/resection_solver.h"
 #include "tagslam/profiler.h"
+#include "tagslam/back_end.h"
+#include "tagslam/work_queue.h"
+#include "tagslam/deadline.h"
+#include "tagslam/frame_queue.h"
+#include "tagslam/map_snapshot.h"
+#include "tagslam/shm_map.h"
+#include <tagslam/GetMap.h>
 #include <ros/ros.h>
 #include <tf/transform_broadcaster.h>
+#include <tf2_ros/static_transform_broadcaster.h>
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/CompressedImage.h>
 #include <apriltag_msgs/ApriltagArrayStamped.h>
 #include <message_filters/time_synchronizer.h>
 #include <message_filters/subscriber.h>
 #include <message_filters/sync_policies/approximate_time.h>
+#include <algorithm>
+#include <functional>
 #include <vector>
+#include <list>
+#include <future>
 #include <memory>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <unordered_map>
@@ -57,35 +71,49 @@ namespace tagslam {
     TagSlam& operator=(const TagSlam&) = delete;
 
     bool initialize();
-    void callback1(TagArrayConstPtr const &tag0);
-    void callback2(TagArrayConstPtr const &tag0,
+    // with bag_file set, initialize() plays the whole bag
+    // and nothing is left to do afterwards
+    bool isBagMode() const { return (!bagFile_.empty()); }
+    // Latest static map. Never blocks, can be called from
+    // any thread, and the snapshot stays valid while held.
+    MapSnapshotConstPtr getMapSnapshot() const;
+    // group: index of the sync group the cameras belong to
+    void callback1(unsigned int group, TagArrayConstPtr const &tag0);
+    void callback2(unsigned int group,
+                   TagArrayConstPtr const &tag0,
                    TagArrayConstPtr const &tag1);
-    void callback3(TagArrayConstPtr const &tag0,
+    void callback3(unsigned int group,
+                   TagArrayConstPtr const &tag0,
                    TagArrayConstPtr const &tag1,
                    TagArrayConstPtr const &tag2);
-    void callback4(TagArrayConstPtr const &tag0,
+    void callback4(unsigned int group,
+                   TagArrayConstPtr const &tag0,
                    TagArrayConstPtr const &tag1,
                    TagArrayConstPtr const &tag2,
                    TagArrayConstPtr const &tag3);
-    void callback5(TagArrayConstPtr const &tag0,
+    void callback5(unsigned int group,
+                   TagArrayConstPtr const &tag0,
                    TagArrayConstPtr const &tag1,
                    TagArrayConstPtr const &tag2,
                    TagArrayConstPtr const &tag3,
                    TagArrayConstPtr const &tag4);
-    void callback6(TagArrayConstPtr const &tag0,
+    void callback6(unsigned int group,
+                   TagArrayConstPtr const &tag0,
                    TagArrayConstPtr const &tag1,
                    TagArrayConstPtr const &tag2,
                    TagArrayConstPtr const &tag3,
                    TagArrayConstPtr const &tag4,
                    TagArrayConstPtr const &tag5);
-    void callback7(TagArrayConstPtr const &tag0,
+    void callback7(unsigned int group,
+                   TagArrayConstPtr const &tag0,
                    TagArrayConstPtr const &tag1,
                    TagArrayConstPtr const &tag2,
                    TagArrayConstPtr const &tag3,
                    TagArrayConstPtr const &tag4,
                    TagArrayConstPtr const &tag5,
                    TagArrayConstPtr const &tag6);
-    void callback8(TagArrayConstPtr const &tag0,
+    void callback8(unsigned int group,
+                   TagArrayConstPtr const &tag0,
                    TagArrayConstPtr const &tag1,
                    TagArrayConstPtr const &tag2,
                    TagArrayConstPtr const &tag3,
@@ -106,13 +134,37 @@ namespace tagslam {
       std::string  frame_id;
     };
     void processTags(const std::vector<TagArrayConstPtr> &msgvec);
+    // index of the rig whose cameras delivered the frame,
+    // -1 if cameras of several rigs were synchronized together
+    int  getFrameRig(const std::vector<TagArrayConstPtr> &msgvec) const;
+    // live frames go through the input queue if there is one
+    void handleFrame(unsigned int group,
+                     const std::vector<TagArrayConstPtr> &msgvec);
+    void processQueuedFrame(const std::vector<TagArrayConstPtr> &msgvec);
     void processTagsAndImages(const std::vector<TagArrayConstPtr> &msgvec1,
                               const std::vector<ImageConstPtr> &msgvec2);
     void processTagsAndCompressedImages(const std::vector<TagArrayConstPtr> &msgvec1,
                                         const std::vector<CompressedImageConstPtr> &msgvec2);
 
     bool subscribe();
+    bool subscribeGroup(const std::vector<int> &cams);
+    // static bodies and their tags, captured on the front end
+    typedef std::vector<std::pair<RigidBodyConstPtr, TagVec>> MapLayout;
+    MapLayout getMapLayout() const;
+    MapSnapshotConstPtr makeMapSnapshot(const MapLayout &layout,
+                                        unsigned int frame,
+                                        const ros::Time &t) const;
+    void setMapSnapshot(const MapSnapshotConstPtr &snap);
+    void updateFrozenMapSnapshot();
+    void pollShmClients(const ros::TimerEvent &);
+    bool getMap(GetMap::Request &req, GetMap::Response &res);
+    // dynamic transforms are batched, static ones are
+    // only sent to /tf_static when they have changed
     void broadcastTransforms(const std::vector<PoseInfo> &poses);
+    void broadcastStaticTransforms(const std::vector<PoseInfo> &poses);
+    void sendTransforms();
+    const std::string &getBodyFrameId(const RigidBodyConstPtr &rb);
+    const std::string &getTagFrameId(int tagId);
     void broadcastBodyPoses(const ros::Time &t);
     void broadcastCameraPoses(const ros::Time &t);
     void broadcastTagPoses(const ros::Time &t);
@@ -130,25 +182,64 @@ namespace tagslam {
     PoseEstimate estimatePosePNP(int cam_idx,
                                  const std::vector<gtsam::Point3>&wpts,
                                  const std::vector<gtsam::Point2>&ipts) const;
+    // fallback: initial guess if pnp fails, defaults to
+    // the last known camera pose
     PoseEstimate poseFromPoints(int cam_idx,
                                 const std::vector<gtsam::Point3> &wp,
                                 const std::vector<gtsam::Point2> &ip,
-                                bool pointsArePlanar = false) const;
-    bool estimateTagPose(int cam_idx,
+                                bool pointsArePlanar = false,
+                                const Deadline &deadline = Deadline(),
+                                const PoseEstimate *fallback = NULL) const;
+    bool estimateTagPose(const gtsam::Pose3 &T_w_c,
                          const gtsam::Pose3 &bodyPose,
+                         const PoseEstimate &T_o_c,
                          const TagPtr &tag) const;
-    PoseEstimate estimateBodyPose(const RigidBodyConstPtr &rb) const;
+    // startPose (optional) returns the initial guess for T_w_b
+    PoseEstimate estimateBodyPose(const RigidBodyConstPtr &rb,
+                                  const Deadline &deadline = Deadline(),
+                                  gtsam::Pose3 *startPose = NULL) const;
+    void initializeStaticBody(const RigidBodyPtr &rb, const PoseEstimate &pe);
+    void deferTagPose(const RigidBodyPtr &rb, int cam_idx, const TagPtr &tag);
+    void deferStaticBodyPose(const RigidBodyPtr &rb,
+                             const gtsam::Pose3 &startPose);
+    void mergeDeferredInits();
+    // adds to the graph now, or once the back end is idle
+    void addTagsToGraph(const RigidBodyPtr &rb, const TagVec &tags);
+    void flushPendingTags();
+    // runs func on the init worker
+    std::future<PoseEstimate> submitDeferred(const std::function<PoseEstimate()> &func);
     void computeProjectionError();
     void runOptimizer();
     void finalize();
     PoseEstimate findCameraPose(int cam_idx, const RigidBodyConstVec &rigidBodies,
                                 bool inWorldFrame) const;
     PoseEstimate guessCameraWorldPose(unsigned int cam_idx) const;
+    PoseEstimate estimateRigPose(const RigidBodyConstPtr &rig,
+                                 const std::vector<int> &rigCams,
+                                 const RigidBodyConstVec &staticBodies) const;
+    void makeRigSolver(const RigidBodyConstPtr &rig,
+                       ResectionSolver *solver) const;
+    void makeBodySolver(const RigidBodyConstPtr &rb,
+                        ResectionSolver *solver) const;
+    bool isGoodPrediction(const ResectionSolver &solver,
+                          const gtsam::Pose3 &T) const;
+    void predictDynamicPoses(const ros::Time &t);
+    bool isKeyFrame(const ros::Time &t, size_t numObjectsBefore) const;
+    void trackNonKeyFrame(const ros::Time &t);
+    void optimizeOrTrack(const ros::Time &t, size_t numObjectsBefore);
+    void submitKeyFrame(const ros::Time &t);
+    bool mergeBackEndResult();
+    void publishRefinedPoses(unsigned int frame, const ros::Time &t);
+    void writeGraphResults();
+    void addObservationsToGraph();
+    bool checkFrozenMap() const;
     void findInitialCameraAndRigPoses();
     void findInitialBodyPoses();
     void findInitialDiscoveredTagPoses();
     std::vector<int> findCamerasWithKnownWorldPose() const;
-    void updatePosesFromGraph(unsigned int frame_num);
+    // t is used to update the motion models, unless zero
+    void updatePosesFromGraph(unsigned int frame_num,
+                              const ros::Time &t = ros::Time(0));
     void writeBodyPoses(const std::string &poseFile) const;
     void writeTagWorldPoses(const std::string &poseFile, unsigned int frameNum) const;
     void writeCameraPoses(const std::string &fname) const;
@@ -171,18 +262,34 @@ namespace tagslam {
     // ----------------------------------------------------------
     typedef message_filters::Subscriber<TagArray> TagSubscriber;
     typedef std::unordered_map<int, TagPtr>       IdToTagMap;
-    ros::Subscriber                               singleCamSub_;
     ros::Publisher                                clockPub_;
     std::vector<ros::Publisher>                   camOdomPub_;
     std::vector<ros::Publisher>                   bodyOdomPub_;
-    std::vector<std::shared_ptr<TagSubscriber>>   sub_;
-    std::unique_ptr<TimeSync2>                    approxSync2_;
-    std::unique_ptr<TimeSync3>                    approxSync3_;
-    std::unique_ptr<TimeSync4>                    approxSync4_;
-    std::unique_ptr<TimeSync5>                    approxSync5_;
-    std::unique_ptr<TimeSync6>                    approxSync6_;
-    std::unique_ptr<TimeSync7>                    approxSync7_;
-    std::unique_ptr<TimeSync8>                    approxSync8_;
+    std::vector<ros::Publisher>                   refinedBodyOdomPub_;
+    ros::Publisher                                queueDepthPub_;
+    ros::Publisher                                queueDropsPub_;
+    std::unique_ptr<FrameQueue>                   inputQueue_;
+    ros::ServiceServer                            mapService_;
+    MapSnapshotConstPtr                           mapSnapshot_{std::make_shared<MapSnapshot>()};
+    std::unique_ptr<ShmMapServer>                 shmServer_;
+    ros::Timer                                    shmTimer_;
+    // Cameras whose tag messages are time synchronized. Normally
+    // there is a single group, but rigs that run on their own
+    // clocks can be synchronized separately.
+    struct SyncGroup {
+      std::vector<int>                            cameras; // index into cameras_
+      ros::Subscriber                             singleCamSub;
+      std::vector<std::shared_ptr<TagSubscriber>> sub;
+      std::unique_ptr<TimeSync2>                  approxSync2;
+      std::unique_ptr<TimeSync3>                  approxSync3;
+      std::unique_ptr<TimeSync4>                  approxSync4;
+      std::unique_ptr<TimeSync5>                  approxSync5;
+      std::unique_ptr<TimeSync6>                  approxSync6;
+      std::unique_ptr<TimeSync7>                  approxSync7;
+      std::unique_ptr<TimeSync8>                  approxSync8;
+    };
+    std::vector<std::unique_ptr<SyncGroup>>       syncGroups_;
+    TagArrayConstPtr                              noTags_{new TagArray()};
     
     ros::NodeHandle                               nh_;
     CameraVec                                     cameras_;
@@ -203,7 +310,16 @@ namespace tagslam {
     bool                                          writeDebugImages_{false};
     bool                                          hasCompressedImages_{false};
     tf::TransformBroadcaster                      tfBroadcaster_;
+    tf2_ros::StaticTransformBroadcaster           staticTfBroadcaster_;
+    std::vector<tf::StampedTransform>             pendingTransforms_;
+    std::vector<geometry_msgs::TransformStamped>  pendingStaticTransforms_;
+    std::unordered_map<std::string, gtsam::Pose3> staticTransforms_; // by frame id
+    std::unordered_map<int, std::string>          bodyFrameIds_;
+    std::unordered_map<int, std::string>          tagFrameIds_;
+    double                                        staticTfTransThresh_{0.001};
+    double                                        staticTfRotThresh_{0.001};
     std::string                                   paramPrefix_;
+    std::string                                   bagFile_;
     std::string                                   bodyPosesOutFile_;
     std::string                                   tagWorldPosesOutFile_;
     std::string                                   cameraPosesOutFile_;
@@ -212,7 +328,54 @@ namespace tagslam {
     double                                        viewingAngleThreshold_;
     double                                        initBodyPoseMaxError_;
     double                                        maxInitErr_{0.02};
+    double                                        maxPredictedPixErr_{2.0};
+    double                                        keyFrameTransThresh_{0.02};
+    double                                        keyFrameRotThresh_{0.02};
+    double                                        keyFrameMaxTimeGap_{2.0};
+    unsigned int                                  lastKeyFrameNum_{0};
+    ros::Time                                     lastKeyFrameTime_{0};
+    std::map<int, ros::Time>                      rigKeyFrameTime_; // by frame rig
+    int                                           frameRig_{-1};
+    std::map<int, gtsam::Pose3>                   keyFramePoses_;
+    bool                                          localizationOnly_{false};
+    bool                                          asyncBackEnd_{false};
+    double                                        mapSnapshotInterval_{1.0};
+    ros::Time                                     lastMapSnapshotTime_{0};
+    MapSnapshotConstPtr                           refinedMap_; // from back end
+    unsigned int                                  numMergedResults_{0};
+    // Initializations that missed the per-frame deadline are
+    // finished in the background and merged in a later frame.
+    // They run one at a time on a single worker, at most
+    // maxDeferredInits_ are outstanding, and a tag or body whose
+    // deferred estimate failed is not deferred again for a while.
+    struct DeferredInit {
+      std::future<PoseEstimate>                   result;
+      std::function<void(const PoseEstimate &)>   merge;
+    };
+    struct DeferBackoff {
+      unsigned int numFailed{0};
+      unsigned int retryFrame{0}; // no deferral before this frame
+      bool canDefer(unsigned int frame) const { return (frame >= retryFrame); }
+      void failed(unsigned int frame) {
+        // wait 10, 20, 40 ... up to 640 frames
+        retryFrame = frame + (10u << std::min(numFailed++, 6u));
+      }
+    };
+    double                                        frameDeadline_{0};
+    Deadline                                      deadline_;
+    int                                           maxDeferredInits_{4};
+    std::list<DeferredInit>                       deferredInits_;
+    std::set<int>                                 deferredTags_;
+    std::set<int>                                 deferredBodies_;
+    std::map<int, DeferBackoff>                   tagBackoff_;  // by tag id
+    std::map<int, DeferBackoff>                   bodyBackoff_; // by body index
+    // tags waiting for the back end to release the graph
+    std::vector<std::pair<RigidBodyPtr, TagVec>>  pendingTags_;
+    std::mutex                                    graphMutex_;
     Profiler                                      profiler_;
+    // the workers use the members above, so they go last
+    WorkQueue                                     initWorker_;
+    BackEnd                                       backEnd_;
   };
 
 }
@@ -0,0 +1,44 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#ifndef TAGSLAM_TAG_TRACKER_H
+#define TAGSLAM_TAG_TRACKER_H
+
+#include <apriltag_msgs/Apriltag.h>
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+namespace tagslam {
+  //
+  // Predicts where the tags of one camera will be in the next frame
+  // (constant pixel velocity from the last two detections) so the
+  // detector can run on padded regions of interest instead of the
+  // full image. A full frame detection is requested every
+  // fullFrameInterval frames, and whenever a track is lost.
+  //
+  class TagTracker {
+  public:
+    typedef std::vector<apriltag_msgs::Apriltag> TagVec;
+    TagTracker(int fullFrameInterval = 10, double padding = 0.5,
+               int minPadding = 20);
+
+    bool needsFullFrame() const;
+    // non-overlapping regions around the predicted tags
+    std::vector<cv::Rect> predictRois(const cv::Size &imageSize) const;
+    void update(const TagVec &detections, bool wasFullFrame);
+    // moves detections in roi coordinates into image coordinates
+    static void shift(const cv::Point &offset, apriltag_msgs::Apriltag *tag);
+  private:
+    // ------------ variables
+    int     fullFrameInterval_;
+    double  padding_;    // relative to tag bounding box size
+    int     minPadding_; // pixels
+    TagVec  last_;
+    TagVec  previous_;
+    int     framesSinceFull_{0};
+    bool    lost_{true};
+  };
+}
+
+#endif
@@ -0,0 +1,54 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_UNDISTORTION_TABLE_H
+#define TAGSLAM_UNDISTORTION_TABLE_H
+
+#include "tagslam/projector.h"
+#include <gtsam/geometry/Point2.h>
+#include <boost/shared_ptr.hpp>
+#include <vector>
+
+namespace tagslam {
+  //
+  // Precomputed grid that maps pixel coordinates to undistorted
+  // normalized coordinates. The grid is built once at startup
+  // by inverting the projector's distortion model on every node.
+  // A lookup interpolates bilinearly between the four surrounding
+  // nodes and polishes the result with a few Newton steps, which
+  // is much cheaper than running the full iterative inversion.
+  //
+  class UndistortionTable {
+  public:
+    UndistortionTable(const ProjectorConstPtr &proj,
+                      int width, int height, int spacing = 8);
+    // Maps pixel pix to undistorted normalized coordinates xn.
+    // Returns false if the distortion model cannot be inverted there.
+    bool undistort(const gtsam::Point2 &pix, gtsam::Point2 *xn) const;
+    // batch version, returns false if any point fails
+    bool undistort(const std::vector<gtsam::Point2> &pix,
+                   std::vector<gtsam::Point2> *xn) const;
+
+    typedef boost::shared_ptr<UndistortionTable> UndistortionTablePtr;
+    typedef boost::shared_ptr<const UndistortionTable> UndistortionTableConstPtr;
+  private:
+    // pixel to distorted normalized coordinates
+    gtsam::Point2 toNormalized(const gtsam::Point2 &pix) const;
+    // Newton iteration starting from *xn, solves distort(xn) = xd
+    bool invert(const gtsam::Point2 &xd, gtsam::Point2 *xn,
+                int maxIter, double tol) const;
+    // bilinear interpolation of the grid, false if outside or invalid
+    bool interpolate(const gtsam::Point2 &pix, gtsam::Point2 *xn) const;
+    // ------------ variables
+    ProjectorConstPtr   proj_;
+    int                 spacing_{8};
+    int                 nx_{0};
+    int                 ny_{0};
+    std::vector<double> tx_; // NaN marks nodes where inversion failed
+    std::vector<double> ty_;
+  };
+  using UndistortionTablePtr = UndistortionTable::UndistortionTablePtr;
+  using UndistortionTableConstPtr = UndistortionTable::UndistortionTableConstPtr;
+}
+
+#endif
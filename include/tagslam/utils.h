@@ -4,6 +4,7 @@
 #ifndef TAGSLAM_UTILS_H
 #define TAGSLAM_UTILS_H
 
+#include "tagslam/undistortion_table.h"
 #include <gtsam/linear/NoiseModel.h>
 #include <gtsam/geometry/Point2.h>
 #include <gtsam/geometry/Point3.h>
@@ -21,8 +22,7 @@ namespace tagslam {
     bool get_init_pose(const std::vector<cv::Point3d> &world_points,
                        const std::vector<cv::Point2d> &image_points,
                        const cv::Mat &K,
-                       const std::string &distModel,
-                       const cv::Mat &D,
+                       const UndistortionTable &undist,
                        cv::Mat *rvec,
                        cv::Mat *tvec);
     //
@@ -31,32 +31,10 @@ namespace tagslam {
     bool get_init_pose_pnp(const std::vector<cv::Point3d> &world_points,
                            const std::vector<cv::Point2d> &image_points,
                            const cv::Mat &K,
-                           const std::string &distModel,
-                           const cv::Mat &D,
+                           const UndistortionTable &undist,
                            cv::Mat *rvec,
                            cv::Mat *tvec);
     //
-    // project points
-    //
-    void project_points(const std::vector<cv::Point3d> &wp,
-                        const cv::Mat &rvec,
-                        const cv::Mat &tvec,
-                        const cv::Mat &K,
-                        const std::string &distModel,
-                        const cv::Mat &D, 
-                        std::vector<cv::Point2d> *ip);
-    //
-    // reprojection error
-    //
-    double reprojection_error(const std::vector<cv::Point3d> &wp,
-                              const std::vector<cv::Point2d> &ip,
-                              const cv::Mat &rvec,
-                              const cv::Mat &tvec,
-                              const cv::Mat &K,
-                              const std::string &distModel,
-                              const cv::Mat &D);
-
-    //
     // returns the shorter side of the square into which
     // all pixels fall.
     //
@@ -0,0 +1,42 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+#ifndef TAGSLAM_WORK_QUEUE_H
+#define TAGSLAM_WORK_QUEUE_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+
+namespace tagslam {
+  //
+  // Single worker thread that runs queued jobs in order. Unlike
+  // the BackEnd, jobs can be pushed while one is running. On
+  // stop(), jobs that have not started yet are discarded.
+  //
+  class WorkQueue {
+  public:
+    typedef std::function<void()> Job;
+    WorkQueue() {}
+    ~WorkQueue();
+    WorkQueue(const WorkQueue&) = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+
+    void start();
+    void stop();
+    bool isRunning() const { return (thread_.joinable()); }
+    void push(const Job &job);
+  private:
+    void run();
+    // ------------ variables
+    std::thread                  thread_;
+    std::mutex                   mutex_;
+    std::condition_variable      cv_;
+    std::deque<Job>              jobs_;
+    bool                         keepRunning_{false};
+  };
+}
+
+#endif
@@ -0,0 +1,80 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/back_end.h"
+#include <stdexcept>
+
+namespace tagslam {
+  BackEnd::~BackEnd() {
+    stop();
+  }
+
+  void BackEnd::start() {
+    if (isRunning()) {
+      return;
+    }
+    keepRunning_ = true;
+    thread_ = std::thread(&BackEnd::run, this);
+  }
+
+  void BackEnd::stop() {
+    if (!isRunning()) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      keepRunning_ = false;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  bool BackEnd::isBusy() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return (busy_);
+  }
+
+  unsigned int BackEnd::getNumCompleted() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return (numCompleted_);
+  }
+
+  void BackEnd::submit(const Job &job) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (busy_) {
+        throw std::runtime_error("back end job submitted while busy!");
+      }
+      job_  = job;
+      busy_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  void BackEnd::waitUntilIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return (!busy_); });
+  }
+
+  void BackEnd::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return (busy_ || !keepRunning_); });
+      if (busy_) {
+        // run the job without holding the lock, so the
+        // front end can poll isBusy()
+        Job job;
+        job.swap(job_);
+        lock.unlock();
+        job();
+        lock.lock();
+        busy_ = false;
+        numCompleted_++;
+        cv_.notify_all();
+      } else if (!keepRunning_) {
+        break;
+      }
+    }
+  }
+}  // namespace
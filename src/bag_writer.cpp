@@ -0,0 +1,80 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/bag_writer.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace tagslam {
+  BagWriter::BagWriter(size_t maxQueueSize) :
+    maxQueueSize_(std::max(maxQueueSize, (size_t) 1)) {
+  }
+
+  BagWriter::~BagWriter() {
+    close();
+  }
+
+  rosbag::compression::CompressionType
+  BagWriter::parse_compression(const std::string &name) {
+    if (name == "none") {
+      return (rosbag::compression::Uncompressed);
+    } else if (name == "lz4") {
+      return (rosbag::compression::LZ4);
+    } else if (name == "bz2") {
+      return (rosbag::compression::BZ2);
+    }
+    throw std::runtime_error("invalid bag compression: " + name);
+  }
+
+  void BagWriter::open(const std::string &fname,
+                       rosbag::compression::CompressionType compression) {
+    close();
+    bag_.open(fname, rosbag::bagmode::Write);
+    bag_.setCompression(compression);
+    keepRunning_ = true;
+    thread_ = std::thread(&BagWriter::run, this);
+  }
+
+  void BagWriter::close() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      keepRunning_ = false;
+    }
+    cv_.notify_all();
+    thread_.join();
+    bag_.close();
+  }
+
+  void BagWriter::push(const Write &w) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return (queue_.size() < maxQueueSize_); });
+      queue_.push_back(w);
+    }
+    cv_.notify_all();
+  }
+
+  void BagWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return (!queue_.empty() || !keepRunning_); });
+      if (queue_.empty()) {
+        break; // stopped, and everything has been written
+      }
+      std::deque<Write> batch;
+      batch.swap(queue_);
+      cv_.notify_all(); // room in the queue again
+      lock.unlock();
+      profiler_.reset();
+      for (const auto &w: batch) {
+        w(&bag_);
+      }
+      profiler_.record("bagWrite", batch.size());
+      lock.lock();
+    }
+  }
+}  // namespace
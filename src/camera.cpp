@@ -123,6 +123,7 @@ namespace tagslam {
       if (!nh.getParam(cam + "/resolution",  ci.resolution)) { bombout("resolution", cam); }
       if (!nh.getParam(cam + "/rostopic",  camera->rostopic)) { bombout("rostopic", cam); }
       nh.param<std::string>(cam + "/tagtopic",  camera->tagtopic, "");
+      nh.param<bool>(cam + "/shm_client", camera->isShmClient, false);
       if (!nh.getParam(cam + "/rig_body", camera->rig_body)) {  bombout("rig_body", cam); }
       nh.getParam(cam + "/frame_id", camera->frame_id);
       if (parse_camera_pose(camera, nh))  {
@@ -142,21 +143,16 @@ namespace tagslam {
         ci.D.at<double>(i) = D[i];
       }
       cdv.push_back(camera);
-      double dc[4] = {0, 0, 0, 0};
-      for (const auto i: irange(0ul, D.size())) {
-        dc[i] = D[i];
-      }
-      if (ci.distortion_model == "radtan" ||
-          ci.distortion_model == "plumb_bob") {
-        camera->radtanModel.reset(
-          new gtsam::Cal3DS2(K[0], K[1], 0.0, K[2], K[3],
-                             dc[0], dc[1], dc[2], dc[3]));
-      } else if (ci.distortion_model == "equidistant") {
-        camera->equidistantModel.reset(new Cal3FS2(K[0], K[1], K[2], K[3],
-                                                   dc[0], dc[1], dc[2], dc[3]));
-      } else {
-        bombout("unknown distortion model", cam);
+      // the camera model is selected here once and for all
+      camera->projector = Projector::make(ci.distortion_model, K, D);
+      if (ci.resolution.size() != 2) {
+        bombout("resolution with 2 entries", cam);
       }
+      int lutSpacing;
+      nh.param<int>(cam + "/undistortion_table_spacing", lutSpacing, 8);
+      camera->undistortionTable.reset(
+        new UndistortionTable(camera->projector, ci.resolution[0],
+                              ci.resolution[1], lutSpacing));
     }
     return (cdv);
   }
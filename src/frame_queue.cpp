@@ -0,0 +1,147 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/frame_queue.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace tagslam {
+  FrameQueue::FrameQueue(Policy policy, size_t maxDepth, double keepInterval) :
+    policy_(policy), maxDepth_(std::max(maxDepth, (size_t) 1)),
+    keepInterval_(keepInterval) {
+  }
+
+  FrameQueue::~FrameQueue() {
+    stop();
+  }
+
+  FrameQueue::Policy FrameQueue::parse_policy(const std::string &name) {
+    if (name == "latest") {
+      return (LATEST);
+    } else if (name == "thin") {
+      return (THIN);
+    }
+    throw std::runtime_error("invalid input queue policy: " + name);
+  }
+
+  void FrameQueue::start(const Callback &cb) {
+    if (thread_.joinable()) {
+      return;
+    }
+    callback_ = cb;
+    keepRunning_ = true;
+    thread_ = std::thread(&FrameQueue::run, this);
+  }
+
+  void FrameQueue::stop() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      keepRunning_ = false;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  size_t FrameQueue::getDepth() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return (depth_);
+  }
+
+  unsigned int FrameQueue::getNumDropped() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return (numDropped_);
+  }
+
+  bool FrameQueue::isProtected(Source *src, const Frame &frame) {
+    bool hasNewTags(false);
+    ros::Time t(0);
+    for (const auto &msg: frame) {
+      if (msg->header.stamp > t) t = msg->header.stamp;
+      for (const auto &tag: msg->apriltags) {
+        hasNewTags = seenTags_.insert(tag.id).second || hasNewTags;
+      }
+    }
+    // sources may run on different clocks, so the
+    // keep interval is tracked per source
+    if (hasNewTags || (t - src->lastProtectedTime).toSec() >= keepInterval_) {
+      src->lastProtectedTime = t;
+      return (true);
+    }
+    return (false);
+  }
+
+  void FrameQueue::dropOne(Source *src) {
+    // oldest unprotected frame goes first, and if there is
+    // none, the oldest frame altogether
+    auto &q = src->queue;
+    auto it = q.begin();
+    for (; it != q.end() && it->isProtected; ++it);
+    q.erase(it == q.end() ? q.begin() : it);
+    depth_--;
+    numDropped_++;
+  }
+
+  void FrameQueue::push(const Frame &frame, unsigned int source) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      Source &src = sources_[source];
+      Entry e;
+      e.frame = frame;
+      if (policy_ == LATEST) {
+        numDropped_ += src.queue.size();
+        depth_ -= src.queue.size();
+        src.queue.clear();
+      } else {
+        e.isProtected = isProtected(&src, frame);
+      }
+      src.queue.push_back(e);
+      depth_++;
+      while (src.queue.size() > maxDepth_) {
+        dropOne(&src);
+      }
+    }
+    cv_.notify_all();
+  }
+
+  bool FrameQueue::popNext(Frame *frame) {
+    // first non-empty source at or after the one
+    // that is next in turn
+    auto it = sources_.lower_bound(nextSource_);
+    for (size_t i = 0; i < sources_.size(); i++, ++it) {
+      if (it == sources_.end()) {
+        it = sources_.begin();
+      }
+      if (!it->second.queue.empty()) {
+        frame->swap(it->second.queue.front().frame);
+        it->second.queue.pop_front();
+        depth_--;
+        nextSource_ = it->first + 1;
+        return (true);
+      }
+    }
+    return (false);
+  }
+
+  void FrameQueue::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return (depth_ != 0 || !keepRunning_); });
+      if (!keepRunning_) {
+        break;
+      }
+      Frame frame;
+      if (!popNext(&frame)) {
+        continue;
+      }
+      // process without holding the lock, so the
+      // callbacks can keep pushing
+      lock.unlock();
+      callback_(frame);
+      lock.lock();
+    }
+  }
+}  // namespace
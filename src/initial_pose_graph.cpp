@@ -4,12 +4,7 @@
 
 #include "tagslam/initial_pose_graph.h"
 #include "tagslam/utils.h"
-#include "tagslam/resectioning_factor.h"
-#include "tagslam/cal3ds2u.h"
 #include <boost/range/irange.hpp>
-#include <gtsam/slam/expressions.h>
-#include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
-#include <gtsam/nonlinear/ExpressionFactorGraph.h>
 #include <boost/random/normal_distribution.hpp>
 #include <boost/random/variate_generator.hpp>
 #include <boost/random/mersenne_twister.hpp>
@@ -40,39 +35,6 @@ namespace tagslam {
   }
 #endif  
 
-  static PoseEstimate try_optimization(const gtsam::Pose3 &startPose,
-                                       const gtsam::Values &startValues,
-                                       gtsam::NonlinearFactorGraph *graph) {
-    gtsam::Symbol P = gtsam::Symbol('P', 0); // pose symbol
-    gtsam::Values                 values = startValues;
-    gtsam::Values                 optimizedValues;
-    const int MAX_ITER = 100;
-    values.insert(P, startPose);
-    try {
-      // if the starting pose is bad (e.g. the camera is in the
-      // plane of the world points), then the optimizer will
-      // encounter NaNs and get stuck in an infinite loop.
-      // That's why we test here first if the error is reasonable.
-      if (!std::isnormal(graph->error(values))) {
-        throw (std::runtime_error("bad starting guess"));
-      }
-      gtsam::LevenbergMarquardtParams lmp;
-      lmp.setVerbosity("SILENT");
-      lmp.setMaxIterations(MAX_ITER);
-      lmp.setAbsoluteErrorTol(1e-7);
-      lmp.setRelativeErrorTol(0);
-      gtsam::LevenbergMarquardtOptimizer lmo(*graph, values, lmp);
-
-      optimizedValues = lmo.optimize();
-      gtsam::Pose3 op = optimizedValues.at<gtsam::Pose3>(P);
-      return (PoseEstimate(op, (double)lmo.error() / graph->size(),
-                           (int)lmo.iterations()));
-    } catch (const std::exception &e) {
-      // bombed out because of cheirality etc
-    }
-    return (PoseEstimate(startPose, 1e10, MAX_ITER));
-  }
-
 #if 0  
   static void analyze_pose(const CameraVec &cams,
                            const ImageVec &imgs,
@@ -93,7 +55,7 @@ namespace tagslam {
         continue;
       }
       
-      gtsam::PinholeCamera<Cal3FS2> phc(cam->poseEstimate.getPose(), *cam->equidistantModel);
+      const gtsam::Pose3 T_c_w = cam->poseEstimate.getPose().inverse();
       std::vector<gtsam::Point3> bpts;
       std::vector<gtsam::Point3> wpts;
       std::vector<gtsam::Point2> ipts;
@@ -106,7 +68,7 @@ namespace tagslam {
       if (cam_idx < (int)imgs.size()) img = imgs[cam_idx];
       for (const auto i: irange(0ul, wpts.size())) {
         gtsam::Point3 wp  = wpts[i];
-        gtsam::Point2 icp = phc.project(wp);
+        gtsam::Point2 icp = cam->projector->projectPoint(T_c_w.transform_from(wp));
         gtsam::Point2 d = icp - ipts[i];
 
         std::cout << wpts[i].x() << "," << wpts[i].y() << "," << wpts[i].z() << ", " << ipts[i].x() << ", " << ipts[i].y() << ", " << icp.x() << ", " << icp.y() << ", " << d.x() << ", " << d.y() << ";" <<  std::endl;
@@ -132,28 +94,27 @@ namespace tagslam {
                                      unsigned int frameNum,
                                      const RigidBodyConstPtr &rb,
                                      const gtsam::Pose3 &initialPose,
-                                     double *errorLimit) const {
+                                     double *errorLimit,
+                                     const Deadline &deadline) const {
     //std::cout << "----------------- analysis of initial pose -----" << std::endl;
     //analyze_pose(cams, imgs, false, frameNum, rb, initialPose);
     PoseEstimate pe; // defaults to invalid
-    gtsam::ExpressionFactorGraph  graph;
+    ResectionSolver solver;
 #ifdef DEBUG_BODY_POSE
     std::cout << "estimating body pose from cameras: " << rb->observedTags.size() << std::endl;
     std::cout << "initial guess pose: " << std::endl;
     print_pose(initialPose);
 #endif    
     // loop through all tags on body
-    auto pixelNoise = gtsam::noiseModel::Isotropic::Sigma(2, 1.0);
-    gtsam::Pose3_  T_w_b('P', 0);
-    std::vector<gtsam::Point2> all_ip;
     for (const auto &tagMap: rb->observedTags) {
       int cam_idx = tagMap.first;
       const CameraPtr &cam = cams[cam_idx];
       if (!cam->poseEstimate.isValid()) {
         continue;
       }
-      gtsam::Pose3_ T_r_c  = cam->poseEstimate.getPose();
-      gtsam::Pose3_ T_w_r  = cam->rig->poseEstimate.getPose();
+      // X_c = T_c_r * T_r_w * T_w_b * X_b
+      const gtsam::Pose3 T_c_w =
+        (cam->rig->poseEstimate.getPose() * cam->poseEstimate.getPose()).inverse();
 #ifdef DEBUG_BODY_POSE
       std::cout << "camera " << cam_idx << " pose: " << std::endl;
       print_pose(cam->poseEstimate.getPose());
@@ -168,36 +129,17 @@ namespace tagslam {
       std::cout << "cam points: " << std::endl;
       std::cout << "pts=[" << std::endl;
 #endif      
-      for (const auto i: irange(0ul, bp.size())) {
-        gtsam::Point3_ p(bp[i]);
-        all_ip.push_back(ip[i]);
 #ifdef DEBUG_BODY_POSE
+      for (const auto i: irange(0ul, bp.size())) {
         std::cout << bp[i].x() << "," << bp[i].y() << "," << bp[i].z() << "," << ip[i].x() << ", " << ip[i].y() << ";" << std::endl;
-#endif        
-        //std::cout << "transform to camera: T_c_w= " << std::endl << cam->poseEstimate.getPose().inverse() << std::endl;
-        //std::cout << "transformed point: p: " << std::endl << cam->poseEstimate.getPose().inverse().transform_to(bp[i]) << std::endl;
-        // P_A = transform_from(T_AB, P_B)
-        //
-        // X_c = T_c_r * T_r_w * T_w_b * X_b
-        gtsam::Point2_ xp = gtsam::project(gtsam::transform_to(T_r_c, gtsam::transform_to(T_w_r, gtsam::transform_from(T_w_b, p))));
-        if (cam->radtanModel) {
-          gtsam::Expression<Cal3DS2U> cK(*cam->radtanModel);
-          gtsam::Point2_ predict(cK, &Cal3DS2U::uncalibrate, xp);
-          graph.addExpressionFactor(predict, ip[i], pixelNoise);
-        } else if (cam->equidistantModel) {
-          gtsam::Expression<Cal3FS2> cK(*cam->equidistantModel);
-          gtsam::Point2_ predict(cK, &Cal3FS2::uncalibrate, xp);
-          graph.addExpressionFactor(predict, ip[i], pixelNoise);
-        }
       }
+#endif        
+      solver.addObservations(cam->projector, T_c_w, bp, ip);
 #ifdef DEBUG_BODY_POSE
       std::cout << "];" << std::endl;
 #endif      
     }
-    gtsam::Values initialValues;
-    double pixelError = initRelPixErr_ * utils::get_pixel_range(all_ip);
-    pe = optimizeGraph(initialPose, initialValues, &graph, pixelError,
-                       errorLimit, std::vector<gtsam::Point3>());
+    pe = estimateBodyPose(solver, initialPose, errorLimit, deadline);
 #ifdef DEBUG_BODY_POSE    
     std::cout << "optimized graph pose T_w_b: " << std::endl;
     print_pose(pe.getPose());
@@ -208,6 +150,16 @@ namespace tagslam {
     return (pe);
   }
 
+  PoseEstimate
+  InitialPoseGraph::estimateBodyPose(const ResectionSolver &solver,
+                                     const gtsam::Pose3 &initialPose,
+                                     double *errorLimit,
+                                     const Deadline &deadline) const {
+    double pixelError = initRelPixErr_ *
+      utils::get_pixel_range(solver.getImagePoints());
+    return (optimizeGraph(initialPose, solver, pixelError,
+                          errorLimit, std::vector<gtsam::Point3>(), deadline));
+  }
   
   // returns T_w_c
   PoseEstimate
@@ -215,31 +167,20 @@ namespace tagslam {
                                        const std::vector<gtsam::Point3> &wp,
                                        const std::vector<gtsam::Point2> &ip,
                                        const PoseEstimate &initialPose,
-                                       double *errorLimit) const {
+                                       double *errorLimit,
+                                       const Deadline &deadline) const {
     PoseEstimate pe; // defaults to invalid
     if (wp.empty()) {
       return (pe);
     }
 
-    gtsam::ExpressionFactorGraph   graph;
-    auto pixelNoise = gtsam::noiseModel::Isotropic::Sigma(2, 1.0);
-    gtsam::Symbol T_w_c = gtsam::Symbol('P', 0); // camera pose symbol
-    for (const auto i: boost::irange(0ul, wp.size())) {
-      gtsam::Point2_ xp = gtsam::project(gtsam::transform_to(T_w_c, wp[i]));
-      if (camera->radtanModel) {
-        gtsam::Expression<Cal3DS2U> cK(*camera->radtanModel);
-        gtsam::Expression<gtsam::Point2> predict(cK, &Cal3DS2U::uncalibrate, xp);
-        graph.addExpressionFactor(predict, ip[i], pixelNoise);
-      } else if (camera->equidistantModel) {
-        gtsam::Expression<Cal3FS2> cK(*camera->equidistantModel);
-        gtsam::Expression<gtsam::Point2> predict(cK, &Cal3FS2::uncalibrate, xp);
-        graph.addExpressionFactor(predict, ip[i], pixelNoise);
-      }
-    }
-    gtsam::Values initialValues;
+    // solve for T_c_w, such that X_c = T_c_w * X_w
+    ResectionSolver solver;
+    solver.addObservations(camera->projector, gtsam::Pose3(), wp, ip);
     double pixelError = initRelPixErr_ * utils::get_pixel_range(ip);
-    pe = optimizeGraph(initialPose, initialValues, &graph, pixelError,
-                       errorLimit, wp);
+    pe = optimizeGraph(initialPose.getPose().inverse(), solver, pixelError,
+                       errorLimit, wp, deadline);
+    pe.setPose(pe.getPose().inverse());
     return (pe);
   }
 
@@ -260,10 +201,10 @@ namespace tagslam {
 
   PoseEstimate
   InitialPoseGraph::optimizeGraph(const gtsam::Pose3 &startPose,
-                                  const gtsam::Values &startValues,
-                                  gtsam::NonlinearFactorGraph *graph,
+                                  const ResectionSolver &solver,
                                   double errorLimit, double *adjErrorLimit,
-                                  const std::vector<gtsam::Point3> &wp) const {
+                                  const std::vector<gtsam::Point3> &wp,
+                                  const Deadline &deadline) const {
   	RandEng	randomEngine;
     RandDist distTrans(0, 10.0); // mu, sigma for translation
     RandDist distRot(0, M_PI);	 // mu, sigma for rotations
@@ -278,25 +219,28 @@ namespace tagslam {
     const double ffac = std::pow(MAX_ADJUST_RATIO, 1.0/MAX_NUM_ITER);
     double adjFac = 1.0;
     for (num_iter = 0; num_iter < MAX_NUM_ITER; num_iter++) {
-      PoseEstimate pe = try_optimization(pose, startValues, graph);
+      PoseEstimate pe = solver.solve(pose);
       double adjustedLimit = errorLimit * adjFac;
       if (pe.getError() < bestPose.getError()) {
-        if (is_camera_z_positive(pe.getPose().inverse(), wp)) {
+        // reject mirror solutions for every camera of the solver,
+        // wp is empty when solving for bodies
+        if (solver.isInFront(pe.getPose()) &&
+            is_camera_z_positive(pe.getPose(), wp)) {
           bestPose = pe;
           //std::cout << num_iter << " best pose: " << pe.getError() << " vs lim: " << adjustedLimit << std::endl;
         }
       }
-      if (bestPose.getError() < adjustedLimit) {
+      if (bestPose.getError() < adjustedLimit || deadline.isExpired()) {
         break;
       }
       pose = make_random_pose(&rgr, &rgt);
       adjFac = adjFac * ffac; // exponentially increasing limit
     }
-    if (num_iter * 10 > MAX_NUM_ITER) {
+    if (num_iter * 10 > MAX_NUM_ITER && !deadline.isExpired()) {
       ROS_WARN_STREAM("init pose guess took " << num_iter << " iterations, slowing you down!");
       ROS_WARN_STREAM("consider increasing initial_maximum_relative_pixel_error from " << initRelPixErr_);
     }
-    if (bestPose.getError() >= errorLimit * adjFac) {
+    if (bestPose.getError() >= errorLimit * adjFac && !deadline.isExpired()) {
       ROS_WARN_STREAM("initialization graph failed with error " <<
                       bestPose.getError() << " vs limit: " << errorLimit * adjFac);
     }
@@ -0,0 +1,34 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/motion_predictor.h"
+
+namespace tagslam {
+  void MotionPredictor::update(const gtsam::Pose3 &T_w_b, const ros::Time &t) {
+    if (numUpdates_ > 0) {
+      const double dt = (t - lastTime_).toSec();
+      if (dt <= 0 || dt > maxTimeGap_) {
+        numUpdates_ = 0; // stale or out of order, start over
+      } else {
+        // twist in body frame: T_w_b(t) = T_w_b(t0) * exp(v * dt)
+        velocity_ = gtsam::Pose3::Logmap(lastPose_.between(T_w_b)) / dt;
+      }
+    }
+    lastPose_ = T_w_b;
+    lastTime_ = t;
+    numUpdates_++;
+  }
+
+  bool MotionPredictor::predict(const ros::Time &t, gtsam::Pose3 *T_w_b) const {
+    if (numUpdates_ < 2) {
+      return (false);
+    }
+    const double dt = (t - lastTime_).toSec();
+    if (dt < 0 || dt > maxTimeGap_) {
+      return (false);
+    }
+    *T_w_b = lastPose_ * gtsam::Pose3::Expmap(velocity_ * dt);
+    return (true);
+  }
+}  // namespace
@@ -0,0 +1,186 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/projector.h"
+#include <boost/range/irange.hpp>
+#include <boost/bind.hpp>
+#include <gtsam/geometry/CalibratedCamera.h>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+
+namespace tagslam {
+  using boost::irange;
+  typedef Eigen::Array<double, Eigen::Dynamic, 1> ArrayX;
+  typedef Eigen::Array<double, 1, 1>              Array1;
+
+  Projector::Projector(const std::vector<double> &K,
+                       const std::vector<double> &D) {
+    if (K.size() != 4) {
+      throw std::runtime_error("projector needs exactly 4 intrinsics!");
+    }
+    if (D.size() > 5) {
+      throw std::runtime_error("max of 5 dist coeff is supported!");
+    }
+    fx_ = K[0];
+    fy_ = K[1];
+    cx_ = K[2];
+    cy_ = K[3];
+    for (const auto i: irange(0ul, D.size())) {
+      k_[i] = D[i];
+    }
+  }
+
+  ProjectorPtr
+  Projector::make(const std::string &distModel,
+                  const std::vector<double> &K,
+                  const std::vector<double> &D) {
+    if (distModel == "radtan" || distModel == "plumb_bob") {
+      return (ProjectorPtr(new ProjectorT<RadTanModel>(K, D)));
+    } else if (distModel == "equidistant") {
+      return (ProjectorPtr(new ProjectorT<EquidistantModel>(K, D)));
+    } else if (distModel == "none" || distModel == "pinhole") {
+      return (ProjectorPtr(new ProjectorT<PinholeModel>(K, D)));
+    }
+    throw std::runtime_error("unknown distortion model: " + distModel);
+  }
+
+  static gtsam::Point2 project_checked(const ProjectorConstPtr &proj,
+                                       const gtsam::Point3 &X_c,
+                                       gtsam::OptionalJacobian<2, 3> H) {
+    const gtsam::Point2 uv = proj->projectPoint(X_c, H);
+    if (!Projector::is_projected(uv)) {
+      throw gtsam::CheiralityException();
+    }
+    return (uv);
+  }
+
+  gtsam::Expression<gtsam::Point2>
+  Projector::make_expression(const ProjectorConstPtr &proj,
+                             const gtsam::Expression<gtsam::Point3> &X_c) {
+    return (gtsam::Expression<gtsam::Point2>(
+              boost::bind(&project_checked, proj, _1, _2), X_c));
+  }
+
+  template <class Model> template <typename A>
+  void ProjectorT<Model>::projectSoA(const A &x, const A &y, const A &z,
+                                     A *u, A *v, A *J) const {
+    const A iz = z.inverse();
+    const A xn = x * iz, yn = y * iz;
+    A xd, yd, JD[4];
+    Model::distort(k_, xn, yn, &xd, &yd, J ? JD : NULL);
+    *u = fx_ * xd + cx_;
+    *v = fy_ * yd + cy_;
+    // cheirality: no projection for points behind the camera
+    if ((z <= 0.0).any()) {
+      const double nan = std::numeric_limits<double>::quiet_NaN();
+      *u = (z <= 0.0).select(nan, *u);
+      *v = (z <= 0.0).select(nan, *v);
+    }
+    if (J) {
+      // d(xn, yn)/d(x, y, z) = [1/z, 0, -xn/z; 0, 1/z, -yn/z]
+      J[0] = fx_ * JD[0] * iz;
+      J[1] = fx_ * JD[1] * iz;
+      J[2] = -fx_ * (JD[0] * xn + JD[1] * yn) * iz;
+      J[3] = fy_ * JD[2] * iz;
+      J[4] = fy_ * JD[3] * iz;
+      J[5] = -fy_ * (JD[2] * xn + JD[3] * yn) * iz;
+    }
+  }
+
+  template <class Model>
+  void ProjectorT<Model>::project(const gtsam::Pose3 &T_c_w,
+                                  const std::vector<gtsam::Point3> &wp,
+                                  std::vector<gtsam::Point2> *ip,
+                                  Matrix26Vec *H) const {
+    const size_t n = wp.size();
+    ip->resize(n);
+    if (H) {
+      H->resize(n);
+    }
+    if (n == 0) {
+      return;
+    }
+    // transform to camera coordinates: X_c = R_c_w * X_w + t_c_w
+    const gtsam::Matrix3 R = T_c_w.rotation().matrix();
+    const gtsam::Point3  t = T_c_w.translation();
+    ArrayX X(n), Y(n), Z(n);
+    for (const auto i: irange(0ul, n)) {
+      X(i) = wp[i].x();
+      Y(i) = wp[i].y();
+      Z(i) = wp[i].z();
+    }
+    const ArrayX x = R(0, 0) * X + R(0, 1) * Y + R(0, 2) * Z + t.x();
+    const ArrayX y = R(1, 0) * X + R(1, 1) * Y + R(1, 2) * Z + t.y();
+    const ArrayX z = R(2, 0) * X + R(2, 1) * Y + R(2, 2) * Z + t.z();
+    ArrayX u, v, J[6];
+    projectSoA(x, y, z, &u, &v, H ? J : NULL);
+    for (const auto i: irange(0ul, n)) {
+      (*ip)[i] = gtsam::Point2(u(i), v(i));
+    }
+    if (H) {
+      for (const auto i: irange(0ul, n)) {
+        Eigen::Matrix<double, 2, 3> Hp;
+        Hp << J[0](i), J[1](i), J[2](i), J[3](i), J[4](i), J[5](i);
+        // d(X_c)/d(omega) = -[X_c]_x, d(X_c)/d(v) = I
+        Eigen::Matrix3d mskew;
+        mskew <<     0.0,  z(i), -y(i),
+                   -z(i),   0.0,  x(i),
+                    y(i), -x(i),   0.0;
+        (*H)[i] << Hp * mskew, Hp;
+      }
+    }
+  }
+
+  template <class Model>
+  gtsam::Point2
+  ProjectorT<Model>::projectPoint(const gtsam::Point3 &X_c,
+                                  gtsam::OptionalJacobian<2, 3> H) const {
+    Array1 x, y, z, u, v, J[6];
+    x(0) = X_c.x();
+    y(0) = X_c.y();
+    z(0) = X_c.z();
+    projectSoA(x, y, z, &u, &v, H ? J : NULL);
+    if (H) {
+      *H << J[0](0), J[1](0), J[2](0), J[3](0), J[4](0), J[5](0);
+    }
+    return (gtsam::Point2(u(0), v(0)));
+  }
+
+  template <class Model>
+  gtsam::Point2
+  ProjectorT<Model>::distort(const gtsam::Point2 &xn,
+                             gtsam::OptionalJacobian<2, 2> H) const {
+    Array1 x, y, xd, yd, J[4];
+    x(0) = xn.x();
+    y(0) = xn.y();
+    Model::distort(k_, x, y, &xd, &yd, H ? J : NULL);
+    if (H) {
+      *H << J[0](0), J[1](0), J[2](0), J[3](0);
+    }
+    return (gtsam::Point2(xd(0), yd(0)));
+  }
+
+  double
+  Projector::reprojectionError(const gtsam::Pose3 &T_c_w,
+                               const std::vector<gtsam::Point3> &wp,
+                               const std::vector<gtsam::Point2> &ip) const {
+    if (wp.empty()) {
+      return (0.0);
+    }
+    std::vector<gtsam::Point2> ipp;
+    project(T_c_w, wp, &ipp);
+    double err(0);
+    for (const auto i: irange(0ul, ipp.size())) {
+      const double dx = ipp[i].x() - ip[i].x();
+      const double dy = ipp[i].y() - ip[i].y();
+      err += std::sqrt(dx * dx + dy * dy);
+    }
+    return (err / (double) ipp.size());
+  }
+
+  template class ProjectorT<PinholeModel>;
+  template class ProjectorT<RadTanModel>;
+  template class ProjectorT<EquidistantModel>;
+}  // namespace
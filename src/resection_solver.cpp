@@ -0,0 +1,144 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/resection_solver.h"
+#include <boost/range/irange.hpp>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+
+namespace tagslam {
+  using boost::irange;
+
+  void ResectionSolver::addObservations(const ProjectorConstPtr &proj,
+                                        const gtsam::Pose3 &T_c_x,
+                                        const std::vector<gtsam::Point3> &X,
+                                        const std::vector<gtsam::Point2> &ip) {
+    if (X.size() != ip.size()) {
+      throw std::runtime_error("resection: number of points mismatch!");
+    }
+    Block b;
+    b.proj  = proj;
+    b.T_c_x = T_c_x;
+    b.begin = X_.size();
+    X_.insert(X_.end(), X.begin(), X.end());
+    ip_.insert(ip_.end(), ip.begin(), ip.end());
+    b.end   = X_.size();
+    blocks_.push_back(b);
+  }
+
+  double ResectionSolver::error(const gtsam::Pose3 &T) const {
+    double err(0);
+    for (const auto &b: blocks_) {
+      const gtsam::Pose3 T_c = b.T_c_x * T;
+      for (const auto i: irange(b.begin, b.end)) {
+        const gtsam::Point3 X_c = T_c.transform_from(X_[i]);
+        if (X_c.z() <= 0) {
+          // behind the camera: rules out the mirrored solution,
+          // which has the same reprojection error
+          return (std::numeric_limits<double>::infinity());
+        }
+        const gtsam::Point2 r = b.proj->projectPoint(X_c) - ip_[i];
+        err += 0.5 * (r.x() * r.x() + r.y() * r.y());
+      }
+    }
+    return (err);
+  }
+
+  bool ResectionSolver::isInFront(const gtsam::Pose3 &T) const {
+    for (const auto &b: blocks_) {
+      const gtsam::Pose3 T_c = b.T_c_x * T;
+      for (const auto i: irange(b.begin, b.end)) {
+        if (T_c.transform_from(X_[i]).z() <= 0) {
+          return (false);
+        }
+      }
+    }
+    return (true);
+  }
+
+  PoseEstimate ResectionSolver::evaluate(const gtsam::Pose3 &T) const {
+    if (X_.empty()) {
+      return (PoseEstimate(T)); // invalid
+    }
+    const double err = error(T);
+    if (!std::isfinite(err)) {
+      return (PoseEstimate(T));
+    }
+    return (PoseEstimate(T, err / (double) X_.size(), 0));
+  }
+
+  bool ResectionSolver::linearize(const gtsam::Pose3 &T, gtsam::Matrix6 *H,
+                                  gtsam::Vector6 *g, double *err) const {
+    H->setZero();
+    g->setZero();
+    *err = 0;
+    for (const auto &b: blocks_) {
+      const gtsam::Matrix3 R_c_x = b.T_c_x.rotation().matrix();
+      for (const auto i: irange(b.begin, b.end)) {
+        const gtsam::Point3 Y   = T.transform_from(X_[i]);
+        const gtsam::Point3 X_c = b.T_c_x.transform_from(Y);
+        if (X_c.z() <= 0) {
+          return (false); // point behind camera
+        }
+        Eigen::Matrix<double, 2, 3> Hp;
+        const gtsam::Point2 r = b.proj->projectPoint(X_c, Hp) - ip_[i];
+        // d(Y)/d(xi) = [-[Y]_x, I] for T -> exp(xi) * T
+        Eigen::Matrix<double, 3, 6> dY;
+        dY <<     0.0,  Y.z(), -Y.y(), 1.0, 0.0, 0.0,
+               -Y.z(),    0.0,  Y.x(), 0.0, 1.0, 0.0,
+                Y.y(), -Y.x(),    0.0, 0.0, 0.0, 1.0;
+        const Eigen::Matrix<double, 2, 6> J = Hp * R_c_x * dY;
+        const Eigen::Vector2d rv(r.x(), r.y());
+        *H += J.transpose() * J;
+        *g += J.transpose() * rv;
+        *err += 0.5 * rv.squaredNorm();
+      }
+    }
+    return (std::isfinite(*err) && H->allFinite());
+  }
+
+  PoseEstimate ResectionSolver::solve(const gtsam::Pose3 &startPose,
+                                      int maxIter) const {
+    const double ABS_ERR_TOL = 1e-7;
+    const double MAX_LAMBDA  = 1e10;
+    gtsam::Pose3 T = startPose;
+    double lambda(1e-5);
+    double err(0);
+    int iter(0);
+    const double n = (double) std::max(X_.size(), (size_t) 1);
+    for (iter = 0; iter < maxIter; iter++) {
+      gtsam::Matrix6 H;
+      gtsam::Vector6 g;
+      if (!linearize(T, &H, &g, &err)) {
+        // e.g. starting pose with points in or behind the camera plane
+        return (PoseEstimate(startPose, 1e10, maxIter));
+      }
+      bool improved(false);
+      double newErr(err);
+      while (lambda < MAX_LAMBDA) {
+        gtsam::Matrix6 Hd = H;
+        Hd.diagonal() += lambda * H.diagonal().cwiseMax(1e-9);
+        const gtsam::Vector6 dx = Hd.ldlt().solve(-g);
+        const gtsam::Pose3 Tn = gtsam::Pose3::Expmap(dx) * T;
+        newErr = error(Tn);
+        if (std::isfinite(newErr) && newErr < err) {
+          T = Tn;
+          lambda = std::max(lambda * 0.1, 1e-12);
+          improved = true;
+          break;
+        }
+        lambda *= 10.0;
+      }
+      if (!improved || err - newErr < ABS_ERR_TOL) {
+        if (improved) {
+          err = newErr;
+        }
+        break;
+      }
+      err = newErr;
+    }
+    return (PoseEstimate(T, err / n, iter));
+  }
+}  // namespace
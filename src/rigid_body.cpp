@@ -42,6 +42,9 @@ namespace tagslam {
       if (body.hasMember("max_hamming_distance")) {
         maxHammingDistance = static_cast<int>(body["max_hamming_distance"]);
       }
+      if (body.hasMember("fix_known_tag_poses")) {
+        fixKnownTagPoses = static_cast<bool>(body["fix_known_tag_poses"]);
+      }
       if (body.hasMember("ignore_tags")) {
         auto ignTags = body["ignore_tags"];
         for (const auto i: irange(0, ignTags.size())) {
@@ -275,6 +278,9 @@ namespace tagslam {
     os << pfix << "is_static: " <<
       (isStatic ? "true" : "false") << std::endl;
     os << pfix << "default_tag_size: " << defaultTagSize << std::endl;
+    if (fixKnownTagPoses) {
+      os << pfix << "fix_known_tag_poses: true" << std::endl;
+    }
     if (isStatic) {
       os << pfix << "pose:" << std::endl;;
       PoseNoise smallNoise = makePoseNoise(0.001, 0.001);
@@ -0,0 +1,256 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/shm_map.h"
+#include <boost/range/irange.hpp>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace tagslam {
+  using boost::irange;
+  namespace shm {
+    const uint32_t MAGIC = 0x74736d31;
+    static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "ring size must be power of 2");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "need lock free atomics in shared memory");
+
+    struct MapArea {
+      std::atomic<uint64_t> version; // odd while written, 0 if no map yet
+      uint32_t              frameNum;
+      int64_t               stamp;
+      uint32_t              numTags;
+      uint32_t              numBodies;
+      PoseRecord            tags[MAX_TAGS];
+      PoseRecord            bodies[MAX_BODIES];
+    };
+    struct RingSlot {
+      std::atomic<uint64_t> seq;
+      DetectionFrame        frame;
+    };
+    // bounded queue after D. Vyukov: the slot sequence number
+    // tells producers and consumer whose turn it is
+    struct Ring {
+      std::atomic<uint64_t> head; // next slot to fill
+      std::atomic<uint64_t> tail; // next slot to drain
+      RingSlot              slots[RING_SIZE];
+    };
+    struct Segment {
+      uint32_t magic;
+      MapArea  map;
+      Ring     ring;
+    };
+  }
+
+  static void to_record(const MapSnapshot::Entry &e, shm::PoseRecord *r) {
+    const gtsam::Matrix3 R = e.pose.rotation().matrix();
+    for (const auto i: irange(0, 3)) {
+      for (const auto j: irange(0, 3)) {
+        r->pose[i * 3 + j] = R(i, j);
+      }
+    }
+    r->pose[9]  = e.pose.x();
+    r->pose[10] = e.pose.y();
+    r->pose[11] = e.pose.z();
+    for (const auto i: irange(0, 36)) {
+      r->covariance[i] = e.covariance(i / 6, i % 6);
+    }
+    r->size = e.size;
+  }
+
+  static MapSnapshot::Entry from_record(const shm::PoseRecord &r) {
+    gtsam::Matrix3 R;
+    gtsam::Matrix6 cov;
+    for (const auto i: irange(0, 9)) {
+      R(i / 3, i % 3) = r.pose[i];
+    }
+    for (const auto i: irange(0, 36)) {
+      cov(i / 6, i % 6) = r.covariance[i];
+    }
+    MapSnapshot::Entry e(gtsam::Pose3(gtsam::Rot3(R),
+                                      gtsam::Point3(r.pose[9], r.pose[10], r.pose[11])),
+                         cov);
+    e.size = r.size;
+    return (e);
+  }
+
+  // ------------------------- server -------------------------------
+
+  ShmMapServer::ShmMapServer(const std::string &name,
+                             double staleSlotTimeout) :
+    name_(name), staleSlotTimeout_(staleSlotTimeout) {
+    using namespace boost::interprocess;
+    shared_memory_object::remove(name.c_str());
+    shm_ = shared_memory_object(create_only, name.c_str(), read_write);
+    shm_.truncate(sizeof(shm::Segment));
+    region_ = mapped_region(shm_, read_write);
+    segment_ = new (region_.get_address()) shm::Segment;
+    segment_->map.version.store(0);
+    segment_->ring.head.store(0);
+    segment_->ring.tail.store(0);
+    for (const auto i: irange(0u, shm::RING_SIZE)) {
+      segment_->ring.slots[i].seq.store(i);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    segment_->magic = shm::MAGIC;
+  }
+
+  ShmMapServer::~ShmMapServer() {
+    boost::interprocess::shared_memory_object::remove(name_.c_str());
+  }
+
+  void ShmMapServer::writeMap(const MapSnapshot &snap) {
+    shm::MapArea &m = segment_->map;
+    const uint64_t v = m.version.load(std::memory_order_relaxed);
+    m.version.store(v + 1, std::memory_order_relaxed); // odd: writing
+    std::atomic_thread_fence(std::memory_order_release);
+    m.frameNum = snap.frameNum;
+    m.stamp    = snap.time.toNSec();
+    m.numTags  = 0;
+    for (const auto &tm: snap.tags) {
+      if (m.numTags >= shm::MAX_TAGS) {
+        break;
+      }
+      shm::PoseRecord &r = m.tags[m.numTags++];
+      r.id = tm.first;
+      r.name[0] = 0;
+      to_record(tm.second, &r);
+    }
+    m.numBodies = 0;
+    for (const auto &bm: snap.bodies) {
+      if (m.numBodies >= shm::MAX_BODIES) {
+        break;
+      }
+      shm::PoseRecord &r = m.bodies[m.numBodies++];
+      r.id = -1;
+      std::strncpy(r.name, bm.first.c_str(), shm::NAME_LEN - 1);
+      r.name[shm::NAME_LEN - 1] = 0;
+      to_record(bm.second, &r);
+    }
+    m.version.store(v + 2, std::memory_order_release);
+  }
+
+  bool ShmMapServer::popDetections(
+    const std::function<void(const shm::DetectionFrame &)> &func) {
+    shm::Ring &ring = segment_->ring;
+    while (true) {
+      // single consumer, so the tail needs no compare-and-swap
+      const uint64_t pos = ring.tail.load(std::memory_order_relaxed);
+      shm::RingSlot &slot = ring.slots[pos & (shm::RING_SIZE - 1)];
+      uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      if (seq == pos + 1) {
+        // read in place, then hand the slot back to the producers
+        func(slot.frame);
+        ring.tail.store(pos + 1, std::memory_order_relaxed);
+        slot.seq.store(pos + shm::RING_SIZE, std::memory_order_release);
+        return (true);
+      }
+      if (seq != pos || ring.head.load(std::memory_order_relaxed) == pos) {
+        return (false); // empty
+      }
+      // claimed by a client, but not published yet
+      const auto now = std::chrono::steady_clock::now();
+      if (pos != claimedPos_) {
+        claimedPos_   = pos;
+        claimedSince_ = now;
+        return (false);
+      }
+      if (now - claimedSince_ < staleSlotTimeout_) {
+        return (false);
+      }
+      // Give up on the slot. The compare-and-swap races with the
+      // client publishing it, see ShmMapClient::pushDetections().
+      if (!slot.seq.compare_exchange_strong(seq, pos + shm::RING_SIZE,
+                                            std::memory_order_acq_rel)) {
+        continue; // published after all
+      }
+      ring.tail.store(pos + 1, std::memory_order_relaxed);
+      numStaleSlots_++;
+    }
+  }
+
+  // ------------------------- client -------------------------------
+
+  ShmMapClient::ShmMapClient(const std::string &name) {
+    using namespace boost::interprocess;
+    shm_ = shared_memory_object(open_only, name.c_str(), read_write);
+    region_ = mapped_region(shm_, read_write);
+    if (region_.get_size() < sizeof(shm::Segment)) {
+      throw std::runtime_error("shared memory segment too small: " + name);
+    }
+    segment_ = static_cast<shm::Segment *>(region_.get_address());
+    if (segment_->magic != shm::MAGIC) {
+      throw std::runtime_error("shared memory segment not initialized: " + name);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+
+  uint64_t ShmMapClient::getMapVersion() const {
+    return (segment_->map.version.load(std::memory_order_acquire));
+  }
+
+  bool ShmMapClient::readMap(MapSnapshot *snap) const {
+    const shm::MapArea &m = segment_->map;
+    while (true) {
+      const uint64_t v1 = m.version.load(std::memory_order_acquire);
+      if (v1 == 0) {
+        return (false); // no map written yet
+      }
+      if (v1 & 1) {
+        std::this_thread::yield(); // server is writing
+        continue;
+      }
+      MapSnapshot s;
+      s.frameNum = m.frameNum;
+      s.time.fromNSec(m.stamp);
+      const uint32_t numTags = std::min(m.numTags, shm::MAX_TAGS);
+      for (const auto i: irange(0u, numTags)) {
+        s.tags[m.tags[i].id] = from_record(m.tags[i]);
+      }
+      const uint32_t numBodies = std::min(m.numBodies, shm::MAX_BODIES);
+      for (const auto i: irange(0u, numBodies)) {
+        char name[shm::NAME_LEN];
+        std::memcpy(name, m.bodies[i].name, shm::NAME_LEN);
+        name[shm::NAME_LEN - 1] = 0;
+        s.bodies[name] = from_record(m.bodies[i]);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (m.version.load(std::memory_order_relaxed) == v1) {
+        *snap = s;
+        return (true);
+      }
+      // map changed while copying, try again
+    }
+  }
+
+  bool ShmMapClient::pushDetections(
+    const std::function<void(shm::DetectionFrame *)> &func) {
+    shm::Ring &ring = segment_->ring;
+    uint64_t pos = ring.head.load(std::memory_order_relaxed);
+    shm::RingSlot *slot(NULL);
+    while (true) {
+      slot = &ring.slots[pos & (shm::RING_SIZE - 1)];
+      const int64_t diff = (int64_t) slot->seq.load(std::memory_order_acquire)
+        - (int64_t) pos;
+      if (diff == 0) {
+        if (ring.head.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+          break; // slot is ours
+        }
+      } else if (diff < 0) {
+        return (false); // full
+      } else {
+        pos = ring.head.load(std::memory_order_relaxed);
+      }
+    }
+    func(&slot->frame);
+    slot->frame.numTags = std::min(slot->frame.numTags, shm::MAX_DETECTIONS);
+    // fails if the server dropped the slot because we took too long
+    uint64_t claimed = pos;
+    return (slot->seq.compare_exchange_strong(claimed, pos + 1,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed));
+  }
+}  // namespace
@@ -0,0 +1,126 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/shm_tracking_client.h"
+#include "tagslam/tag.h"
+#include <nav_msgs/Odometry.h>
+#include <eigen_conversions/eigen_msg.h>
+#include <boost/range/irange.hpp>
+#include <algorithm>
+
+namespace tagslam {
+  using boost::irange;
+
+  ShmTrackingClient::ShmTrackingClient(const ros::NodeHandle& pnh) :
+    nh_(pnh) {
+  }
+
+  bool ShmTrackingClient::initialize() {
+    nh_.param<std::string>("shm_map_name", shmName_, "tagslam_map");
+    nh_.param<std::string>("fixed_frame_id", fixedFrame_, "map");
+    double maxInitErr;
+    nh_.param<double>("initial_maximum_relative_pixel_error", maxInitErr, 0.02);
+    poseGraph_.setInitialRelativePixelError(maxInitErr);
+    // The camera must be configured identically in the mapping
+    // process, its index there is the position in the camera list.
+    std::string cameraName;
+    nh_.param<std::string>("camera", cameraName, "cam0");
+    const CameraVec cameras = Camera::parse_cameras(nh_);
+    for (const auto cam_idx: irange(0ul, cameras.size())) {
+      if (cameras[cam_idx]->name == cameraName) {
+        camera_ = cameras[cam_idx];
+        cameraIndex_ = cam_idx;
+      }
+    }
+    if (!camera_) {
+      ROS_ERROR_STREAM("camera not configured: " << cameraName);
+      return (false);
+    }
+    odomPub_ = nh_.advertise<nav_msgs::Odometry>("odom/" + camera_->name, 1);
+    sub_ = nh_.subscribe(camera_->tagtopic, 1, &ShmTrackingClient::callback, this);
+    ROS_INFO_STREAM("tracking " << camera_->name << " on " << camera_->tagtopic);
+    return (true);
+  }
+
+  bool ShmTrackingClient::connect() {
+    if (!client_) {
+      try {
+        client_.reset(new ShmMapClient(shmName_));
+        ROS_INFO_STREAM("connected to map server: " << shmName_);
+      } catch (const std::exception &e) {
+        ROS_WARN_STREAM_THROTTLE(5.0, "waiting for map server: " << e.what());
+      }
+    }
+    return (client_ != nullptr);
+  }
+
+  void ShmTrackingClient::callback(const TagArray::ConstPtr &msg) {
+    if (!connect()) {
+      return;
+    }
+    forwardDetections(*msg);
+    const uint64_t version = client_->getMapVersion();
+    if (version != mapVersion_ && client_->readMap(&map_)) {
+      mapVersion_ = version;
+    }
+    localize(*msg);
+  }
+
+  void ShmTrackingClient::forwardDetections(const TagArray &msg) {
+    const unsigned int camIdx = cameraIndex_;
+    const bool ok = client_->pushDetections([&msg, camIdx](shm::DetectionFrame *f) {
+        f->camera  = camIdx;
+        f->stamp   = msg.header.stamp.toNSec();
+        f->numTags = std::min((uint32_t) msg.apriltags.size(), shm::MAX_DETECTIONS);
+        for (const auto i: irange(0u, f->numTags)) {
+          const auto &tag = msg.apriltags[i];
+          f->tags[i].id   = tag.id;
+          f->tags[i].bits = tag.bits;
+          for (const auto k: irange(0, 4)) {
+            f->tags[i].corners[2 * k]     = tag.corners[k].x;
+            f->tags[i].corners[2 * k + 1] = tag.corners[k].y;
+          }
+        }
+      });
+    if (!ok) {
+      // server is behind, the detections are only lost for mapping
+      numDropped_++;
+      ROS_WARN_STREAM_THROTTLE(5.0, "detection ring full, dropped: " << numDropped_);
+    }
+  }
+
+  void ShmTrackingClient::localize(const TagArray &msg) {
+    std::vector<gtsam::Point3> wp;
+    std::vector<gtsam::Point2> ip;
+    for (const auto &tag: msg.apriltags) {
+      const auto it = map_.tags.find(tag.id);
+      if (it == map_.tags.end() || it->second.size <= 0) {
+        continue;
+      }
+      const auto oc = Tag::make_object_corners(it->second.size);
+      for (const auto k: irange(0ul, oc.size())) {
+        wp.push_back(it->second.pose.transform_from(oc[k]));
+        ip.push_back(gtsam::Point2(tag.corners[k].x, tag.corners[k].y));
+      }
+    }
+    if (wp.empty()) {
+      return;
+    }
+    double errorLimit;
+    const PoseEstimate pe =
+      poseGraph_.estimateCameraPose(camera_, wp, ip, lastPose_, &errorLimit);
+    if (pe.getError() >= errorLimit) {
+      ROS_WARN_STREAM("cannot localize " << camera_->name << " err: " << pe.getError());
+      return;
+    }
+    lastPose_ = pe;
+    nav_msgs::Odometry odom;
+    odom.header.stamp = msg.header.stamp;
+    odom.header.frame_id = fixedFrame_;
+    odom.child_frame_id = camera_->frame_id;
+    Eigen::Affine3d TFa(pe.getPose().matrix());
+    tf::poseEigenToMsg(TFa, odom.pose.pose);
+    odomPub_.publish(odom);
+  }
+}  // namespace
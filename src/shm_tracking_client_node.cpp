@@ -0,0 +1,20 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include <ros/ros.h>
+#include "tagslam/shm_tracking_client.h"
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "shm_tracking_client_node");
+  ros::NodeHandle pnh("~");
+
+  try {
+    tagslam::ShmTrackingClient node(pnh);
+    if (node.initialize()) {
+      ros::spin();
+    }
+  } catch (const std::exception& e) {
+    ROS_ERROR("%s: %s", pnh.getNamespace().c_str(), e.what());
+  }
+}
@@ -0,0 +1,232 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/smart_tag_factor.h"
+#include "tagslam/resection_solver.h"
+#include <gtsam/linear/HessianFactor.h>
+#include <gtsam/base/SymmetricBlockMatrix.h>
+#include <gtsam/geometry/CalibratedCamera.h>
+#include <boost/range/irange.hpp>
+#include <algorithm>
+#include <stdexcept>
+
+namespace tagslam {
+  using boost::irange;
+
+  SmartTagFactor::SmartTagFactor(const std::vector<gtsam::Point3> &objCorners,
+                                 double sigma, const gtsam::Pose3 &T_b_o,
+                                 size_t maxDynamicObs) :
+    X_o_(objCorners), sigma_(sigma), T_b_o_(T_b_o),
+    maxDynamicObs_(maxDynamicObs) {
+  }
+
+  SmartTagFactor::SmartTagFactor(const SmartTagFactor &f,
+                                 const gtsam::Pose3 &T_b_o) :
+    SmartTagFactor(f) {
+    T_b_o_ = T_b_o;
+  }
+
+  void SmartTagFactor::updateKeys() {
+    keys_.clear();
+    auto index = [this](gtsam::Key key) {
+      const auto it = std::find(keys_.begin(), keys_.end(), key);
+      if (it != keys_.end()) {
+        return ((size_t)(it - keys_.begin()));
+      }
+      keys_.push_back(key);
+      return (keys_.size() - 1);
+    };
+    for (auto &o: obs_) {
+      o.idx_w_r = index(o.T_w_r);
+      o.idx_r_c = index(o.T_r_c);
+      o.idx_w_b = index(o.T_w_b);
+    }
+  }
+
+  void SmartTagFactor::addObservation(const ProjectorConstPtr &proj,
+                                      gtsam::Key T_w_r, gtsam::Key T_r_c,
+                                      gtsam::Key T_w_b, bool isStatic,
+                                      const std::vector<gtsam::Point2> &measured) {
+    if (measured.size() != X_o_.size()) {
+      throw std::runtime_error("smart tag factor: number of corners mismatch!");
+    }
+    if (isStatic) {
+      for (auto &o: obs_) {
+        if (o.isStatic && o.proj == proj && o.T_w_r == T_w_r &&
+            o.T_r_c == T_r_c && o.T_w_b == T_w_b) {
+          // same keys: average the corners, weight by count
+          o.count++;
+          for (const auto i: irange((size_t) 0, measured.size())) {
+            o.measured[i] = o.measured[i] +
+              (measured[i] - o.measured[i]) / (double) o.count;
+          }
+          return;
+        }
+      }
+    }
+    Observation o;
+    o.proj  = proj;
+    o.T_w_r = T_w_r;
+    o.T_r_c = T_r_c;
+    o.T_w_b = T_w_b;
+    o.isStatic = isStatic;
+    o.count = 1;
+    o.measured = measured;
+    obs_.push_back(o);
+    // drop the oldest frame-dependent observations beyond the window
+    size_t numDynamic = std::count_if(
+      obs_.begin(), obs_.end(), [](const Observation &x) { return (!x.isStatic); });
+    for (auto it = obs_.begin(); numDynamic > maxDynamicObs_ && it != obs_.end();) {
+      if (!it->isStatic) {
+        it = obs_.erase(it);
+        numDynamic--;
+      } else {
+        ++it;
+      }
+    }
+    updateKeys();
+  }
+
+  bool SmartTagFactor::isSimilar(const SmartTagFactor &f, double pixTol,
+                                 double countTol) const {
+    // observations are only ever appended or dropped from the front,
+    // so matching ones are at the same position
+    if (f.obs_.size() != obs_.size()) {
+      return (false);
+    }
+    for (const auto i: irange((size_t) 0, obs_.size())) {
+      const Observation &a = obs_[i];
+      const Observation &b = f.obs_[i];
+      if (a.proj != b.proj || a.T_w_r != b.T_w_r || a.T_r_c != b.T_r_c ||
+          a.T_w_b != b.T_w_b || a.isStatic != b.isStatic) {
+        return (false);
+      }
+      if (!a.isStatic) {
+        continue; // frame-dependent observations never change
+      }
+      if (std::max(a.count, b.count) > countTol * std::min(a.count, b.count)) {
+        return (false);
+      }
+      for (const auto j: irange((size_t) 0, a.measured.size())) {
+        if ((a.measured[j] - b.measured[j]).norm() > pixTol) {
+          return (false);
+        }
+      }
+    }
+    return (true);
+  }
+
+  gtsam::Pose3
+  SmartTagFactor::triangulate(const gtsam::Values &values) const {
+    ResectionSolver solver;
+    for (const auto &o: obs_) {
+      const gtsam::Pose3 T_w_c = values.at<gtsam::Pose3>(o.T_w_r) *
+        values.at<gtsam::Pose3>(o.T_r_c);
+      const gtsam::Pose3 T_c_b = T_w_c.inverse() *
+        values.at<gtsam::Pose3>(o.T_w_b);
+      solver.addObservations(o.proj, T_c_b, X_o_, o.measured);
+    }
+    const PoseEstimate pe = solver.solve(T_b_o_);
+    return (pe.isValid() ? pe.getPose() : T_b_o_);
+  }
+
+  double SmartTagFactor::error(const gtsam::Values &values) const {
+    const gtsam::Pose3 T_b_o = triangulate(values);
+    double err(0);
+    for (const auto &o: obs_) {
+      const gtsam::Pose3 T_c_o =
+        (values.at<gtsam::Pose3>(o.T_w_r) *
+         values.at<gtsam::Pose3>(o.T_r_c)).inverse() *
+        values.at<gtsam::Pose3>(o.T_w_b) * T_b_o;
+      for (const auto i: irange((size_t) 0, X_o_.size())) {
+        const gtsam::Point2 uv = o.proj->projectPoint(T_c_o.transform_from(X_o_[i]));
+        if (!Projector::is_projected(uv)) {
+          throw gtsam::CheiralityException();
+        }
+        const double dx = (uv.x() - o.measured[i].x()) / sigma_;
+        const double dy = (uv.y() - o.measured[i].y()) / sigma_;
+        err += 0.5 * o.count * (dx * dx + dy * dy);
+      }
+    }
+    return (err);
+  }
+
+  boost::shared_ptr<gtsam::GaussianFactor>
+  SmartTagFactor::linearize(const gtsam::Values &values) const {
+    const gtsam::Pose3 T_b_o = triangulate(values);
+    const size_t nk = keys_.size();
+    // Normal equations of the whitened system r + sum_k F_k * dx_k
+    // + E * de, where dx_k are the pose keys and de is the tag pose,
+    // accumulated one 6x6 block at a time. Each observation only
+    // touches its own three keys.
+    gtsam::Matrix aug = gtsam::Matrix::Zero(6 * nk + 1, 6 * nk + 1);
+    std::vector<gtsam::Matrix6> Hfe(nk, gtsam::Matrix6::Zero()); // F_k' E
+    std::vector<gtsam::Vector6> gf(nk, gtsam::Vector6::Zero());  // F_k' r
+    gtsam::Matrix6 Hee = gtsam::Matrix6::Zero();
+    gtsam::Vector6 ge  = gtsam::Vector6::Zero();
+    double rr(0);
+    for (const auto &o: obs_) {
+      const gtsam::Pose3 &T_w_r = values.at<gtsam::Pose3>(o.T_w_r);
+      const gtsam::Pose3 &T_r_c = values.at<gtsam::Pose3>(o.T_r_c);
+      const gtsam::Pose3 &T_w_b = values.at<gtsam::Pose3>(o.T_w_b);
+      const size_t idx[3] = {o.idx_r_c, o.idx_w_r, o.idx_w_b};
+      const double w = o.count; // averaged observations
+      for (const auto i: irange((size_t) 0, X_o_.size())) {
+        Eigen::Matrix<double, 3, 6> H_bo, H_wb, H_wr, H_rc;
+        gtsam::Matrix3 H_Xb, H_Xw, H_Xr;
+        Eigen::Matrix<double, 2, 3> Hp;
+        const gtsam::Point3 X_b = T_b_o.transform_from(X_o_[i], H_bo);
+        const gtsam::Point3 X_w = T_w_b.transform_from(X_b, H_wb, H_Xb);
+        const gtsam::Point3 X_r = T_w_r.transform_to(X_w, H_wr, H_Xw);
+        const gtsam::Point3 X_c = T_r_c.transform_to(X_r, H_rc, H_Xr);
+        const gtsam::Point2 uv  = o.proj->projectPoint(X_c, Hp);
+        if (!Projector::is_projected(uv)) {
+          throw gtsam::CheiralityException();
+        }
+        const Eigen::Matrix<double, 2, 3> A_c = Hp / sigma_;
+        const Eigen::Matrix<double, 2, 3> A_r = A_c * H_Xr;
+        const Eigen::Matrix<double, 2, 3> A_w = A_r * H_Xw;
+        const Eigen::Matrix<double, 2, 6> F[3] = {A_c * H_rc, A_r * H_wr, A_w * H_wb};
+        const Eigen::Matrix<double, 2, 6> E = A_w * H_Xb * H_bo;
+        const gtsam::Vector2 r((uv.x() - o.measured[i].x()) / sigma_,
+                               (uv.y() - o.measured[i].y()) / sigma_);
+        Hee += w * E.transpose() * E;
+        ge  += w * E.transpose() * r;
+        rr  += w * r.squaredNorm();
+        // keys can coincide, so accumulate
+        for (const auto a: irange(0, 3)) {
+          Hfe[idx[a]] += w * F[a].transpose() * E;
+          gf[idx[a]]  += w * F[a].transpose() * r;
+          for (const auto b: irange(0, 3)) {
+            aug.block<6, 6>(6 * idx[a], 6 * idx[b]) +=
+              w * F[a].transpose() * F[b];
+          }
+        }
+      }
+    }
+    // Schur complement: eliminate tag pose
+    //   G_kl = F_k'F_l - F_k'E (E'E)^-1 E'F_l
+    //   g_k  = -F_k'r + F_k'E (E'E)^-1 E'r
+    //   f    = r'r - r'E (E'E)^-1 E'r
+    const Eigen::LDLT<gtsam::Matrix6> Hee_ldlt(Hee);
+    const gtsam::Vector6 HeeInv_ge = Hee_ldlt.solve(ge);
+    std::vector<gtsam::Matrix6> HeeInv_Hef(nk);
+    for (const auto k: irange((size_t) 0, nk)) {
+      HeeInv_Hef[k] = Hee_ldlt.solve(Hfe[k].transpose());
+    }
+    for (const auto k: irange((size_t) 0, nk)) {
+      for (const auto l: irange((size_t) 0, nk)) {
+        aug.block<6, 6>(6 * k, 6 * l) -= Hfe[k] * HeeInv_Hef[l];
+      }
+      const gtsam::Vector6 g = -gf[k] + Hfe[k] * HeeInv_ge;
+      aug.block<6, 1>(6 * k, 6 * nk) = g;
+      aug.block<1, 6>(6 * nk, 6 * k) = g.transpose();
+    }
+    aug(6 * nk, 6 * nk) = rr - ge.dot(HeeInv_ge);
+    std::vector<gtsam::DenseIndex> dims(nk + 1, 6);
+    dims.back() = 1;
+    return (boost::make_shared<gtsam::HessianFactor>(
+              keys_, gtsam::SymmetricBlockMatrix(dims, aug)));
+  }
+}  // namespace
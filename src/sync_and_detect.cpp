@@ -3,6 +3,7 @@
  */
 
 #include "tagslam/sync_and_detect.h"
+#include "tagslam/tag_detector.h"
 #include <rosbag/bag.h>
 #include <rosbag/view.h>
 #include <cv_bridge/cv_bridge.h>
@@ -12,14 +13,19 @@
 #include <boost/range/irange.hpp>
 #include <apriltag_msgs/ApriltagArrayStamped.h>
 #include <math.h>
+#include <cmath>
+#include <stdexcept>
 #include <fstream>
 #include <iomanip>
 #include <functional>
+#include <set>
+#include <utility>
 
 namespace tagslam {
   using boost::irange;
 
-  SyncAndDetect::SyncAndDetect(const ros::NodeHandle& pnh) :  nh_(pnh) {
+  SyncAndDetect::SyncAndDetect(const ros::NodeHandle& pnh) :
+    nh_(pnh), outbag_(pnh.param<int>("output_queue_size", 100)) {
   }
 
   SyncAndDetect::~SyncAndDetect() {
@@ -42,27 +48,63 @@ namespace tagslam {
       return (false);
     }
     nh_.param<std::string>("detector_type", detectorType_, "Mit");
-    if (detectorType_ == "Mit") {
-      detector_ = apriltag_ros::ApriltagDetector::Create(
-        apriltag_ros::DetectorType::Mit, apriltag_ros::TagFamily::tf36h11);
-    } else if (detectorType_ == "Umich") {
-      detector_ = apriltag_ros::ApriltagDetector::Create(
-        apriltag_ros::DetectorType::Umich, apriltag_ros::TagFamily::tf36h11);
-    } else {
-      ROS_ERROR_STREAM("INVALID DETECTOR TYPE: " << detectorType_);
+    // one detector per family, all run on the same grey image
+    std::vector<std::string> families;
+    if (!nh_.getParam("tag_families", families)) {
+      families.push_back("36h11");
     }
     int borderWidth;
     nh_.param<int>("black_border_width", borderWidth, 1);
-    detector_->set_black_border(borderWidth);
+    try {
+      detectors_ = TagDetector::make_detectors(detectorType_, families,
+                                               borderWidth);
+    } catch (const std::runtime_error &e) {
+      ROS_ERROR_STREAM(e.what());
+      return (false);
+    }
 
     nh_.param<int>("max_number_frames", maxFrameNumber_, 1000000);
     nh_.param<bool>("images_are_compressed", imagesAreCompressed_, false);
     nh_.param<bool>("annotate_images", annotateImages_, false);
+    std::string bayerPattern;
+    nh_.param<std::string>("bayer_pattern", bayerPattern, "BG");
+    bayerPattern_ = parse_bayer_pattern(bayerPattern);
+    // detect on half resolution grey images (compressed images only)
+    nh_.param<bool>("half_resolution", halfResolution_, false);
+    if (!nh_.getParam("decimation_factors", decimation_)) {
+      int decimation;
+      nh_.param<int>("decimation_factor", decimation, 1);
+      decimation_.resize(tagTopics_.size(), decimation);
+    }
+    if (decimation_.size() != tagTopics_.size()) {
+      ROS_ERROR("must have same number of decimation_factors and tag_topics!");
+      return (false);
+    }
+    for (const auto &d: decimation_) {
+      if (d < 1) {
+        ROS_ERROR_STREAM("invalid decimation factor: " << d);
+        return (false);
+      }
+    }
+    nh_.param<bool>("benchmark_decimation", benchmarkDecimation_, false);
+    decimationStats_.resize(tagTopics_.size());
+    nh_.param<bool>("roi_tracking", roiTracking_, false);
+    if (roiTracking_) {
+      int fullFrameInterval, minPadding;
+      double padding;
+      nh_.param<int>("full_frame_interval", fullFrameInterval, 10);
+      nh_.param<double>("roi_padding", padding, 0.5);
+      nh_.param<int>("roi_min_padding", minPadding, 20);
+      trackers_.resize(tagTopics_.size(),
+                       TagTracker(fullFrameInterval, padding, minPadding));
+    }
     std::string bagFile;
     nh_.param<std::string>("bag_file", bagFile, "");
     std::string outfname;
     nh_.param<std::string>("output_bag_file", outfname, "output.bag");
-    outbag_.open(outfname, rosbag::bagmode::Write);
+    std::string compression;
+    nh_.param<std::string>("output_bag_compression", compression, "none");
+    outbag_.open(outfname, BagWriter::parse_compression(compression));
     if (!bagFile.empty()) {
       processBag(bagFile);
     } else {
@@ -75,23 +117,226 @@ namespace tagslam {
   }
 
 
+  // Bayer patterns use opencv naming: the colors of the second
+  // and third pixel in the second row.
+  SyncAndDetect::BayerPattern
+  SyncAndDetect::parse_bayer_pattern(const std::string &pattern) {
+    if (pattern == "BG") {
+      return (BayerPattern{cv::COLOR_BayerBG2GRAY, cv::COLOR_BayerBG2BGR,
+            cv::Point(0, 0), cv::Point(1, 1)});
+    } else if (pattern == "RG") {
+      return (BayerPattern{cv::COLOR_BayerRG2GRAY, cv::COLOR_BayerRG2BGR,
+            cv::Point(1, 1), cv::Point(0, 0)});
+    } else if (pattern == "GB") {
+      return (BayerPattern{cv::COLOR_BayerGB2GRAY, cv::COLOR_BayerGB2BGR,
+            cv::Point(1, 0), cv::Point(0, 1)});
+    } else if (pattern == "GR") {
+      return (BayerPattern{cv::COLOR_BayerGR2GRAY, cv::COLOR_BayerGR2BGR,
+            cv::Point(0, 1), cv::Point(1, 0)});
+    }
+    throw std::runtime_error("invalid bayer pattern: " + pattern);
+  }
+
+  void SyncAndDetect::bayerToGrey(const cv::Mat &raw, cv::Mat *grey) const {
+    if (!halfResolution_) {
+      cv::cvtColor(raw, *grey, bayerPattern_.toGrey);
+      return;
+    }
+    // one output pixel per 2x2 block, luminance weights in 8 bit
+    // fixed point: 77 * R + 75 * (G1 + G2) + 29 * B
+    grey->create(raw.rows / 2, raw.cols / 2, CV_8UC1);
+    const cv::Point &r = bayerPattern_.red;
+    const cv::Point &b = bayerPattern_.blue;
+    const cv::Point g1(r.x, b.y), g2(b.x, r.y);
+    for (const auto y: irange(0, grey->rows)) {
+      const uint8_t *row[2] = {raw.ptr<uint8_t>(2 * y),
+                               raw.ptr<uint8_t>(2 * y + 1)};
+      uint8_t *out = grey->ptr<uint8_t>(y);
+      for (const auto x: irange(0, grey->cols)) {
+        const int x2 = 2 * x;
+        const unsigned int v =
+          77 * row[r.y][x2 + r.x] + 29 * row[b.y][x2 + b.x] +
+          75 * (row[g1.y][x2 + g1.x] + row[g2.y][x2 + g2.x]);
+        out[x] = (uint8_t)((v + 128) >> 8);
+      }
+    }
+  }
+
+  // moves tags detected on a downscaled image to full resolution
+  static void scale_tags(int s, TagTracker::TagVec *tags) {
+    for (auto &tag: *tags) {
+      // pixel centers have a half pixel shift
+      tag.center.x = (tag.center.x + 0.5) * s - 0.5;
+      tag.center.y = (tag.center.y + 0.5) * s - 0.5;
+      for (auto &c: tag.corners) {
+        c.x = (c.x + 0.5) * s - 0.5;
+        c.y = (c.y + 0.5) * s - 0.5;
+      }
+      // H' = [s 0 (s-1)/2; 0 s (s-1)/2; 0 0 1] * H
+      const double o = 0.5 * (s - 1);
+      for (const auto k: irange(0, 3)) {
+        tag.H[k]     = s * tag.H[k]     + o * tag.H[6 + k];
+        tag.H[3 + k] = s * tag.H[3 + k] + o * tag.H[6 + k];
+      }
+    }
+  }
+
+  TagTracker::TagVec SyncAndDetect::detect(const cv::Mat &grey) {
+    if (detectors_.size() == 1) {
+      return (detectors_[0]->Detect(grey));
+    }
+    std::vector<TagTracker::TagVec> tags(detectors_.size());
+    // Each family is a full detection pass. They only run in
+    // parallel for a single camera: with several, detect() is
+    // called from the parallel loop over cameras in processCVMat(),
+    // and the nested region gets one thread. The Umich detector is
+    // run serially throughout.
+#pragma omp parallel for if (detectorType_ != "Umich")
+    for (int i = 0; i < (int)detectors_.size(); i++) {
+      tags[i] = detectors_[i]->Detect(grey);
+    }
+    TagTracker::TagVec merged;
+    for (const auto &t: tags) {
+      merged.insert(merged.end(), t.begin(), t.end());
+    }
+    return (merged);
+  }
+
+  TagTracker::TagVec
+  SyncAndDetect::detectDecimated(int cam, const cv::Mat &grey) {
+    const int d = decimation_[cam];
+    if (d == 1) {
+      return (detect(grey));
+    }
+    // find quads on the downscaled image ...
+    cv::Mat small;
+    cv::resize(grey, small, cv::Size(), 1.0 / d, 1.0 / d, cv::INTER_AREA);
+    TagTracker::TagVec tags = detect(small);
+    if (tags.empty()) {
+      return (tags);
+    }
+    // ... move them to full resolution, including the homography ...
+    scale_tags(d, &tags);
+    // ... then refine the corners on the full resolution image
+    std::vector<cv::Point2f> corners;
+    for (const auto &tag: tags) {
+      for (const auto &c: tag.corners) {
+        corners.push_back(cv::Point2f(c.x, c.y));
+      }
+    }
+    cv::cornerSubPix(grey, corners, cv::Size(d + 1, d + 1), cv::Size(-1, -1),
+                     cv::TermCriteria(cv::TermCriteria::EPS +
+                                      cv::TermCriteria::COUNT, 20, 0.01));
+    for (const auto i: irange(0ul, tags.size())) {
+      auto &tag = tags[i];
+      for (const auto j: irange(0, 4)) {
+        tag.corners[j].x = corners[4 * i + j].x;
+        tag.corners[j].y = corners[4 * i + j].y;
+      }
+      // center is the intersection of the diagonals
+      const cv::Point2f &p0 = corners[4 * i], &p1 = corners[4 * i + 1];
+      const cv::Point2f &p2 = corners[4 * i + 2], &p3 = corners[4 * i + 3];
+      const cv::Point2f d1 = p2 - p0, d2 = p3 - p1;
+      const double den = d1.x * d2.y - d1.y * d2.x;
+      if (std::abs(den) > 1e-9) {
+        const cv::Point2f dp = p1 - p0;
+        const double s = (dp.x * d2.y - dp.y * d2.x) / den;
+        tag.center.x = p0.x + s * d1.x;
+        tag.center.y = p0.y + s * d1.y;
+      }
+    }
+    return (tags);
+  }
+
+  void SyncAndDetect::compareToFullResolution(int cam, const cv::Mat &grey,
+                                              const TagTracker::TagVec &tags) {
+    const TagTracker::TagVec full = detect(grey);
+    DecimationStats &st = decimationStats_[cam];
+    for (const auto &ref: full) {
+      st.numFull++;
+      for (const auto &tag: tags) {
+        if (tag.id == ref.id && tag.bits == ref.bits) {
+          st.numFound++;
+          for (const auto j: irange(0, 4)) {
+            const double dx = tag.corners[j].x - ref.corners[j].x;
+            const double dy = tag.corners[j].y - ref.corners[j].y;
+            st.cornerError += std::sqrt(dx * dx + dy * dy);
+            st.numCorners++;
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  void SyncAndDetect::printDecimationBenchmark() const {
+    for (const auto i: irange(0ul, decimationStats_.size())) {
+      const DecimationStats &st = decimationStats_[i];
+      ROS_INFO_STREAM(tagTopics_[i] << " decimation: " << decimation_[i]
+                      << " recall: " << st.numFound << "/" << st.numFull
+                      << " (" << (st.numFull > 0 ?
+                                  100.0 * st.numFound / st.numFull : 0.0)
+                      << "%) avg corner err: " << (st.numCorners > 0 ?
+                        st.cornerError / st.numCorners : 0.0) << " px");
+    }
+  }
+
+  TagTracker::TagVec
+  SyncAndDetect::detectTags(int cam, const cv::Mat &grey) {
+    if (!roiTracking_) {
+      const TagTracker::TagVec tags = detectDecimated(cam, grey);
+      if (benchmarkDecimation_) {
+        compareToFullResolution(cam, grey, tags);
+      }
+      return (tags);
+    }
+    TagTracker &tracker = trackers_[cam];
+    if (tracker.needsFullFrame()) {
+      const TagTracker::TagVec tags = detectDecimated(cam, grey);
+      tracker.update(tags, true);
+      return (tags);
+    }
+    TagTracker::TagVec tags;
+    std::set<std::pair<int, int>> found; // (bits, id)
+    for (const auto &roi: tracker.predictRois(grey.size())) {
+      // clone so the detector gets a continuous image
+      for (auto tag: detectDecimated(cam, grey(roi).clone())) {
+        if (found.insert(std::make_pair(tag.bits, tag.id)).second) {
+          TagTracker::shift(roi.tl(), &tag);
+          tags.push_back(tag);
+        }
+      }
+    }
+    tracker.update(tags, false);
+    return (tags);
+  }
+
   void SyncAndDetect::processCVMat(const std::vector<std_msgs::Header> &headers,
                                    const std::vector<cv::Mat> &grey,
                                    const std::vector<cv::Mat> &imgs) {
     int totTags(0);
     typedef std::vector<apriltag_msgs::Apriltag> TagVec;
     std::vector<TagVec> allTags(grey.size());
+    profiler_.reset();
     if (detectorType_ == "Umich") {
       for (int i = 0; i < (int)grey.size(); i++) {
-        allTags[i] = detector_->Detect(grey[i]);
+        allTags[i] = detectTags(i, grey[i]);
       }
     } else {
 #pragma omp parallel for
       for (int i = 0; i < (int)grey.size(); i++) {
-        allTags[i] = detector_->Detect(grey[i]);
+        allTags[i] = detectTags(i, grey[i]);
       }
     }
 
+    // half resolution grey images come from compressed bayer images
+    for (const auto i: irange(0ul, grey.size())) {
+      const int s = (int) std::round((double) imgs[i].cols / grey[i].cols);
+      if (s > 1) {
+        scale_tags(s, &allTags[i]);
+      }
+    }
+    profiler_.record("detect");
     sensor_msgs::CompressedImage msg;
     msg.format = "jpeg";
     std::vector<int> param(2);
@@ -99,6 +344,7 @@ namespace tagslam {
     param[1] = 80;//default(95) 0-100
 
     for (const auto i: irange(0ul, grey.size())) {
+      profiler_.reset();
       const std::vector<apriltag_msgs::Apriltag> tags = allTags[i];
       totTags += tags.size();
       apriltag_msgs::ApriltagArrayStamped tagMsg;
@@ -108,7 +354,9 @@ namespace tagslam {
       }
       if(headers[i].stamp.toSec() != 0)
         outbag_.write<apriltag_msgs::ApriltagArrayStamped>(tagTopics_[i], headers[i].stamp, tagMsg);
+      profiler_.record("queueTags");
       if (annotateImages_) {
+        profiler_.reset();
         cv::Mat colorImg = imgs[i].clone();
         if (!tags.empty()) {
           apriltag_ros::DrawApriltags(colorImg, tags);
@@ -116,9 +364,11 @@ namespace tagslam {
         
         msg.header = headers[i];
         cv::imencode(".jpg", colorImg, msg.data, param);
+        profiler_.record("encodeImage");
 
         if(headers[i].stamp.toSec() != 0)
           outbag_.write<sensor_msgs::CompressedImage>(imageOutputTopics_[i], headers[i].stamp, msg);
+        profiler_.record("queueImage");
       }
     }
     ROS_INFO_STREAM("frame " << fnum_ << " " << headers[0].stamp << " detected "
@@ -135,13 +385,17 @@ namespace tagslam {
     std::vector<std_msgs::Header> headers;
     for (const auto i: irange(0ul, msgvec.size())) {
       const auto &img = msgvec[i];
-      cv::Mat im1 = cv_bridge::toCvCopy(img, sensor_msgs::image_encodings::MONO8)->image;
-      cv::Mat im;
-      cv::cvtColor(im1, im, cv::COLOR_BayerBG2BGR);
-      images.push_back(im);
+      cv::Mat raw = cv_bridge::toCvCopy(img, sensor_msgs::image_encodings::MONO8)->image;
       cv::Mat im_grey;
-      cv::cvtColor(im, im_grey, cv::COLOR_BGR2GRAY);
+      bayerToGrey(raw, &im_grey);
       grey_images.push_back(im_grey);
+      if (annotateImages_) {
+        cv::Mat im;
+        cv::cvtColor(raw, im, bayerPattern_.toBGR);
+        images.push_back(im);
+      } else {
+        images.push_back(raw); // only used for its size
+      }
       headers.push_back(img->header);
     }
     processCVMat(headers, grey_images, images);
@@ -156,10 +410,13 @@ namespace tagslam {
     std::vector<std_msgs::Header> headers;
     for (const auto i: irange(0ul, msgvec.size())) {
       const auto &img = msgvec[i];
-      cv::Mat im = cv_bridge::toCvCopy(img, sensor_msgs::image_encodings::BGR8)->image;
-      images.push_back(im);
       cv::Mat im_grey = cv_bridge::toCvCopy(img, sensor_msgs::image_encodings::MONO8)->image;
       grey_images.push_back(im_grey);
+      if (annotateImages_) {
+        images.push_back(cv_bridge::toCvCopy(img, sensor_msgs::image_encodings::BGR8)->image);
+      } else {
+        images.push_back(im_grey);
+      }
       headers.push_back(img->header);
     }
     processCVMat(headers, grey_images, images);
@@ -180,16 +437,28 @@ namespace tagslam {
     }
 
     if (imagesAreCompressed_) {
-      iterate_through_bag<CompressedImage>(imageTopics_, &view, &outbag_,
+      iterate_through_bag<CompressedImage>(imageTopics_, &view,
                                            std::bind(&SyncAndDetect::processCompressedImages,
                                                      this, std::placeholders::_1));
     } else {
-      iterate_through_bag<sensor_msgs::Image>(imageTopics_,&view, &outbag_,
+      iterate_through_bag<sensor_msgs::Image>(imageTopics_, &view,
                                               std::bind(&SyncAndDetect::processImages,
                                                         this, std::placeholders::_1));
     }
     bag.close();
-    ros::shutdown();
+    outbag_.close();
+    printProfile();
+    if (benchmarkDecimation_) {
+      printDecimationBenchmark();
+    }
+  }
+
+  void SyncAndDetect::printProfile() const {
+    // detection and jpeg encoding on the processing thread, the
+    // queue times show how long writing blocked processing
+    ROS_INFO_STREAM("processing profile:" << std::endl << profiler_);
+    // serialization, chunk compression and disk I/O
+    ROS_INFO_STREAM("bag writer profile:" << std::endl << outbag_.getProfiler());
   }
   
 }  // namespace
@@ -11,8 +11,9 @@ int main(int argc, char** argv) {
 
   try {
     tagslam::SyncAndDetect node(pnh);
+    // processes the whole bag, then the node is done
     node.initialize();
-    ros::spin();
+    ros::shutdown();
   } catch (const std::exception& e) {
     ROS_ERROR("%s: %s", pnh.getNamespace().c_str(), e.what());
   }
@@ -0,0 +1,37 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/sync_and_detect.h"
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <memory>
+#include <thread>
+
+namespace tagslam {
+  class SyncAndDetectNodelet : public nodelet::Nodelet {
+  public:
+    ~SyncAndDetectNodelet() {
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+    }
+    void onInit() override {
+      node_.reset(new SyncAndDetect(getPrivateNodeHandle()));
+      // processing the bag takes long, don't block the manager
+      thread_ = std::thread([this]() {
+          if (!node_->initialize()) {
+            NODELET_ERROR("sync and detect failed!");
+          } else {
+            // leave the manager and the other nodelets running
+            NODELET_INFO("sync and detect finished processing bag");
+          }
+        });
+    }
+  private:
+    std::unique_ptr<SyncAndDetect> node_;
+    std::thread                    thread_;
+  };
+}
+
+PLUGINLIB_EXPORT_CLASS(tagslam::SyncAndDetectNodelet, nodelet::Nodelet)
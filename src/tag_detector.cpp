@@ -0,0 +1,71 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/tag_detector.h"
+#include <apriltag_msgs/ApriltagArrayStamped.h>
+#include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
+#include <stdexcept>
+
+namespace tagslam {
+  using TagArray = apriltag_msgs::ApriltagArrayStamped;
+
+  TagDetector::TagDetector(const ros::NodeHandle &nh,
+                           const std::string &imageTopic,
+                           const std::string &tagTopic,
+                           const std::string &detectorType,
+                           const std::vector<std::string> &families,
+                           int borderWidth) : nh_(nh) {
+    detectors_ = make_detectors(detectorType, families, borderWidth);
+    pub_ = nh_.advertise<TagArray>(tagTopic, 1);
+    sub_ = nh_.subscribe(imageTopic, 1, &TagDetector::callback, this);
+  }
+
+  std::vector<TagDetector::DetectorPtr>
+  TagDetector::make_detectors(const std::string &detectorType,
+                              const std::vector<std::string> &families,
+                              int borderWidth) {
+    apriltag_ros::DetectorType type;
+    if (detectorType == "Mit") {
+      type = apriltag_ros::DetectorType::Mit;
+    } else if (detectorType == "Umich") {
+      type = apriltag_ros::DetectorType::Umich;
+    } else {
+      throw std::runtime_error("invalid detector type: " + detectorType);
+    }
+    std::vector<DetectorPtr> detectors;
+    for (const auto &family: families) {
+      apriltag_ros::TagFamily tf;
+      if (family == "36h11") {
+        tf = apriltag_ros::TagFamily::tf36h11;
+      } else if (family == "25h9") {
+        tf = apriltag_ros::TagFamily::tf25h9;
+      } else if (family == "16h5") {
+        tf = apriltag_ros::TagFamily::tf16h5;
+      } else {
+        throw std::runtime_error("invalid tag family: " + family);
+      }
+      detectors.push_back(apriltag_ros::ApriltagDetector::Create(type, tf));
+      detectors.back()->set_black_border(borderWidth);
+    }
+    if (detectors.empty()) {
+      throw std::runtime_error("must specify at least one tag family!");
+    }
+    return (detectors);
+  }
+
+  void TagDetector::callback(const sensor_msgs::ImageConstPtr &img) {
+    // shares the image data if it is already mono8
+    cv_bridge::CvImageConstPtr grey =
+      cv_bridge::toCvShare(img, sensor_msgs::image_encodings::MONO8);
+    TagArray::Ptr tags(new TagArray());
+    tags->header = img->header;
+    // the cameras run in parallel already, so the families don't
+    for (const auto &detector: detectors_) {
+      const auto t = detector->Detect(grey->image);
+      tags->apriltags.insert(tags->apriltags.end(), t.begin(), t.end());
+    }
+    pub_.publish(tags);
+  }
+}  // namespace
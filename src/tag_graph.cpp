@@ -4,7 +4,6 @@
 
 #include "tagslam/tag_graph.h"
 #include "tagslam/point_distance_factor.h"
-#include "tagslam/cal3ds2u.h"
 #include <boost/range/irange.hpp>
 #include <gtsam/slam/expressions.h>
 #include <gtsam/slam/PriorFactor.h>
@@ -13,6 +12,7 @@
 #include <gtsam/slam/ReferenceFrameFactor.h>
 #include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
 #include <gtsam/nonlinear/Marginals.h>
+#include <cmath>
 
 namespace tagslam {
   // you can probably bump MAX_TAG_ID without too much trouble,
@@ -21,6 +21,12 @@ namespace tagslam {
   // TODO: safeguard against overflow!
   static const unsigned int MAX_TAG_ID = 255;
   static const unsigned int MAX_BODY_ID = 'Z' - 'A' - 1;
+  // A smart tag factor in isam is only replaced once its static
+  // averages moved by this many pixels or gained this factor in
+  // weight. Otherwise every static observation would trigger a
+  // relinearization of all poses the factor connects.
+  static const double SMART_TAG_PIXEL_TOL = 0.05;
+  static const double SMART_TAG_COUNT_TOL = 1.25;
 
   typedef gtsam::GenericProjectionFactor<gtsam::Pose3,
                                          gtsam::Point3,
@@ -64,7 +70,15 @@ namespace tagslam {
     return (frame_num);
   }
 
-  TagGraph::TagGraph() {
+  static gtsam::ISAM2Params make_isam2_params() {
+    gtsam::ISAM2Params p;
+    // replaced factors leave a null slot in isam's factor graph,
+    // reuse those or the graph grows with every static observation
+    p.findUnusedFactorSlots = true;
+    return (p);
+  }
+
+  TagGraph::TagGraph() : graph_(make_isam2_params()) {
     pixelNoise_= gtsam::noiseModel::Isotropic::Sigma(2, 1.0);
   }
 
@@ -110,10 +124,22 @@ namespace tagslam {
       PoseNoise tagNoise = tag->poseEstimate.getNoise();
       // ----- insert transform T_b_o and pin it down with prior factor if known
       gtsam::Symbol T_b_o_sym = sym_T_b_o(tag->id);
-      if (values_.find(T_b_o_sym) != values_.end()) {
+      if (hasTagPose(tag->id)) {
         std::cout << "TagGraph ERROR: duplicate tag id inserted: " << tag->id << std::endl;
         return;
       }
+      if (tag->hasKnownPose && rb->fixKnownTagPoses) {
+        // no variable, the tag pose enters the factors as constant
+        fixedTagPoses_[tag->id] = tagPose;
+        continue;
+      }
+      if (!tag->hasKnownPose && useSmartTagFactors_) {
+        // no variable, the factor is created on first observation
+        smartTags_[tag->id].factor.reset(
+          new SmartTagFactor(tag->getObjectCorners(),
+                             pixelNoise_->sigma(), tagPose, smartTagMaxObs_));
+        continue;
+      }
       newValues.insert(T_b_o_sym, tagPose);
       if (tag->hasKnownPose) {
         graph.push_back(gtsam::PriorFactor<gtsam::Pose3>(T_b_o_sym, tagPose, tagNoise));
@@ -144,23 +170,21 @@ namespace tagslam {
     }
     const auto T_w_b1_sym = sym_T_w_b(rb1->index, 0);
     const auto T_w_b2_sym = sym_T_w_b(rb2->index, 0);
-    const auto T_b1_o_sym = sym_T_b_o(tag1->id);
-    const auto T_b2_o_sym = sym_T_b_o(tag2->id);
 
     if (!values_.exists(T_w_b1_sym) || !values_.exists(T_w_b2_sym) ||
-        !values_.exists(T_b1_o_sym) || !values_.exists(T_b2_o_sym)) {
+        !hasTagPoseExpression(tag1->id) || !hasTagPoseExpression(tag2->id)) {
       //std::cout << "TagGraph: NOT adding rb measurement: " << dm.tag1 << " to " << dm.tag2 << std::endl;
       return (false);
     } else {
       std::cout << "TagGraph adding rb measurement: " << dm.tag1 << " to " << dm.tag2 << std::endl;
     }
     gtsam::Expression<gtsam::Pose3>  T_w_b_1(T_w_b1_sym);
-    gtsam::Expression<gtsam::Pose3>  T_b_o_1(T_b1_o_sym);
+    gtsam::Expression<gtsam::Pose3>  T_b_o_1 = tagPoseExpression(tag1->id);
     gtsam::Expression<gtsam::Point3> X_o_1(tag1->getObjectCorner(dm.corner1));
     gtsam::Expression<gtsam::Point3> X_w_1 = gtsam::transform_from(T_w_b_1, gtsam::transform_from(T_b_o_1, X_o_1));
     
     gtsam::Expression<gtsam::Pose3>  T_w_b_2(T_w_b2_sym);
-    gtsam::Expression<gtsam::Pose3>  T_b_o_2(T_b2_o_sym);
+    gtsam::Expression<gtsam::Pose3>  T_b_o_2 = tagPoseExpression(tag2->id);
     gtsam::Expression<gtsam::Point3> X_o_2(tag2->getObjectCorner(dm.corner2));
     gtsam::Expression<gtsam::Point3> X_w_2 = gtsam::transform_from(T_w_b_2, gtsam::transform_from(T_b_o_2, X_o_2));
 
@@ -186,17 +210,15 @@ namespace tagslam {
                           const TagConstPtr &tag2, int corner2) const {
     const auto T_w_b1_sym = sym_T_w_b(rb1->index, 0);
     const auto T_w_b2_sym = sym_T_w_b(rb2->index, 0);
-    const auto T_b1_o_sym = sym_T_b_o(tag1->id);
-    const auto T_b2_o_sym = sym_T_b_o(tag2->id);
-
+    gtsam::Pose3 T_b1_o, T_b2_o;
     if (!values_.exists(T_w_b1_sym) || !values_.exists(T_w_b2_sym) ||
-        !values_.exists(T_b1_o_sym) || !values_.exists(T_b2_o_sym)) {
+        !getTagPose(tag1->id, &T_b1_o) || !getTagPose(tag2->id, &T_b2_o)) {
       return (std::pair<gtsam::Point3,bool>(gtsam::Point3(), false));
     }
     const gtsam::Point3 X_w_1 = values_.at<gtsam::Pose3>(T_w_b1_sym) *
-      values_.at<gtsam::Pose3>(T_b1_o_sym) * tag1->getObjectCorner(corner1);
+      T_b1_o * tag1->getObjectCorner(corner1);
     const gtsam::Point3 X_w_2 = values_.at<gtsam::Pose3>(T_w_b2_sym) *
-      values_.at<gtsam::Pose3>(T_b2_o_sym) * tag2->getObjectCorner(corner2);
+      T_b2_o * tag2->getObjectCorner(corner2);
     return (std::pair<gtsam::Point3,bool>(X_w_1 - X_w_2, true));
   }
 
@@ -210,13 +232,12 @@ namespace tagslam {
       return (false);
     }
     const auto T_w_b_sym = sym_T_w_b(rb->index, 0);
-    const auto T_b_o_sym = sym_T_b_o(tag->id);
-    if (!values_.exists(T_w_b_sym) || !values_.exists(T_b_o_sym)) {
+    if (!values_.exists(T_w_b_sym) || !hasTagPoseExpression(tag->id)) {
       return (false);
     }
     std::cout << "TagGraph adding position measurement: " << m.tag << std::endl;
     gtsam::Expression<gtsam::Pose3>  T_w_b(T_w_b_sym);
-    gtsam::Expression<gtsam::Pose3>  T_b_o(T_b_o_sym);
+    gtsam::Expression<gtsam::Pose3>  T_b_o = tagPoseExpression(tag->id);
     gtsam::Expression<gtsam::Point3> X_o(tag->getObjectCorner(m.corner));
     gtsam::Expression<gtsam::Point3> X_w = gtsam::transform_from(T_w_b, gtsam::transform_from(T_b_o, X_o));
     gtsam::Expression<gtsam::Point3> n(m.dir);
@@ -231,13 +252,12 @@ namespace tagslam {
   TagGraph::getPosition(const RigidBodyPtr &rb, const TagConstPtr &tag,
                         int corner) const {
     const auto T_w_b_sym = sym_T_w_b(rb->index, 0);
-    const auto T_b_o_sym = sym_T_b_o(tag->id);
-
-    if (!values_.exists(T_w_b_sym) || !values_.exists(T_b_o_sym)) {
+    gtsam::Pose3 T_b_o;
+    if (!values_.exists(T_w_b_sym) || !getTagPose(tag->id, &T_b_o)) {
       return (std::pair<gtsam::Point3,bool>(gtsam::Point3(), false));
     }
     const gtsam::Point3 X_w = values_.at<gtsam::Pose3>(T_w_b_sym) *
-      values_.at<gtsam::Pose3>(T_b_o_sym) * tag->getObjectCorner(corner);
+      T_b_o * tag->getObjectCorner(corner);
     return (std::pair<gtsam::Point3,bool>(X_w, true));
   }
 
@@ -251,6 +271,41 @@ namespace tagslam {
     return (pe);
   }
 
+  void TagGraph::aggregateObservation(const ObsKey &key,
+                                      const gtsam::Expression<gtsam::Point2> &predict,
+                                      const gtsam::Point2 &measured) {
+    AggregatedObservation &ao = aggregatedObs_[key];
+    // n identical factors with noise sigma and measurements z_i
+    // are equivalent to a single factor with noise sigma/sqrt(n)
+    // and measurement mean(z_i), up to a constant.
+    ao.count++;
+    ao.mean = ao.mean + (measured - ao.mean) / (double) ao.count;
+    auto noise = gtsam::noiseModel::Isotropic::Sigma(
+      2, pixelNoise_->sigma() / std::sqrt((double) ao.count));
+    replaceFactor(&ao, boost::make_shared<gtsam::ExpressionFactor<gtsam::Point2>>(
+                    noise, ao.mean, predict));
+  }
+
+  void TagGraph::replaceFactor(ReplaceableFactor *rf,
+                               const gtsam::NonlinearFactor::shared_ptr &factor) {
+    if (rf->isPending) {
+      // previous version hasn't made it into isam yet
+      newGraph_.replace(rf->newGraphIndex, factor);
+      return;
+    }
+    if (rf->isInGraph) {
+      factorsToRemove_.push_back(rf->factorIndex);
+    }
+    rf->isPending = true;
+    rf->newGraphIndex = newGraph_.size();
+    newGraph_.push_back(factor);
+    pendingFactors_.push_back(rf);
+  }
+
+  bool TagGraph::hasCameraPose(const CameraConstPtr &cam) const {
+    return (values_.exists(sym_T_r_c(cam->index)));
+  }
+
   void TagGraph::observedTags(const CameraPtr &cam, 
                               const RigidBodyPtr &rb, const TagVec &tags,
                               unsigned int frame_num) {
@@ -316,7 +371,22 @@ namespace tagslam {
         continue;
       }
       const auto &measured = tag->getImageCorners();
-      gtsam::Expression<gtsam::Pose3>  T_b_o(sym_T_b_o(tag->id));
+      auto st = smartTags_.find(tag->id);
+      if (st != smartTags_.end()) {
+        // collect the observations, the factor in the graph is
+        // replaced only once per update, see flushSmartTags()
+        SmartTag &smt = st->second;
+        if (!smt.updated) {
+          gtsam::Pose3 T_b_o;
+          getTagPose(tag->id, &T_b_o);
+          smt.updated.reset(new SmartTagFactor(*smt.factor, T_b_o));
+        }
+        smt.updated->addObservation(cam->projector, T_w_r_sym, T_r_c_sym,
+                                    T_w_b_sym, camRig->isStatic && rb->isStatic,
+                                    measured);
+        continue;
+      }
+      gtsam::Expression<gtsam::Pose3>  T_b_o = tagPoseExpression(tag->id);
       gtsam::Expression<gtsam::Pose3>  T_w_b(T_w_b_sym);
       gtsam::Expression<gtsam::Pose3>  T_r_c(T_r_c_sym);
       gtsam::Expression<gtsam::Pose3>  T_w_r(sym_T_w_r_t(camRig->index, camRig->isStatic ? 0 : frame_num));
@@ -325,14 +395,13 @@ namespace tagslam {
         // transform_from does X_A = T_AB * X_B
         // transform_to   does X_A = T_BA * X_B
         gtsam::Expression<gtsam::Point3> X_w = gtsam::transform_from(T_w_b, gtsam::transform_from(T_b_o, X_o));
-        gtsam::Expression<gtsam::Point2> xp  = gtsam::project(gtsam::transform_to(T_r_c, gtsam::transform_to(T_w_r, X_w)));
-        if (cam->radtanModel) {
-          gtsam::Expression<Cal3DS2U> cK(*cam->radtanModel);
-          gtsam::Expression<gtsam::Point2> predict(cK, &Cal3DS2U::uncalibrate, xp);
-          newGraph_.addExpressionFactor(predict, measured[i], pixelNoise_);
-        } else if (cam->equidistantModel) {
-          gtsam::Expression<Cal3FS2> cK(*cam->equidistantModel);
-          gtsam::Expression<gtsam::Point2> predict(cK, &Cal3FS2::uncalibrate, xp);
+        gtsam::Expression<gtsam::Point3> X_c = gtsam::transform_to(T_r_c, gtsam::transform_to(T_w_r, X_w));
+        gtsam::Expression<gtsam::Point2> predict = Projector::make_expression(cam->projector, X_c);
+        if (camRig->isStatic && rb->isStatic) {
+          // all variables are frame-independent, so fold this
+          // observation into the existing factor
+          aggregateObservation(ObsKey(cam->index, tag->id, i), predict, measured[i]);
+        } else {
           newGraph_.addExpressionFactor(predict, measured[i], pixelNoise_);
         }
       }
@@ -369,11 +438,55 @@ namespace tagslam {
     }
   }
 
+  gtsam::Matrix6 TagGraph::getMarginalCovariance(const gtsam::Symbol &sym) const {
+    // variables not yet in isam have no covariance
+    if (!graph_.valueExists(sym)) {
+      return (gtsam::Matrix6::Zero());
+    }
+    return (graph_.marginalCovariance(sym));
+  }
+
+  gtsam::Matrix6 TagGraph::getStaticBodyCovariance(const RigidBodyConstPtr &rb) const {
+    return (getMarginalCovariance(sym_T_w_b(rb->index, 0)));
+  }
+
+  gtsam::Matrix6 TagGraph::getTagCovariance(int tagId) const {
+    return (getMarginalCovariance(sym_T_b_o(tagId)));
+  }
+
+  void TagGraph::flushSmartTags() {
+    for (auto &st: smartTags_) {
+      SmartTag &smt = st.second;
+      if (!smt.updated) {
+        continue;
+      }
+      if (smt.isInGraph &&
+          smt.updated->isSimilar(*smt.factor, SMART_TAG_PIXEL_TOL,
+                                 SMART_TAG_COUNT_TOL)) {
+        // keep collecting in smt.updated
+        continue;
+      }
+      smt.factor = smt.updated;
+      smt.updated.reset();
+      replaceFactor(&smt, smt.factor);
+    }
+  }
+
   double TagGraph::tryOptimization(gtsam::Values *result,
                                    const gtsam::ISAM2 &graph,
                                    const gtsam::Values &values,
                                    const std::string &verbosity, int maxIter) {
-    graph_.update(newGraph_, newValues_);
+    flushSmartTags();
+    const gtsam::ISAM2Result res = graph_.update(newGraph_, newValues_, factorsToRemove_);
+    // remember where isam put the replaceable factors, so they
+    // can be replaced next time around
+    for (auto rf: pendingFactors_) {
+      rf->factorIndex = res.newFactorsIndices[rf->newGraphIndex];
+      rf->isPending = false;
+      rf->isInGraph = true;
+    }
+    pendingFactors_.clear();
+    factorsToRemove_.clear();
     newGraph_.erase(newGraph_.begin(), newGraph_.end());
     newValues_.clear();
     *result = graph.calculateEstimate();
@@ -387,15 +500,14 @@ namespace tagslam {
   PoseEstimate TagGraph::getTagWorldPose(const RigidBodyConstPtr &rb,
                                          int tagId, unsigned int frame_num) const {
     PoseEstimate pe;   // defaults to invalid
-    const auto T_b_o_sym = sym_T_b_o(tagId);
-    if (values_.find(T_b_o_sym) != values_.end()) {
+    gtsam::Pose3 T_b_o;
+    if (getTagPose(tagId, &T_b_o)) {
       const auto T_w_b_sym = sym_T_w_b(rb->index, rb->isStatic ? 0:frame_num);
       if (values_.find(T_w_b_sym) != values_.end()) {
         // T_w_o = T_w_b * T_b_o
         // cov(T_w_o, T_w_o) = sum (R_w_b*x) (R_w_b*x)T
         // = R_w_b * cov(T_b_o) * R_w_b^T
-        gtsam::Pose3 T_w_o = values_.at<gtsam::Pose3>(T_w_b_sym) *
-          values_.at<gtsam::Pose3>(T_b_o_sym);
+        gtsam::Pose3 T_w_o = values_.at<gtsam::Pose3>(T_w_b_sym) * T_b_o;
         pe = PoseEstimate(T_w_o, 0.0, 0, makePoseNoise(0.005, 0.010));
       }
     }
@@ -403,16 +515,62 @@ namespace tagslam {
   }
   
   bool
-  TagGraph::getTagRelPose(const RigidBodyPtr &rb, int tagId,
+  TagGraph::getTagRelPose(const RigidBodyConstPtr &rb, int tagId,
                           gtsam::Pose3 *pose) const {
+    return (getTagPose(tagId, pose));
+  }
+
+  bool TagGraph::hasTagPose(int tagId) const {
+    return (values_.exists(sym_T_b_o(tagId)) ||
+            fixedTagPoses_.count(tagId) != 0 ||
+            smartTags_.count(tagId) != 0);
+  }
+
+  bool TagGraph::getTagPose(int tagId, gtsam::Pose3 *T_b_o) const {
+    const auto it = fixedTagPoses_.find(tagId);
+    if (it != fixedTagPoses_.end()) {
+      *T_b_o = it->second;
+      return (true);
+    }
     const auto T_b_o_sym = sym_T_b_o(tagId);
-    if (values_.find(T_b_o_sym) != values_.end()) {
-      *pose = values_.at<gtsam::Pose3>(T_b_o_sym);
+    if (values_.exists(T_b_o_sym)) {
+      *T_b_o = values_.at<gtsam::Pose3>(T_b_o_sym);
+      return (true);
+    }
+    const auto st = smartTags_.find(tagId);
+    if (st != smartTags_.end()) {
+      if (!st->second.isInGraph) {
+        // not observed yet, use initial guess
+        *T_b_o = st->second.factor->getStartPose();
+        return (true);
+      }
+      // triangulate on demand only
+      auto cached = smartTagPoses_.find(tagId);
+      if (cached == smartTagPoses_.end()) {
+        cached = smartTagPoses_.emplace(
+          tagId, st->second.factor->triangulate(values_)).first;
+      }
+      *T_b_o = cached->second;
       return (true);
     }
     return (false);
   }
 
+  bool TagGraph::hasTagPoseExpression(int tagId) const {
+    // smart tags have no variable that could go into an expression
+    return (values_.exists(sym_T_b_o(tagId)) ||
+            fixedTagPoses_.count(tagId) != 0);
+  }
+
+  gtsam::Expression<gtsam::Pose3>
+  TagGraph::tagPoseExpression(int tagId) const {
+    const auto it = fixedTagPoses_.find(tagId);
+    if (it != fixedTagPoses_.end()) {
+      return (gtsam::Expression<gtsam::Pose3>(it->second));
+    }
+    return (gtsam::Expression<gtsam::Pose3>(sym_T_b_o(tagId)));
+  }
+
   void
   TagGraph::printDistances() const {
     const auto symMin = sym_X_w_i(0, 0, 0);
@@ -476,12 +634,11 @@ namespace tagslam {
     const gtsam::Pose3 T_w_b = values_.at<gtsam::Pose3>(T_w_b_sym);
     std::cout << "TESTPROJ: T_w_b " << T_w_b << std::endl;
     for (const auto &tag: tags) {
-      gtsam::Symbol T_b_o_sym(sym_T_b_o(tag->id));
-      if (!values_.exists(T_b_o_sym)) {
+      gtsam::Pose3 T_b_o;
+      if (!getTagPose(tag->id, &T_b_o)) {
         std::cout << "TagGraph TESTPROJ WARN: tag " << tag->id << " has invalid pose!" << std::endl;
         continue;
       }
-      const gtsam::Pose3 T_b_o = values_.at<gtsam::Pose3>(T_b_o_sym);
       std::cout << "TESTPROJ: T_b_o: " << T_b_o << std::endl;
       const auto &measured = tag->getImageCorners();
       for (const auto i: irange(0, 4)) {
@@ -490,14 +647,7 @@ namespace tagslam {
         const gtsam::Point3 X_r = T_w_r.transform_to(X_w);
         const gtsam::Point3 X_c = T_r_c.transform_to(X_r);
         std::cout << "TESTPROJ " << tag->id << " " << measured[i] << " " << X_c << " X_w: " << X_w << " X_r: " << X_r;
-        gtsam::Point2 pp;
-        if (cam->radtanModel) {
-          const auto cm = gtsam::PinholeCamera<Cal3DS2U>(gtsam::Pose3(), *cam->radtanModel);
-          pp = cm.project(X_c);
-        } else if (cam->equidistantModel) {
-          const auto cm = gtsam::PinholeCamera<Cal3FS2>(gtsam::Pose3(), *cam->equidistantModel);
-          pp = cm.project(X_c);
-        }
+        const gtsam::Point2 pp = cam->projector->projectPoint(X_c);
         const auto dp = pp - measured[i];
         std::cout << " " << dp.x() << " " << dp.y() << " " << std::endl;
       }
@@ -510,6 +660,7 @@ namespace tagslam {
     //double err = tryOptimization(&optimizedValues_, graph_, values_, "TERMINATION", 100);
     tryOptimization(&optimizedValues_, graph_, values_, "TERMINATION", 100);
     values_ = optimizedValues_;
+    smartTagPoses_.clear();
     //optimizedValues_.print();
   }
 
@@ -8,6 +8,7 @@
 #include "tagslam/yaml_utils.h"
 #include "tagslam/rigid_body.h"
 #include "tagslam/bag_sync.h"
+#include "tagslam/pose_change.h"
 #include <XmlRpcException.h>
 #include <rosbag/bag.h>
 #include <rosbag/view.h>
@@ -18,11 +19,14 @@
 #include <opencv2/imgcodecs.hpp>
 #include <eigen_conversions/eigen_msg.h>
 #include <boost/range/irange.hpp>
+#include <boost/bind.hpp>
 #include <math.h>
 #include <fstream>
 #include <iomanip>
 #include <functional>
+#include <algorithm>
 #include <rosgraph_msgs/Clock.h>
+#include <std_msgs/UInt32.h>
 
 //#define DEBUG_POSE_ESTIMATE
 
@@ -39,6 +43,11 @@ namespace tagslam {
   }
 
   TagSlam::~TagSlam() {
+    if (inputQueue_) {
+      inputQueue_->stop();
+    }
+    initWorker_.stop();
+    backEnd_.stop();
   }
 
   bool TagSlam::initialize() {
@@ -47,6 +56,30 @@ namespace tagslam {
     nh_.param<double>("initial_maximum_relative_pixel_error", maxInitErr_, 0.02);
     initialPoseGraph_.setInitialRelativePixelError(maxInitErr_);
     nh_.param<int>("max_number_of_frames", maxFrameNum_, 1000000);
+    // pixel error below which a motion-predicted pose is accepted
+    // without running pnp. Set to zero to disable prediction.
+    nh_.param<double>("max_predicted_pixel_error", maxPredictedPixErr_, 2.0);
+    // a frame becomes a keyframe if any dynamic body moved more
+    // than this since the last keyframe. Zero thresholds make
+    // every frame a keyframe.
+    nh_.param<double>("keyframe_translation_threshold", keyFrameTransThresh_, 0.02);
+    nh_.param<double>("keyframe_rotation_threshold", keyFrameRotThresh_, 0.02);
+    nh_.param<double>("keyframe_max_time_gap", keyFrameMaxTimeGap_, 2.0);
+    nh_.param<double>("static_tf_translation_threshold", staticTfTransThresh_, 0.001);
+    nh_.param<double>("static_tf_rotation_threshold", staticTfRotThresh_, 0.001);
+    // Track against a surveyed map: static bodies, their tags and the
+    // camera extrinsics come from the config and are held fixed. Only
+    // the dynamic poses are solved for, frame by frame, without graph.
+    nh_.param<bool>("localization_only", localizationOnly_, false);
+    // Run the isam update on a separate thread. Front-end poses are
+    // published right away, refined ones on odom_refined/ when ready.
+    nh_.param<bool>("async_back_end", asyncBackEnd_, false);
+    // Minimum time between map snapshots (get_map service and shared
+    // memory) without async back end. They need the marginal
+    // covariances, which are expensive for a large map.
+    nh_.param<double>("map_snapshot_interval", mapSnapshotInterval_, 1.0);
+    nh_.param<double>("frame_deadline", frameDeadline_, 0.0);
+    nh_.param<int>("max_deferred_inits", maxDeferredInits_, 4);
     nh_.param<bool>("write_debug_images", writeDebugImages_, false);
     nh_.param<bool>("has_compressed_images", hasCompressedImages_, false);
     nh_.param<std::string>("param_prefix", paramPrefix_, "tagslam_config");
@@ -63,14 +96,18 @@ namespace tagslam {
                            "camera_poses.yaml");
     ROS_INFO_STREAM("setting pixel noise to: " << pixNoise);
     tagGraph_.setPixelNoise(pixNoise);
+    bool useSmartTagFactors(false);
+    nh_.param<bool>("use_smart_tag_factors", useSmartTagFactors, false);
+    tagGraph_.setUseSmartTagFactors(useSmartTagFactors);
+    int smartTagMaxObs;
+    nh_.param<int>("smart_tag_max_observations", smartTagMaxObs, 50);
+    tagGraph_.setSmartTagMaxObservations(smartTagMaxObs);
     cameras_ = Camera::parse_cameras(nh_);
     if (cameras_.empty()) {
       ROS_ERROR("no cameras found!");
       return (false);
     }
-    if (!subscribe()) {
-      return (false);
-    }
+    nh_.param<std::string>("fixed_frame_id", fixedFrame_, "map");
     for (const auto &cam_idx: irange(0ul, cameras_.size())) {
       camOdomPub_.push_back(
         nh_.advertise<nav_msgs::Odometry>("odom/cam_" +
@@ -87,24 +124,88 @@ namespace tagslam {
     if (!attachCamerasToBodies()) {
       return (false);
     }
-    for (const auto &cam: cameras_) {
-      tagGraph_.addCamera(cam);
+    // fill the frame id cache now, so the back end
+    // thread only ever reads from it
+    for (const auto &rb: allBodies_) {
+      getBodyFrameId(rb);
+    }
+    if (localizationOnly_) {
+      if (!checkFrozenMap()) {
+        return (false);
+      }
+      updateFrozenMapSnapshot();
+    } else {
+      for (const auto &cam: cameras_) {
+        tagGraph_.addCamera(cam);
+      }
     }
     for (const auto &rb: dynamicBodies_) {
       bodyOdomPub_.push_back(
         nh_.advertise<nav_msgs::Odometry>("odom/body_" + rb->name, 1));
+      if (asyncBackEnd_) {
+        refinedBodyOdomPub_.push_back(
+          nh_.advertise<nav_msgs::Odometry>("odom_refined/body_" + rb->name, 1));
+      }
+    }
+    if (asyncBackEnd_ && !localizationOnly_) {
+      backEnd_.start();
+    }
+    if (frameDeadline_ > 0) {
+      initWorker_.start();
     }
-    nh_.param<std::string>("fixed_frame_id", fixedFrame_, "map");
     double maxDegree;
     nh_.param<double>("viewing_angle_threshold", maxDegree, 45.0);
     viewingAngleThreshold_ = std::cos(maxDegree/180.0 * M_PI);
     // play from bag file if file name is non-empty
-    std::string bagFile;
-    nh_.param<std::string>("bag_file", bagFile, "");
-    if (!bagFile.empty()) {
-      playFromBag(bagFile);
+    nh_.param<std::string>("bag_file", bagFile_, "");
+    if (isBagMode()) {
+      // the caller decides whether to shut down
+      playFromBag(bagFile_);
       tagGraph_.printDistances();
-      ros::shutdown();
+      return (true);
+    }
+    // Everything below hands frames or map requests to the
+    // callbacks. In a nodelet, these can run right away, so
+    // all state they use must be complete at this point.
+
+    // Tracking clients in other processes on this host exchange
+    // detections and the map through shared memory.
+    std::string shmName;
+    nh_.param<std::string>("shm_map_name", shmName, "");
+    if (!shmName.empty()) {
+      double pollInterval;
+      nh_.param<double>("shm_poll_interval", pollInterval, 0.005);
+      shmServer_.reset(new ShmMapServer(shmName));
+      shmServer_->writeMap(*getMapSnapshot());
+      shmTimer_ = nh_.createTimer(ros::Duration(pollInterval),
+                                  &TagSlam::pollShmClients, this);
+      ROS_INFO_STREAM("serving map in shared memory: " << shmName);
+    } else {
+      for (const auto &cam: cameras_) {
+        if (cam->isShmClient) {
+          ROS_WARN_STREAM("camera " << cam->name << " is shm_client, "
+                          << "but shm_map_name is not set!");
+        }
+      }
+    }
+    // Live mode: with an input queue, the frames are processed in
+    // a separate thread and dropped by policy when falling behind.
+    std::string queuePolicy;
+    nh_.param<std::string>("input_queue_policy", queuePolicy, "");
+    if (!queuePolicy.empty()) {
+      int queueSize;
+      nh_.param<int>("input_queue_size", queueSize, 5);
+      inputQueue_.reset(new FrameQueue(FrameQueue::parse_policy(queuePolicy),
+                                       queueSize, keyFrameMaxTimeGap_));
+      queueDepthPub_ = nh_.advertise<std_msgs::UInt32>("input_queue/depth", 1);
+      queueDropsPub_ = nh_.advertise<std_msgs::UInt32>("input_queue/dropped", 1);
+      inputQueue_->start(std::bind(&TagSlam::processQueuedFrame, this,
+                                   std::placeholders::_1));
+      ROS_INFO_STREAM("using input queue with policy: " << queuePolicy);
+    }
+    mapService_ = nh_.advertiseService("get_map", &TagSlam::getMap, this);
+    if (!subscribe()) {
+      return (false);
     }
     return (true);
   }
@@ -198,7 +299,9 @@ namespace tagslam {
           }
         }
       }
-      tagGraph_.addTags(rb, tvec);
+      if (!localizationOnly_) {
+        tagGraph_.addTags(rb, tvec);
+      }
       allBodies_.push_back(rb);
       if (rb->isDefaultBody) {
         defaultBody_ = rb;
@@ -208,68 +311,126 @@ namespace tagslam {
     return (true);
   }
 
+  bool TagSlam::checkFrozenMap() const {
+    for (const auto &cam: cameras_) {
+      if (!cam->poseEstimate.isValid()) {
+        ROS_ERROR_STREAM("localization mode: camera " << cam->name
+                         << " has no pose in config!");
+        return (false);
+      }
+    }
+    for (const auto &rb: staticBodies_) {
+      if (!rb->poseEstimate.isValid()) {
+        ROS_ERROR_STREAM("localization mode: static body " << rb->name
+                         << " has no pose in config!");
+        return (false);
+      }
+    }
+    ROS_INFO_STREAM("running in localization mode, tags in map: "
+                    << allTags_.size());
+    return (true);
+  }
+
   bool TagSlam::subscribe() {
-    if (cameras_.size() == 1) {
-      singleCamSub_ = nh_.subscribe(cameras_[0]->tagtopic, 1,
-                                    &TagSlam::callback1, this);
+    // With sync_rigs_separately, each camera rig gets its own
+    // synchronizer, so rigs with independent clocks (e.g. several
+    // robots) can share one map without forming one sync group.
+    bool syncRigsSeparately(false);
+    nh_.param<bool>("sync_rigs_separately", syncRigsSeparately, false);
+    std::map<std::string, std::vector<int>> groups;
+    for (const auto cam_idx: irange(0ul, cameras_.size())) {
+      if (cameras_[cam_idx]->isShmClient) {
+        // detections arrive through shared memory, see pollShmClients()
+        continue;
+      }
+      groups[syncRigsSeparately ? cameras_[cam_idx]->rig_body : ""].push_back(cam_idx);
+    }
+    size_t numSubscribed(0);
+    for (const auto &g: groups) {
+      if (!subscribeGroup(g.second)) {
+        return (false);
+      }
+      numSubscribed += g.second.size();
+    }
+    ROS_INFO_STREAM("subscribed to " << numSubscribed << " cameras in "
+                    << syncGroups_.size() << " sync group(s)");
+    return (true);
+  }
+
+  bool TagSlam::subscribeGroup(const std::vector<int> &cams) {
+    const unsigned int group = syncGroups_.size();
+    std::unique_ptr<SyncGroup> sg(new SyncGroup());
+    sg->cameras = cams;
+    auto &sub = sg->sub;
+    if (cams.size() == 1) {
+      sg->singleCamSub = nh_.subscribe<TagArray>(
+        cameras_[cams[0]]->tagtopic, 1,
+        boost::bind(&TagSlam::callback1, this, group, _1));
     } else {
-      for (const auto &cam : cameras_) {
-        sub_.push_back(std::shared_ptr<TagSubscriber>(
-                         new TagSubscriber(nh_, cam->tagtopic, 1)));
+      for (const auto cam_idx : cams) {
+        sub.push_back(std::shared_ptr<TagSubscriber>(
+                        new TagSubscriber(nh_, cameras_[cam_idx]->tagtopic, 1)));
       }
-      switch (cameras_.size()) {
+      switch (cams.size()) {
       case 2:
-        approxSync2_.reset(new TimeSync2(SyncPolicy2(60/*q size*/),
-                                         *(sub_[0]), *(sub_[1])));
-        approxSync2_->registerCallback(&TagSlam::callback2, this);
+        sg->approxSync2.reset(new TimeSync2(SyncPolicy2(60/*q size*/),
+                                            *(sub[0]), *(sub[1])));
+        sg->approxSync2->registerCallback(
+          boost::bind(&TagSlam::callback2, this, group, _1, _2));
         break;
       case 3:
-        approxSync3_.reset(
+        sg->approxSync3.reset(
           new TimeSync3(SyncPolicy3(60/*q size*/),
-                        *(sub_[0]), *(sub_[1]), *(sub_[2])));
-        approxSync3_->registerCallback(&TagSlam::callback3, this);
+                        *(sub[0]), *(sub[1]), *(sub[2])));
+        sg->approxSync3->registerCallback(
+          boost::bind(&TagSlam::callback3, this, group, _1, _2, _3));
         break;
       case 4:
-        approxSync4_.reset(
+        sg->approxSync4.reset(
           new TimeSync4(SyncPolicy4(60/*q size*/),
-                        *(sub_[0]), *(sub_[1]), *(sub_[2]), *(sub_[3])));
-        approxSync4_->registerCallback(&TagSlam::callback4, this);
+                        *(sub[0]), *(sub[1]), *(sub[2]), *(sub[3])));
+        sg->approxSync4->registerCallback(
+          boost::bind(&TagSlam::callback4, this, group, _1, _2, _3, _4));
         break;
       case 5:
-        approxSync5_.reset(
+        sg->approxSync5.reset(
           new TimeSync5(SyncPolicy5(60/*q size*/),
-                        *(sub_[0]), *(sub_[1]), *(sub_[2]), *(sub_[3]),
-                        *(sub_[4])));
-        approxSync5_->registerCallback(&TagSlam::callback5, this);
+                        *(sub[0]), *(sub[1]), *(sub[2]), *(sub[3]),
+                        *(sub[4])));
+        sg->approxSync5->registerCallback(
+          boost::bind(&TagSlam::callback5, this, group, _1, _2, _3, _4, _5));
         break;
       case 6:
-        approxSync6_.reset(
+        sg->approxSync6.reset(
           new TimeSync6(SyncPolicy6(60/*q size*/),
-                        *(sub_[0]), *(sub_[1]), *(sub_[2]), *(sub_[3]),
-                        *(sub_[4]), *(sub_[5])));
-        approxSync6_->registerCallback(&TagSlam::callback6, this);
+                        *(sub[0]), *(sub[1]), *(sub[2]), *(sub[3]),
+                        *(sub[4]), *(sub[5])));
+        sg->approxSync6->registerCallback(
+          boost::bind(&TagSlam::callback6, this, group, _1, _2, _3, _4, _5, _6));
         break;
       case 7:
-        approxSync7_.reset(
+        sg->approxSync7.reset(
           new TimeSync7(SyncPolicy7(60/*q size*/),
-                        *(sub_[0]), *(sub_[1]), *(sub_[2]), *(sub_[3]),
-                        *(sub_[4]), *(sub_[5]), *(sub_[6])));
-        approxSync7_->registerCallback(&TagSlam::callback7, this);
+                        *(sub[0]), *(sub[1]), *(sub[2]), *(sub[3]),
+                        *(sub[4]), *(sub[5]), *(sub[6])));
+        sg->approxSync7->registerCallback(
+          boost::bind(&TagSlam::callback7, this, group, _1, _2, _3, _4, _5, _6, _7));
         break;
       case 8:
-        approxSync8_.reset(
+        sg->approxSync8.reset(
           new TimeSync8(SyncPolicy8(60/*q size*/),
-                        *(sub_[0]), *(sub_[1]), *(sub_[2]), *(sub_[3]),
-                        *(sub_[4]), *(sub_[5]), *(sub_[6]), *(sub_[7])));
-        approxSync8_->registerCallback(&TagSlam::callback8, this);
+                        *(sub[0]), *(sub[1]), *(sub[2]), *(sub[3]),
+                        *(sub[4]), *(sub[5]), *(sub[6]), *(sub[7])));
+        sg->approxSync8->registerCallback(
+          boost::bind(&TagSlam::callback8, this, group, _1, _2, _3, _4, _5, _6, _7, _8));
         break;
       default:
-        ROS_ERROR_STREAM("number of cameras too large: " << cameras_.size());
+        ROS_ERROR_STREAM("number of cameras in sync group too large: " << cams.size());
         return (false);
         break;
       }
     }
-    ROS_INFO_STREAM("subscribed to " << cameras_.size() << " cameras");
+    syncGroups_.push_back(std::move(sg));
     return (true);
   }
 
@@ -281,6 +442,21 @@ namespace tagslam {
     return (t);
   }
 
+  int TagSlam::getFrameRig(const std::vector<TagArrayConstPtr> &msgvec) const {
+    // cameras outside the frame's sync group have no message
+    int rig(-1);
+    for (const auto i: irange(0ul, msgvec.size())) {
+      if (msgvec[i] == noTags_ || !cameras_[i]->rig) {
+        continue;
+      }
+      if (rig >= 0 && rig != cameras_[i]->rig->index) {
+        return (-1); // several rigs on one clock
+      }
+      rig = cameras_[i]->rig->index;
+    }
+    return (rig);
+  }
+
   static gtsam::Pose3
   to_gtsam(const cv::Mat &rvec, const cv::Mat &tvec) {
     gtsam::Vector tvec_gtsam = (gtsam::Vector(3) <<
@@ -294,14 +470,6 @@ namespace tagslam {
     return (p);
   }
 
-  static void
-  from_gtsam(cv::Mat *rvec, cv::Mat *tvec, const gtsam::Pose3 &p) {
-    const gtsam::Point3 rv = gtsam::Rot3::Logmap(p.rotation());
-    const gtsam::Point3 tv = p.translation();
-    *rvec = (cv::Mat_<double>(3,1) << rv.x(), rv.y(), rv.z());
-    *tvec = (cv::Mat_<double>(3,1) << tv.x(), tv.y(), tv.z());
-  }
-
   static void to_opencv(std::vector<cv::Point3d> *a,
                        const std::vector<gtsam::Point3> b) {
     for (const auto &p: b) {
@@ -329,8 +497,8 @@ namespace tagslam {
       const auto   &ci  = cameras_[cam_idx]->intrinsics;
       cv::Mat rvec, tvec;
       bool rc = utils::get_init_pose_pnp(wp, ip, ci.K,
-                                         ci.distortion_model,
-                                         ci.D, &rvec, &tvec);
+                                         *cameras_[cam_idx]->undistortionTable,
+                                         &rvec, &tvec);
       if (rc) {
         //std::cout << "WP IN CAM COORDS: " << cameras_[cam_idx]->name << std::endl;
      
@@ -351,15 +519,15 @@ namespace tagslam {
         if (hasNegZ) {
           pe.setValid(false);
         } else {
-          pe.setError(utils::reprojection_error(wp, ip, rvec, tvec, ci.K,
-                                                ci.distortion_model, ci.D));
+          pe.setError(cameras_[cam_idx]->projector->reprojectionError(
+                        T_c_w, wpts, ipts));
         }
       }
     }
     return (pe);
   }
                               
-  void TagSlam::updatePosesFromGraph(unsigned int frame) {
+  void TagSlam::updatePosesFromGraph(unsigned int frame, const ros::Time &t) {
     for (const auto &cam: cameras_) {
       cam->poseEstimate = tagGraph_.getCameraPose(cam);
     }
@@ -370,6 +538,9 @@ namespace tagslam {
         //std::cout << rb->poseEstimate.getPose() << std::endl << " to: " << std::endl;
         //std::cout << pe << std::endl;
         rb->poseEstimate = pe;
+        if (!rb->isStatic && !t.isZero()) {
+          rb->motion[frameRig_].update(pe.getPose(), t);
+        }
       } else {
         if (!rb->isStatic) {
           // mark pose estimate of dynamic bodies as invalid
@@ -395,6 +566,181 @@ namespace tagslam {
     }
   }
 
+  void TagSlam::updateFrozenMapSnapshot() {
+    // the frozen map has no graph, hence no covariances
+    std::shared_ptr<MapSnapshot> snap(new MapSnapshot());
+    for (const auto &rb: staticBodies_) {
+      if (!rb->poseEstimate.isValid()) {
+        continue;
+      }
+      const gtsam::Pose3 T_w_b = rb->poseEstimate.getPose();
+      snap->bodies[rb->name] = MapSnapshot::Entry(T_w_b);
+      for (const auto &tm: rb->tags) {
+        const auto &tag = tm.second;
+        if (tag->poseEstimate.isValid()) {
+          MapSnapshot::Entry &e = snap->tags[tag->id];
+          e = MapSnapshot::Entry(T_w_b * tag->poseEstimate.getPose());
+          e.size = tag->size;
+        }
+      }
+    }
+    setMapSnapshot(snap);
+  }
+
+  TagSlam::MapLayout TagSlam::getMapLayout() const {
+    MapLayout layout;
+    for (const auto &rb: staticBodies_) {
+      TagVec tags;
+      for (const auto &tm: rb->tags) {
+        tags.push_back(tm.second);
+      }
+      layout.push_back(MapLayout::value_type(rb, tags));
+    }
+    return (layout);
+  }
+
+  MapSnapshotConstPtr
+  TagSlam::makeMapSnapshot(const MapLayout &layout, unsigned int frame,
+                           const ros::Time &t) const {
+    // Only reads the graph and the tag ids and sizes, so it can
+    // run on the back end thread.
+    std::shared_ptr<MapSnapshot> snap(new MapSnapshot());
+    snap->frameNum = frame;
+    snap->time = t;
+    for (const auto &bt: layout) {
+      const RigidBodyConstPtr &rb = bt.first;
+      PoseEstimate pe;
+      if (!tagGraph_.getBodyPose(rb, &pe, 0)) {
+        continue;
+      }
+      const gtsam::Pose3 T_w_b = pe.getPose();
+      const gtsam::Matrix6 C_b = tagGraph_.getStaticBodyCovariance(rb);
+      snap->bodies[rb->name] = MapSnapshot::Entry(T_w_b, C_b);
+      for (const auto &tag: bt.second) {
+        gtsam::Pose3 T_b_o;
+        if (!tagGraph_.getTagRelPose(rb, tag->id, &T_b_o)) {
+          continue;
+        }
+        // T_w_o = T_w_b * T_b_o. The body covariance is moved into
+        // the tag frame with the adjoint of T_o_b.
+        const gtsam::Matrix6 Ad = T_b_o.inverse().AdjointMap();
+        MapSnapshot::Entry &e = snap->tags[tag->id];
+        e = MapSnapshot::Entry(
+          T_w_b * T_b_o,
+          Ad * C_b * Ad.transpose() + tagGraph_.getTagCovariance(tag->id));
+        e.size = tag->size;
+      }
+    }
+    return (snap);
+  }
+
+  void TagSlam::setMapSnapshot(const MapSnapshotConstPtr &snap) {
+    std::atomic_store(&mapSnapshot_, snap);
+    if (shmServer_) {
+      shmServer_->writeMap(*snap);
+    }
+  }
+
+  void TagSlam::pollShmClients(const ros::TimerEvent &) {
+    // convert in place, process after the ring slots are released
+    std::vector<std::pair<unsigned int, std::vector<TagArrayConstPtr>>> frames;
+    auto convert = [this, &frames](const shm::DetectionFrame &f) {
+      if (f.camera >= cameras_.size()) {
+        ROS_WARN_STREAM("detections for invalid camera index: " << f.camera);
+        return;
+      }
+      if (!cameras_[f.camera]->isShmClient) {
+        // already subscribed over ROS, would count twice
+        ROS_WARN_STREAM_THROTTLE(5.0, "ignoring shared memory detections for "
+                                 << cameras_[f.camera]->name
+                                 << ", set shm_client for this camera!");
+        return;
+      }
+      TagArray::Ptr tags(new TagArray());
+      tags->header.stamp.fromNSec(f.stamp);
+      tags->header.frame_id = cameras_[f.camera]->frame_id;
+      // the segment is writable by any client, don't trust it
+      const uint32_t numTags = std::min(f.numTags, shm::MAX_DETECTIONS);
+      if (numTags != f.numTags) {
+        ROS_WARN_STREAM_THROTTLE(5.0, "camera " << cameras_[f.camera]->name
+                                 << " sent " << f.numTags << " detections, max is "
+                                 << shm::MAX_DETECTIONS);
+      }
+      tags->apriltags.resize(numTags);
+      for (const auto i: irange(0u, numTags)) {
+        auto &tag = tags->apriltags[i];
+        tag.id   = f.tags[i].id;
+        tag.bits = f.tags[i].bits;
+        for (const auto k: irange(0, 4)) {
+          tag.corners[k].x = f.tags[i].corners[2 * k];
+          tag.corners[k].y = f.tags[i].corners[2 * k + 1];
+        }
+      }
+      std::vector<TagArrayConstPtr> allCams(cameras_.size(), noTags_);
+      allCams[f.camera] = tags;
+      frames.push_back(std::make_pair(f.camera, allCams));
+    };
+    const uint64_t numStale = shmServer_->getNumStaleSlots();
+    while (shmServer_->popDetections(convert));
+    if (shmServer_->getNumStaleSlots() != numStale) {
+      ROS_WARN_STREAM("dropped " << shmServer_->getNumStaleSlots() - numStale
+                      << " shared memory slot(s) of dead or stuck client(s)");
+    }
+    for (const auto &f: frames) {
+      if (inputQueue_) {
+        // queue sources after the sync groups, one per camera
+        inputQueue_->push(f.second, syncGroups_.size() + f.first);
+      } else {
+        processTags(f.second);
+      }
+    }
+  }
+
+  MapSnapshotConstPtr TagSlam::getMapSnapshot() const {
+    return (std::atomic_load(&mapSnapshot_));
+  }
+
+  static geometry_msgs::PoseWithCovariance
+  make_pose_with_cov(const MapSnapshot::Entry &e) {
+    geometry_msgs::PoseWithCovariance msg;
+    Eigen::Affine3d TFa(e.pose.matrix());
+    tf::poseEigenToMsg(TFa, msg.pose);
+    // ros order is translation, rotation
+    for (const auto i: irange(0, 6)) {
+      for (const auto j: irange(0, 6)) {
+        msg.covariance[i * 6 + j] = e.covariance((i + 3) % 6, (j + 3) % 6);
+      }
+    }
+    return (msg);
+  }
+
+  bool TagSlam::getMap(GetMap::Request &req, GetMap::Response &res) {
+    // runs in the ros callback thread, only touches the snapshot
+    const MapSnapshotConstPtr snap = getMapSnapshot();
+    res.frame_number = snap->frameNum;
+    res.stamp = snap->time;
+    res.frame_id = fixedFrame_;
+    if (req.tag_ids.empty()) {
+      for (const auto &tm: snap->tags) {
+        res.tag_ids.push_back(tm.first);
+        res.tag_poses.push_back(make_pose_with_cov(tm.second));
+      }
+    } else {
+      for (const auto id: req.tag_ids) {
+        const auto it = snap->tags.find(id);
+        if (it != snap->tags.end()) {
+          res.tag_ids.push_back(id);
+          res.tag_poses.push_back(make_pose_with_cov(it->second));
+        }
+      }
+    }
+    for (const auto &bm: snap->bodies) {
+      res.body_names.push_back(bm.first);
+      res.body_poses.push_back(make_pose_with_cov(bm.second));
+    }
+    return (true);
+  }
+
   void TagSlam::invalidateDynamicPoses() {
     for (const auto &rb: dynamicBodies_) {
       rb->poseEstimate.setValid(false);
@@ -463,7 +809,9 @@ namespace tagslam {
   TagSlam::poseFromPoints(int cam_idx,
                           const std::vector<gtsam::Point3> &wp,
                           const std::vector<gtsam::Point2> &ip,
-                          bool pointsArePlanar) const {
+                          bool pointsArePlanar,
+                          const Deadline &deadline,
+                          const PoseEstimate *fallback) const {
 #ifdef DEBUG_POSE_ESTIMATE
     std::cout << "------ points for pose estimate:------" << std::endl;
     for (const auto i: irange(0ul, wp.size())) {
@@ -486,16 +834,20 @@ namespace tagslam {
       // if pnp didn't outright fail, but just has too large error,
       // use that pose as starting guess, otherwise resort to the last
       // known camera pose.
-      const PoseEstimate initPose = pe.isValid() ? pe : guessCameraWorldPose(cam_idx);
+      const PoseEstimate initPose = pe.isValid() ? pe :
+        (fallback ? *fallback : guessCameraWorldPose(cam_idx));
 #ifdef DEBUG_POSE_ESTIMATE
       std::cout << "running mini graph for cam " << cam_idx << " init pose: " << std::endl << initPose << std::endl;
 #endif
       double errorLimit;
       pe = initialPoseGraph_.estimateCameraPose(cam, wp, ip,
-                                                initPose, &errorLimit);
+                                                initPose, &errorLimit,
+                                                deadline);
       if (pe.getError() >= errorLimit) {
-        ROS_WARN_STREAM("mini graph pose estimate failed for " << cam->name
-                        << " err: " << pe.getError());
+        if (!deadline.isExpired()) {
+          ROS_WARN_STREAM("mini graph pose estimate failed for " << cam->name
+                          << " err: " << pe.getError());
+        }
         pe.setValid(false);
       } else {
 #ifdef DEBUG_POSE_ESTIMATE
@@ -523,77 +875,293 @@ namespace tagslam {
       std::cout << "=============== estimating pose for camera: " << cam_idx << std::endl;
 #endif    
 
-      return (poseFromPoints(cam_idx, wp, ip));
+      return (poseFromPoints(cam_idx, wp, ip, false, deadline_));
     }
     return (PoseEstimate()); // invalid pose estimate
   }
                                        
 
+  PoseEstimate
+  TagSlam::estimateRigPose(const RigidBodyConstPtr &rig,
+                           const std::vector<int> &rigCams,
+                           const RigidBodyConstVec &staticBodies) const {
+    // gather world points for all cameras with known extrinsics
+    ResectionSolver solver, bootSolver;
+    int bootCam(-1);
+    size_t maxPoints(0);
+    double bootPixelRange(0);
+    for (const auto cam_idx: rigCams) {
+      const auto &cam = cameras_[cam_idx];
+      if (!cam->poseEstimate.isValid()) {
+        continue;
+      }
+      std::vector<gtsam::Point3> wp;
+      std::vector<gtsam::Point2> ip;
+      for (const auto &rb : staticBodies) {
+        if (rb->poseEstimate.isValid()) {
+          rb->getAttachedPoints(cam_idx, &wp, &ip, true /* world coords */);
+        }
+      }
+      if (wp.empty()) {
+        continue;
+      }
+      // X_c = T_c_r * T_r_w * X_w
+      solver.addObservations(cam->projector, cam->poseEstimate.inverse(), wp, ip);
+      if (wp.size() > maxPoints) {
+        maxPoints = wp.size();
+        bootCam = cam_idx;
+        bootPixelRange = utils::get_pixel_range(ip);
+        bootSolver = ResectionSolver();
+        bootSolver.addObservations(cam->projector, cam->poseEstimate.inverse(), wp, ip);
+      }
+    }
+    if (bootCam < 0) {
+      return (PoseEstimate()); // rig doesn't see any known tags
+    }
+    // bootstrap with pnp from the camera with the most points
+    const PoseEstimate camPose = findCameraPose(bootCam, staticBodies, true);
+    if (!camPose.isValid()) {
+      return (PoseEstimate());
+    }
+    // T_w_r  = T_w_c * T_c_r
+    const gtsam::Pose3 T_w_r0 =
+      camPose.getPose() * cameras_[bootCam]->poseEstimate.getPose().inverse();
+    // then refine with the corners seen by all cameras of the rig
+    const PoseEstimate pe = solver.solve(T_w_r0.inverse());
+    // same error limit as for pnp in poseFromPoints(). The solver
+    // error per point is 0.5 * squared pixel distance. Either way,
+    // the returned error is the rms pixel error of the points the
+    // pose was computed from.
+    const double pixErr = std::sqrt(2.0 * pe.getError());
+    if (!pe.isValid() || pixErr > bootPixelRange * maxInitErr_) {
+      ROS_WARN_STREAM("joint resection failed for rig " << rig->name
+                      << " pixel err: " << pixErr);
+      // fall back to the single camera pose
+      const PoseEstimate bootPe = bootSolver.evaluate(T_w_r0.inverse());
+      if (!bootPe.isValid()) {
+        return (PoseEstimate()); // tags behind the camera
+      }
+      return (PoseEstimate(T_w_r0, std::sqrt(2.0 * bootPe.getError()), 0));
+    }
+    return (PoseEstimate(pe.getPose().inverse(), pixErr, 0));
+  }
+
+  void TagSlam::makeRigSolver(const RigidBodyConstPtr &rig,
+                              ResectionSolver *solver) const {
+    // solves for T_r_w: X_c = T_c_r * T_r_w * X_w
+    for (const auto &cam: cameras_) {
+      if (cam->rig != rig || !cam->poseEstimate.isValid()) {
+        continue;
+      }
+      std::vector<gtsam::Point3> wp;
+      std::vector<gtsam::Point2> ip;
+      for (const auto &sb: staticBodies_) {
+        if (sb->poseEstimate.isValid()) {
+          sb->getAttachedPoints(cam->index, &wp, &ip, true /* world coords */);
+        }
+      }
+      solver->addObservations(cam->projector, cam->poseEstimate.inverse(), wp, ip);
+    }
+  }
+
+  void TagSlam::makeBodySolver(const RigidBodyConstPtr &rb,
+                               ResectionSolver *solver) const {
+    // solves for T_w_b: X_c = T_c_w * T_w_b * X_b
+    for (const auto &tagMap: rb->observedTags) {
+      const CameraPtr &cam = cameras_[tagMap.first];
+      if (!cam->poseEstimate.isValid() || !cam->rig->poseEstimate.isValid()) {
+        continue;
+      }
+      std::vector<gtsam::Point3> bp;
+      std::vector<gtsam::Point2> ip;
+      rb->getAttachedPoints(tagMap.first, &bp, &ip, false /* body coords */);
+      const gtsam::Pose3 T_c_w =
+        (cam->rig->poseEstimate.getPose() * cam->poseEstimate.getPose()).inverse();
+      solver->addObservations(cam->projector, T_c_w, bp, ip);
+    }
+  }
+
+  bool TagSlam::isGoodPrediction(const ResectionSolver &solver,
+                                 const gtsam::Pose3 &T) const {
+    const PoseEstimate pe = solver.evaluate(T);
+    // per-point error is 0.5 * squared pixel distance
+    return (pe.isValid() && std::sqrt(2.0 * pe.getError()) < maxPredictedPixErr_);
+  }
+
+  void TagSlam::predictDynamicPoses(const ros::Time &t) {
+    if (maxPredictedPixErr_ <= 0) {
+      return;
+    }
+    // rigs first, because the body check needs camera world poses
+    for (const auto &rb: dynamicBodies_) {
+      gtsam::Pose3 T_w_r;
+      if (rb->poseEstimate.isValid() || !rb->motion[frameRig_].predict(t, &T_w_r)) {
+        continue;
+      }
+      ResectionSolver solver;
+      makeRigSolver(rb, &solver);
+      if (isGoodPrediction(solver, T_w_r.inverse())) {
+        rb->poseEstimate = PoseEstimate(T_w_r, 0.0, 0);
+      }
+    }
+    for (const auto &rb: dynamicBodies_) {
+      gtsam::Pose3 T_w_b;
+      if (rb->poseEstimate.isValid() || !rb->motion[frameRig_].predict(t, &T_w_b)) {
+        continue;
+      }
+      ResectionSolver solver;
+      makeBodySolver(rb, &solver);
+      if (isGoodPrediction(solver, T_w_b)) {
+        rb->poseEstimate = PoseEstimate(T_w_b, 0.0, 0);
+      }
+    }
+  }
+
+  bool TagSlam::isKeyFrame(const ros::Time &t, size_t numObjectsBefore) const {
+    if (keyFrameTransThresh_ <= 0 && keyFrameRotThresh_ <= 0) {
+      return (true); // keyframe selection is disabled
+    }
+    // rigs may run on their own clocks, so the
+    // gap is measured against the same rig
+    const auto it = rigKeyFrameTime_.find(frameRig_);
+    if (it == rigKeyFrameTime_.end() ||
+        (t - it->second).toSec() > keyFrameMaxTimeGap_) {
+      return (true);
+    }
+    // new tags, bodies or measurements have been added to the graph
+    if (tagGraph_.getNumObjects() != numObjectsBefore) {
+      return (true);
+    }
+    // camera extrinsics have just been found
+    for (const auto &cam: cameras_) {
+      if (cam->poseEstimate.isValid() && !tagGraph_.hasCameraPose(cam)) {
+        return (true);
+      }
+    }
+    for (const auto &rb: allBodies_) {
+      if (!rb->poseEstimate.isValid()) {
+        continue;
+      }
+      if (rb->isStatic) {
+        PoseEstimate pe;
+        if (!tagGraph_.getBodyPose(rb, &pe, 0)) {
+          return (true); // static body not yet in graph
+        }
+        continue;
+      }
+      const auto it = keyFramePoses_.find(rb->index);
+      if (it == keyFramePoses_.end()) {
+        return (true);
+      }
+      const PoseChange pc = PoseChange::pose_change(it->second, rb->poseEstimate);
+      if (pc.trans > keyFrameTransThresh_ || pc.rot > keyFrameRotThresh_) {
+        return (true);
+      }
+    }
+    return (false);
+  }
+
+  void TagSlam::trackNonKeyFrame(const ros::Time &t) {
+    // Pose-only refinement against the current map, without
+    // touching the graph. Rigs go first, because the bodies
+    // need the camera world poses.
+    for (const auto &rb: dynamicBodies_) {
+      ResectionSolver solver;
+      if (rb->poseEstimate.isValid()) {
+        makeRigSolver(rb, &solver);
+      }
+      if (solver.size() != 0) {
+        const PoseEstimate pe = solver.solve(rb->poseEstimate.inverse());
+        if (pe.isValid()) {
+          rb->poseEstimate = PoseEstimate(pe.getPose().inverse(), 0.0, 0);
+        }
+      }
+    }
+    for (const auto &rb: dynamicBodies_) {
+      ResectionSolver solver;
+      if (rb->poseEstimate.isValid()) {
+        makeBodySolver(rb, &solver);
+      }
+      if (solver.size() != 0) {
+        const PoseEstimate pe = solver.solve(rb->poseEstimate);
+        if (pe.isValid()) {
+          rb->poseEstimate = PoseEstimate(pe.getPose(), 0.0, 0);
+        }
+      }
+      if (rb->poseEstimate.isValid()) {
+        rb->motion[frameRig_].update(rb->poseEstimate.getPose(), t);
+      }
+    }
+  }
+
   void TagSlam::findInitialCameraAndRigPoses() {
-    std::vector<PoseEstimate> camPoses;
+    const RigidBodyConstVec staticBodies(staticBodies_.begin(),
+                                         staticBodies_.end());
+    // group cameras by rig, keeping camera order
+    std::vector<RigidBodyPtr> rigs;
+    std::vector<std::vector<int>> rigCams;
     for (const auto cam_idx: irange(0ul, cameras_.size())) {
-      const auto &cam = cameras_[cam_idx];
-      if (cam->hasPosePrior && cam->rig->isStatic && cam->rig->poseEstimate.isValid()) {
-        // already know camera world pose
-        camPoses.push_back(PoseEstimate(cam->rig->poseEstimate * cam->poseEstimate, 0, 0));
+      const auto &rig = cameras_[cam_idx]->rig;
+      const auto it = std::find(rigs.begin(), rigs.end(), rig);
+      if (it == rigs.end()) {
+        rigs.push_back(rig);
+        rigCams.push_back(std::vector<int>(1, cam_idx));
       } else {
-        // compute camera-to-world transform from static bodies
-        //
-        // TODO: we often end up computing camera-to-static-body-point transforms
-        //       that end up being useless if the rig-to-camera pose is not yet known
-        PoseEstimate pe = findCameraPose(cam_idx, {staticBodies_.begin(),
-              staticBodies_.end()}, true /* in world coords */);
-        camPoses.push_back(pe);
+        rigCams[it - rigs.begin()].push_back(cam_idx);
       }
     }
-    double bestEstimateQuality(0);
-    for (const auto cam_idx: irange(0ul, cameras_.size())) {
-      const auto &cam = cameras_[cam_idx];
-      if (camPoses[cam_idx].isValid()) {
-        bool foundRigPose(false);
-        if (cam->poseEstimate.isValid()) {
-          // if we know both the camera world pose and its pose
-          // relative to the rig, we can determine the rig pose.
-          // T_w_r  = T_w_c * T_c_r
-          const gtsam::Pose3 T_w_r = camPoses[cam_idx].getPose() * cam->poseEstimate.getPose().inverse();
-          gtsam::Pose3 diff = (T_w_r.inverse() * cam->rig->poseEstimate);
-          double d = diff.translation().norm();
-          if (d > 0.5 && !cam->rig->poseEstimate.equals(gtsam::Pose3(), 1e-8)) {
-            ROS_WARN_STREAM("camera " << cam_idx << " has large jump in rig position: " << d);
-            ROS_WARN_STREAM("pose difference to previous frame: " << std::endl << diff);
-          }
-          // if either the rig pose is unknown, or it is dynamic,
-          // initialize it here
-          if ((!cam->rig->poseEstimate.isValid() || !cam->rig->isStatic) &&
-              camPoses[cam_idx].getQuality() > bestEstimateQuality) {
-            bestEstimateQuality = camPoses[cam_idx].getQuality();
-            cam->rig->poseEstimate = PoseEstimate(T_w_r, 0.0, 0);
+    for (const auto rig_idx: irange(0ul, rigs.size())) {
+      const auto &rig = rigs[rig_idx];
+      // If the rig pose is unknown, compute it from all calibrated
+      // cameras in one go. Dynamic poses are invalidated after each
+      // frame, so a valid dynamic rig pose came from the motion model.
+      if (rig->poseEstimate.isValid()) {
+        continue;
+      }
+      const PoseEstimate pe = estimateRigPose(rig, rigCams[rig_idx], staticBodies);
+      if (!pe.isValid()) {
+        continue;
+      }
+      gtsam::Pose3 diff = (pe.getPose().inverse() * rig->poseEstimate);
+      double d = diff.translation().norm();
+      if (d > 0.5 && !rig->poseEstimate.equals(gtsam::Pose3(), 1e-8)) {
+        ROS_WARN_STREAM("rig " << rig->name << " has large jump in position: " << d);
+        ROS_WARN_STREAM("pose difference to previous frame: " << std::endl << diff);
+      }
+      rig->poseEstimate = pe;
 #ifdef DEBUG_POSE_ESTIMATE
-            std::cout << "+++++ init rig pose based on cam: " << cam->name << " to be: " << std::endl;
-            std::cout << cam->rig->poseEstimate << std::endl;
-            std::cout << "DIFF to prev: " << std::endl << diff << std::endl;
+      std::cout << "+++++ init rig pose for: " << rig->name << " to be: " << std::endl;
+      std::cout << rig->poseEstimate << std::endl;
+      std::cout << "DIFF to prev: " << std::endl << diff << std::endl;
 #endif
-            foundRigPose = true;
-          }
-        }
-        // if the rig world pose is known and the camera world pose
-        // as well, we can deduce the camera-to-rig pose.
-        // If we just discovered the rig pose, then we can try this
-        // for all cameras up to and including this one.
-        for (int cam2_idx = foundRigPose ? 0 : cam_idx; cam2_idx <= (int)cam_idx; cam2_idx++) {
-          const auto &cam2 = cameras_[cam2_idx];
-          const PoseEstimate &cam2WorldPose = camPoses[cam2_idx];
-          if (!cam2->poseEstimate.isValid() && cam2->rig->poseEstimate.isValid()
-              && cam2WorldPose.isValid() && cam2WorldPose.getQuality() > 0.06) {
-            // T_r_c = T_r_w * T_w_c
-            const gtsam::Pose3 T_r_c = cam2->rig->poseEstimate.inverse() * cam2WorldPose.getPose();
-            cam2->poseEstimate = PoseEstimate(T_r_c, 0.0, 0);
+    }
+    // Cameras with unknown extrinsics are bootstrapped with single
+    // camera pnp, once their rig pose is known. These are
+    // independent, so run them in parallel.
+    std::vector<int> uncalibrated;
+    for (const auto cam_idx: irange(0ul, cameras_.size())) {
+      const auto &cam = cameras_[cam_idx];
+      if (!cam->poseEstimate.isValid() && cam->rig->poseEstimate.isValid()) {
+        uncalibrated.push_back(cam_idx);
+      }
+    }
+    std::vector<PoseEstimate> camPoses(uncalibrated.size());
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)uncalibrated.size(); i++) {
+      camPoses[i] = findCameraPose(uncalibrated[i], staticBodies,
+                                   true /* in world coords */);
+    }
+    for (const auto i: irange(0ul, uncalibrated.size())) {
+      const auto &cam = cameras_[uncalibrated[i]];
+      const PoseEstimate &camWorldPose = camPoses[i];
+      if (camWorldPose.isValid() && camWorldPose.getQuality() > 0.06) {
+        // T_r_c = T_r_w * T_w_c
+        const gtsam::Pose3 T_r_c = cam->rig->poseEstimate.inverse() * camWorldPose.getPose();
+        cam->poseEstimate = PoseEstimate(T_r_c, 0.0, 0);
 #ifdef DEBUG_POSE_ESTIMATE            
-            std::cout << "INITIALIZED CAM-TO-RIG FOR CAM " << cam2->name << std::endl << cam2->poseEstimate << std::endl;
-            std::cout << "QUALITY: " << cam2WorldPose.getQuality() << std::endl;
+        std::cout << "INITIALIZED CAM-TO-RIG FOR CAM " << cam->name << std::endl << cam->poseEstimate << std::endl;
+        std::cout << "QUALITY: " << camWorldPose.getQuality() << std::endl;
 #endif
-          }
-        }
       }
     }
   }
@@ -607,31 +1175,22 @@ namespace tagslam {
   }
   
   bool
-  TagSlam::estimateTagPose(int cam_idx,
+  TagSlam::estimateTagPose(const gtsam::Pose3 &T_w_c,
                            const gtsam::Pose3 &T_w_b,
+                           const PoseEstimate &pe,
                            const TagPtr &tag) const {
-#ifdef DEBUG_POSE_ESTIMATE
-    std::cout << "&&&&&&&&&&&& estimating pose for tag: " << tag->id << std::endl;
-#endif    
-    const auto &wp = tag->getObjectCorners();
-    const auto ip = tag->getImageCorners();
-    // get T_o_c, the transform from camera to object coordinates
-    PoseEstimate pe = poseFromPoints(cam_idx, wp, ip, false);
-    const CameraPtr &cam = cameras_[cam_idx];
-    if (pe.isValid() && cam->rig->poseEstimate.isValid()) {
+    // pe pose estimate has T_o_c
+    if (pe.isValid()) {
       if (isBadViewingAngle(pe.getPose())) {
         ROS_INFO_STREAM("IGNORING tag " << tag->id << " (bad viewing angle)");
         tag->poseEstimate = PoseEstimate(); // mark invalid
         return (false);
       }
-      // pe pose estimate has T_o_c
       // body pose has T_w_b
-      // camera pose has T_r_c
-      // rig pose has T_w_r
+      // camera pose has T_w_c = T_w_r * T_r_c
       // tag pose should have T_b_o
-      // T_b_o = T_b_w * T_w_r * T_r_c  * T_c_o
-      gtsam::Pose3 pose = T_w_b.inverse() *
-        cam->rig->poseEstimate * cam->poseEstimate * pe.inverse();
+      // T_b_o = T_b_w * T_w_c * T_c_o
+      gtsam::Pose3 pose = T_w_b.inverse() * T_w_c * pe.inverse();
       tag->poseEstimate = PoseEstimate(pose, 0.0, 0);
       //std::cout << "init tag pose est: " << tag->id << std::endl << " T_c_o: " << pe.inverse() << std::endl;
       //std::cout << "T_w_c: " << cam->poseEstimate.getPose() << std::endl;
@@ -641,8 +1200,17 @@ namespace tagslam {
     //std::cout << "pose estimate for tag " << tag->id << ": " << pe << std::endl;
     return (true);
   }
-                                
+
   void TagSlam::findInitialDiscoveredTagPoses() {
+    // First collect all observations of tags that have no pose yet,
+    // in the same order in which the serial loop visits them.
+    struct TagObs {
+      RigidBodyPtr rb;
+      int          cam_idx;
+      TagPtr       tag;
+      PoseEstimate pe; // T_o_c
+    };
+    std::vector<TagObs> obs;
     for (auto &rb: allBodies_) {
       if (rb->poseEstimate.isValid()) {
         //std::cout << "RIGID BODY " << rb->name << " has pose: " << rb->poseEstimate << std::endl;
@@ -652,43 +1220,197 @@ namespace tagslam {
           const CameraPtr &cam = cameras_[tagMap.first];
           if (cam->poseEstimate.isValid() && cam->rig->poseEstimate.isValid()) {
             for (const auto &tag: tagMap.second) {
-              auto gTagIt = allTags_.find(tag->id);
-              if (gTagIt == allTags_.end()) {
-                ROS_ERROR_STREAM("ERROR: invalid tag id: " << tag->id);
-                continue;
-              }
-              TagPtr globalTag = gTagIt->second;
-              if (!globalTag->poseEstimate.isValid()) {
-                //std::cout << "tag: " << globalTag << " id " << globalTag->id << " has no valid pose!" << std::endl;
-                if (estimateTagPose(tagMap.first, rb->poseEstimate.getPose(), tag)) {
-                  TagVec tvec = {tag};
-                  tagGraph_.addTags(rb, tvec);
-                  globalTag->poseEstimate = tag->poseEstimate;
-                }
-              } else {
-                tag->poseEstimate = globalTag->poseEstimate;
-              }
+              TagObs to;
+              to.rb = rb;
+              to.cam_idx = tagMap.first;
+              to.tag = tag;
+              obs.push_back(to);
             }
           }
         }
       }
     }
+    // the expensive part: pose from corners, one per observation
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)obs.size(); i++) {
+      const auto &to = obs[i];
+      auto gTagIt = allTags_.find(to.tag->id);
+      if (gTagIt != allTags_.end() && !gTagIt->second->poseEstimate.isValid() &&
+          deferredTags_.count(to.tag->id) == 0) {
+#ifdef DEBUG_POSE_ESTIMATE
+        std::cout << "&&&&&&&&&&&& estimating pose for tag: " << to.tag->id << std::endl;
+#endif    
+        obs[i].pe = poseFromPoints(to.cam_idx, to.tag->getObjectCorners(),
+                                   to.tag->getImageCorners(), false, deadline_);
+      }
+    }
+    // merge serially, first observation of a tag wins
+    for (const auto &to: obs) {
+      const TagPtr &tag = to.tag;
+      auto gTagIt = allTags_.find(tag->id);
+      if (gTagIt == allTags_.end()) {
+        ROS_ERROR_STREAM("ERROR: invalid tag id: " << tag->id);
+        continue;
+      }
+      TagPtr globalTag = gTagIt->second;
+      if (!globalTag->poseEstimate.isValid()) {
+        if (deferredTags_.count(tag->id) > 0) {
+          continue;
+        }
+        if (!to.pe.isValid() && deadline_.isExpired()) {
+          // ran out of time, finish this one in the background
+          deferTagPose(to.rb, to.cam_idx, tag);
+          continue;
+        }
+        //std::cout << "tag: " << globalTag << " id " << globalTag->id << " has no valid pose!" << std::endl;
+        const CameraPtr &cam = cameras_[to.cam_idx];
+        const gtsam::Pose3 T_w_c = cam->rig->poseEstimate * cam->poseEstimate;
+        if (estimateTagPose(T_w_c, to.rb->poseEstimate.getPose(), to.pe, tag)) {
+          addTagsToGraph(to.rb, TagVec{tag});
+          globalTag->poseEstimate = tag->poseEstimate;
+        }
+      } else {
+        tag->poseEstimate = globalTag->poseEstimate;
+      }
+    }
+  }
+
+
+  void TagSlam::deferTagPose(const RigidBodyPtr &rb, int cam_idx,
+                             const TagPtr &tag) {
+    if ((int)deferredInits_.size() >= maxDeferredInits_ ||
+        !tagBackoff_[tag->id].canDefer(frameNum_)) {
+      return; // try again in a later frame
+    }
+    // Everything that refers to the current frame is captured
+    // here, the background task only sees copies.
+    const CameraPtr &cam = cameras_[cam_idx];
+    const gtsam::Pose3 T_w_c = cam->rig->poseEstimate * cam->poseEstimate;
+    const gtsam::Pose3 T_w_b = rb->poseEstimate.getPose();
+    const PoseEstimate guess = guessCameraWorldPose(cam_idx);
+    const std::vector<gtsam::Point3> wp = tag->getObjectCorners();
+    const std::vector<gtsam::Point2> ip = tag->getImageCorners();
+    DeferredInit di;
+    di.result = submitDeferred([this, cam_idx, wp, ip, guess]() {
+        return (poseFromPoints(cam_idx, wp, ip, false, Deadline(), &guess));
+      });
+    di.merge = [this, rb, tag, T_w_c, T_w_b](const PoseEstimate &pe) {
+      deferredTags_.erase(tag->id);
+      auto gTagIt = allTags_.find(tag->id);
+      if (gTagIt == allTags_.end() || gTagIt->second->poseEstimate.isValid()) {
+        return; // has been initialized in the meantime
+      }
+      if (pe.isValid() && estimateTagPose(T_w_c, T_w_b, pe, tag)) {
+        addTagsToGraph(rb, TagVec{tag});
+        gTagIt->second->poseEstimate = tag->poseEstimate;
+        tagBackoff_.erase(tag->id);
+      } else {
+        tagBackoff_[tag->id].failed(frameNum_);
+      }
+    };
+    deferredTags_.insert(tag->id);
+    deferredInits_.push_back(std::move(di));
+  }
+
+  void TagSlam::deferStaticBodyPose(const RigidBodyPtr &rb,
+                                    const gtsam::Pose3 &startPose) {
+    if ((int)deferredInits_.size() >= maxDeferredInits_ ||
+        !bodyBackoff_[rb->index].canDefer(frameNum_)) {
+      return;
+    }
+    std::shared_ptr<ResectionSolver> solver(new ResectionSolver());
+    makeBodySolver(rb, solver.get());
+    if (solver->size() == 0) {
+      return;
+    }
+    DeferredInit di;
+    di.result = submitDeferred([this, solver, startPose]() {
+        double errorLimit;
+        PoseEstimate pe = initialPoseGraph_.estimateBodyPose(*solver, startPose,
+                                                             &errorLimit);
+        if (pe.getError() > errorLimit) {
+          pe.setValid(false);
+        }
+        return (pe);
+      });
+    di.merge = [this, rb](const PoseEstimate &pe) {
+      deferredBodies_.erase(rb->index);
+      if (rb->poseEstimate.isValid()) {
+        return;
+      }
+      if (pe.isValid()) {
+        initializeStaticBody(rb, pe);
+        bodyBackoff_.erase(rb->index);
+      } else {
+        bodyBackoff_[rb->index].failed(frameNum_);
+      }
+    };
+    deferredBodies_.insert(rb->index);
+    deferredInits_.push_back(std::move(di));
+  }
+
+  std::future<PoseEstimate>
+  TagSlam::submitDeferred(const std::function<PoseEstimate()> &func) {
+    std::shared_ptr<std::packaged_task<PoseEstimate()>> task(
+      new std::packaged_task<PoseEstimate()>(func));
+    initWorker_.push([task]() { (*task)(); });
+    return (task->get_future());
   }
 
+  void TagSlam::mergeDeferredInits() {
+    for (auto it = deferredInits_.begin(); it != deferredInits_.end();) {
+      if (it->result.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready) {
+        it->merge(it->result.get());
+        it = deferredInits_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
         
   void TagSlam::processTags(const std::vector<TagArrayConstPtr> &msgvec) {
     profiler_.reset();
+    // Time budget for this frame. Initializations that do not
+    // finish in time are deferred, see mergeDeferredInits().
+    deadline_ = Deadline(frameDeadline_);
+    // With the async back end, the graph can only be inspected
+    // while no isam update is running.
+    const bool graphIdle = mergeBackEndResult();
+    if (graphIdle && !pendingTags_.empty()) {
+      flushPendingTags();
+    }
+    if (!deferredInits_.empty()) {
+      mergeDeferredInits();
+      profiler_.record("mergeDeferredInits");
+    }
+    const size_t numObjectsBefore = graphIdle ? tagGraph_.getNumObjects() : 0;
 
     // check if any of the tags are new, and associate them
-    // with a rigid body
-    discoverTags(msgvec);
-    profiler_.record("discoverTags");
+    // with a rigid body. The frozen map has no new tags.
+    if (!localizationOnly_) {
+      discoverTags(msgvec);
+      profiler_.record("discoverTags");
+    }
     // Sort the tags according to which bodies they
     // belong to. The observed tags are then hanging
     // off of the bodies, to be used subsequently
     const auto nobs = attachObservedTagsToBodies(msgvec);
     profiler_.record("attachObservedTagsToBodies");
+    const ros::Time t = get_latest_time(msgvec);
+    frameRig_ = getFrameRig(msgvec);
+    // Dynamic rigs and bodies that move smoothly can often be
+    // placed by the motion model, skipping pnp altogether.
+    predictDynamicPoses(t);
+    profiler_.record("predictDynamicPoses");
     
+    // The front end below runs as a sequence of stages:
+    //   camera poses -> rig poses -> body poses -> tag poses.
+    // Within each stage the per-camera, per-body or per-tag work is
+    // independent and done in parallel (OpenMP), and the results are
+    // merged serially in index order, so the outcome does not
+    // depend on the number of threads.
+
     // Go over all bodies and use tags with
     // established positions to determine camera poses.
     findInitialCameraAndRigPoses();
@@ -697,45 +1419,144 @@ namespace tagslam {
     // initial poses if any of their tags are observed
     findInitialBodyPoses();
     profiler_.record("findInitialBodyPoses");
-    // Any newly discovered tags can now be given
-    // an initial pose, too.
-    findInitialDiscoveredTagPoses();
-    profiler_.record("findInitialDiscoveredTagPoses");
-
-    runOptimizer();
-    profiler_.record("runOptimizer");
-    updatePosesFromGraph(frameNum_);
-    profiler_.record("updatePosesFromGraph");
-    const auto distances = getDistances();
-    printDistanceErrors(distances);
-    profiler_.record("printDistanceErrors");
-    const auto positions = getPositions();
-    printPositionErrors(positions);
-    profiler_.record("printPositionErrors");
-    computeProjectionError();
-    profiler_.record("computeProjectionError");
-    detachObservedTagsFromBodies();
-    profiler_.record("detachObservedTagsFromBodies");
-    ros::Time t = get_latest_time(msgvec);
+    if (localizationOnly_) {
+      // frozen map: refine this frame's dynamic poses against
+      // it with a fixed-size solve, the graph is never touched
+      trackNonKeyFrame(t);
+      profiler_.record("trackNonKeyFrame");
+    } else {
+      // Any newly discovered tags can now be given
+      // an initial pose, too.
+      findInitialDiscoveredTagPoses();
+      profiler_.record("findInitialDiscoveredTagPoses");
+      if (backEnd_.isRunning()) {
+        // publish front-end poses now, the graph catches up later
+        trackNonKeyFrame(t);
+        profiler_.record("trackNonKeyFrame");
+        if (graphIdle && isKeyFrame(t, numObjectsBefore)) {
+          submitKeyFrame(t);
+          profiler_.record("submitKeyFrame");
+        }
+      } else {
+        optimizeOrTrack(t, numObjectsBefore);
+      }
+    }
+    // publish poses before doing any of the diagnostics
     rosgraph_msgs::Clock clockMsg;
     clockMsg.clock = t;
     clockPub_.publish(clockMsg);
-    
     broadcastCameraPoses(t);
     broadcastBodyPoses(t);
     broadcastTagPoses(t);
+    sendTransforms();
+    profiler_.record("broadcast");
+    computeProjectionError();
+    profiler_.record("computeProjectionError");
+    detachObservedTagsFromBodies();
+    profiler_.record("detachObservedTagsFromBodies");
     writeBodyPoses(bodyPosesOutFile_);
-    writeTagWorldPoses(tagWorldPosesOutFile_, frameNum_);
-    writeMeasurements(measurementsOutFile_, distances, positions);
+    if (!localizationOnly_ && !backEnd_.isRunning()) {
+      // async back end writes these when merging
+      writeGraphResults();
+    }
     ROS_INFO_STREAM("frame " << frameNum_ << " total tags: " << allTags_.size()
-                    << " obs: " << nobs << " err: " << tagGraph_.getError()
-                    << " iter: " << tagGraph_.getIterations());
+                    << " obs: " << nobs);
     invalidateDynamicPoses();
     frameNum_++;
     profiler_.record("writing");
+    if (deadline_.isExpired()) {
+      profiler_.count("deadlineMiss");
+    }
     std::cout << std::flush;
   }
 
+  void TagSlam::writeGraphResults() {
+    const auto distances = getDistances();
+    printDistanceErrors(distances);
+    const auto positions = getPositions();
+    printPositionErrors(positions);
+    writeTagWorldPoses(tagWorldPosesOutFile_, lastKeyFrameNum_);
+    writeMeasurements(measurementsOutFile_, distances, positions);
+    ROS_INFO_STREAM("graph err: " << tagGraph_.getError()
+                    << " iter: " << tagGraph_.getIterations());
+  }
+
+  void TagSlam::submitKeyFrame(const ros::Time &t) {
+    // the factors are built here, because they need the current
+    // observations and poses. Only the isam update is deferred.
+    flushPendingTags(); // tags found in this frame
+    {
+      std::lock_guard<std::mutex> lock(graphMutex_);
+      addObservationsToGraph();
+    }
+    lastKeyFrameNum_  = frameNum_;
+    lastKeyFrameTime_ = t;
+    rigKeyFrameTime_[frameRig_] = t;
+    for (const auto &rb: dynamicBodies_) {
+      if (rb->poseEstimate.isValid()) {
+        keyFramePoses_[rb->index] = rb->poseEstimate.getPose();
+      }
+    }
+    const unsigned int frame = frameNum_;
+    const MapLayout layout = getMapLayout();
+    backEnd_.submit([this, frame, t, layout]() {
+        std::lock_guard<std::mutex> lock(graphMutex_);
+        tagGraph_.optimize();
+        publishRefinedPoses(frame, t);
+        // the marginals are expensive, so the snapshot is finished
+        // here, and the front end only swaps it in
+        refinedMap_ = makeMapSnapshot(layout, frame, t);
+      });
+  }
+
+  bool TagSlam::mergeBackEndResult() {
+    if (!backEnd_.isRunning()) {
+      return (true);
+    }
+    if (backEnd_.isBusy()) {
+      return (false);
+    }
+    const unsigned int numCompleted = backEnd_.getNumCompleted();
+    if (numCompleted != numMergedResults_) {
+      // Refined static poses, tag poses and extrinsics become
+      // visible to the front end. The dynamic poses belong to
+      // an old frame and are not used.
+      updatePosesFromGraph(lastKeyFrameNum_);
+      invalidateDynamicPoses();
+      setMapSnapshot(refinedMap_);
+      writeGraphResults();
+      numMergedResults_ = numCompleted;
+      profiler_.record("mergeBackEndResult");
+    }
+    return (true);
+  }
+
+  void TagSlam::optimizeOrTrack(const ros::Time &t, size_t numObjectsBefore) {
+    if (isKeyFrame(t, numObjectsBefore)) {
+      runOptimizer();
+      profiler_.record("runOptimizer");
+      updatePosesFromGraph(frameNum_, t);
+      profiler_.record("updatePosesFromGraph");
+      // the marginals are too expensive for every key frame
+      if (t - lastMapSnapshotTime_ >= ros::Duration(mapSnapshotInterval_)) {
+        setMapSnapshot(makeMapSnapshot(getMapLayout(), frameNum_, t));
+        lastMapSnapshotTime_ = t;
+        profiler_.record("makeMapSnapshot");
+      }
+      lastKeyFrameNum_  = frameNum_;
+      lastKeyFrameTime_ = t;
+      rigKeyFrameTime_[frameRig_] = t;
+      for (const auto &rb: dynamicBodies_) {
+        if (rb->poseEstimate.isValid()) {
+          keyFramePoses_[rb->index] = rb->poseEstimate.getPose();
+        }
+      }
+    } else {
+      trackNonKeyFrame(t);
+      profiler_.record("trackNonKeyFrame");
+    }
+  }
+
   struct Stat {
     Stat(double s = 0, unsigned int c =0) :sum(s), cnt(c) {}
     Stat &operator+=(const Stat &b) {
@@ -760,18 +1581,23 @@ namespace tagslam {
     std::vector<Stat> bodyStats(allBodies_.size());
     std::map<int, Stat> tagStats;
     std::map<double, std::pair<int, int>> sortedTagErrors;
-    for (const auto cam_idx: irange(0ul, cameras_.size())) {
+    // per-camera results, filled in parallel and merged in camera order
+    struct TagErr {
+      int  body_idx;
+      int  tagId;
+      Stat stat;
+    };
+    std::vector<std::vector<TagErr>> camTagErrors(cameras_.size());
+#pragma omp parallel for schedule(dynamic)
+    for (int cam_idx = 0; cam_idx < (int)cameras_.size(); cam_idx++) {
       const auto &cam = cameras_[cam_idx];
       if (!(cam->poseEstimate.isValid() & cam->rig->poseEstimate.isValid())) {
         continue;
       }
       cv::Mat img;
-      if (cam_idx < images_.size()) img = images_[cam_idx];
-      cv::Mat rvec, tvec;
+      if (cam_idx < (int)images_.size()) img = images_[cam_idx];
       // T_c_w = T_c_r * T_r_w
       const gtsam::Pose3 T_c_w = cam->poseEstimate.inverse() * cam->rig->poseEstimate.inverse();
-      from_gtsam(&rvec, &tvec, T_c_w);
-      std::vector<Stat> bodyCamStats(allBodies_.size()); // per cam stat
       for (const auto body_idx: irange(0ul, allBodies_.size())) {
         const auto &rb = allBodies_[body_idx];
         if (!rb->poseEstimate.isValid()) {
@@ -782,40 +1608,29 @@ namespace tagslam {
         std::vector<int> tagids;
         rb->getAttachedPoints(cam_idx, &wpts, &ipts,
                               true /* in world coords */, &tagids);
-        std::vector<cv::Point3d> wp;
-        std::vector<cv::Point2d> ip, ipp;
-        to_opencv(&wp, wpts);
-        to_opencv(&ip, ipts);
-        const auto &ci = cam->intrinsics;
-        utils::project_points(wp, rvec, tvec, ci.K,
-                              ci.distortion_model, ci.D, &ipp);
+        std::vector<gtsam::Point2> ipp;
+        cam->projector->project(T_c_w, wpts, &ipp);
         if (img.rows > 0) {
           const cv::Scalar origColor(0,255,0), projColor(255,0,255);
           const cv::Size rsz(4,4);
-          for (const auto i: irange(0ul, wp.size())) {
-            cv::rectangle(img, cv::Rect(ip[i], rsz),  origColor, 2, 8, 0);
-            cv::rectangle(img, cv::Rect(ipp[i], rsz), projColor, 2, 8, 0);
+          for (const auto i: irange(0ul, wpts.size())) {
+            cv::rectangle(img, cv::Rect(cv::Point2d(ipts[i].x(), ipts[i].y()), rsz),
+                          origColor, 2, 8, 0);
+            cv::rectangle(img, cv::Rect(cv::Point2d(ipp[i].x(), ipp[i].y()), rsz),
+                          projColor, 2, 8, 0);
           }
         }
 
         for (const auto tag_idx: irange(0ul, tagids.size())) {
           Stat s(0, 4);
           for (const auto i: irange(0, 4)) {
-            const cv::Point diff = ipp[tag_idx * 4 + i] - ip[tag_idx * 4 + i];
-            s.sum += diff.x * diff.x + diff.y * diff.y;
+            const gtsam::Point2 diff = ipp[tag_idx * 4 + i] - ipts[tag_idx * 4 + i];
+            s.sum += diff.x() * diff.x() + diff.y() * diff.y();
 #ifdef DEBUG_SLM_VS_GRAPH
             std::cout << "SLMPROJ: " << tagids[tag_idx] << " " << ipts[tag_idx * 4 + i]  << " " << T_c_w.transform_from(wpts[tag_idx * 4 + i])   << " X_w: " << wpts[tag_idx * 4 + i] << std::endl;
 #endif            
           }
-          // XXX will overwrite entry if error is identical!
-          sortedTagErrors[s.avg()] = std::pair<int, int>(cam_idx, tagids[tag_idx]);
-          tagStats[tagids[tag_idx]] += s;
-          bodyCamStats[body_idx]    += s;
-          bodyStats[body_idx]       += s;
-          camStats[cam_idx]         += s;
-        }
-        if (!tagids.empty()) {
-          ROS_INFO_STREAM("cam " << cam->name << " body: " << rb->name << " err: " << bodyCamStats[body_idx].avg());
+          camTagErrors[cam_idx].push_back(TagErr{(int)body_idx, tagids[tag_idx], s});
         }
       }
       if (img.rows > 0 && writeDebugImages_) {
@@ -824,7 +1639,26 @@ namespace tagslam {
         std::string fbase = "image_" + ss.str() + "_";
         cv::imwrite(fbase + std::to_string(cam_idx) + ".jpg", img);
       }
-
+    }
+    for (const auto cam_idx: irange(0ul, cameras_.size())) {
+      const auto &cam = cameras_[cam_idx];
+      std::vector<Stat> bodyCamStats(allBodies_.size()); // per cam stat
+      std::vector<bool> bodySeen(allBodies_.size(), false);
+      for (const auto &te: camTagErrors[cam_idx]) {
+        // XXX will overwrite entry if error is identical!
+        sortedTagErrors[te.stat.avg()] = std::pair<int, int>(cam_idx, te.tagId);
+        tagStats[te.tagId]           += te.stat;
+        bodyCamStats[te.body_idx]    += te.stat;
+        bodyStats[te.body_idx]       += te.stat;
+        camStats[cam_idx]            += te.stat;
+        bodySeen[te.body_idx] = true;
+      }
+      for (const auto body_idx: irange(0ul, allBodies_.size())) {
+        if (bodySeen[body_idx]) {
+          ROS_INFO_STREAM("cam " << cam->name << " body: " << allBodies_[body_idx]->name
+                          << " err: " << bodyCamStats[body_idx].avg());
+        }
+      }
     }
     for (const auto cam_idx: irange(0ul, cameras_.size())) {
       const auto &cam = cameras_[cam_idx];
@@ -856,6 +1690,11 @@ namespace tagslam {
   }
 
   void TagSlam::runOptimizer() {
+    addObservationsToGraph();
+    tagGraph_.optimize();
+  }
+
+  void TagSlam::addObservationsToGraph() {
     for (const auto &rb: allBodies_) {
       for (const auto &camToTag: rb->observedTags) {
         const auto &cam = cameras_[camToTag.first];
@@ -870,7 +1709,6 @@ namespace tagslam {
                                rb, camToTag.second, frameNum_);
       }
     }
-    tagGraph_.optimize();
 #ifdef DEBUG_SLM_VS_GRAPH
     for (const auto &rb: allBodies_) {
       for (const auto &camToTag: rb->observedTags) {
@@ -898,7 +1736,9 @@ namespace tagslam {
   // 
 
   PoseEstimate
-  TagSlam::estimateBodyPose(const RigidBodyConstPtr &rb) const {
+  TagSlam::estimateBodyPose(const RigidBodyConstPtr &rb,
+                            const Deadline &deadline,
+                            gtsam::Pose3 *startPose) const {
     //std::cout << "&&&& estimating body pose for " << rb->name << std::endl;
     PoseEstimate bodyPose; // defaults to invalid pose estimate
     int best_cam_idx = rb->bestCamera(findCamerasWithKnownWorldPose());
@@ -915,44 +1755,90 @@ namespace tagslam {
     const auto &T_r_c = bestCam->poseEstimate;
     const auto &T_w_r = bestCam->rig->poseEstimate; // should be valid!
     gtsam::Pose3 T_w_b = T_w_r * T_r_c * pe.inverse();
+    if (startPose) {
+      *startPose = T_w_b;
+    }
     //std::cout << "body pose from single camera " << best_cam_idx << std::endl;
     //std::cout << T_w_b << std::endl;
     double errorLimit;
     bodyPose = initialPoseGraph_.estimateBodyPose(cameras_, images_, frameNum_, rb, T_w_b,
-                                                  &errorLimit);
+                                                  &errorLimit, deadline);
     //std::cout << "body pose from body graph: " << std::endl << T_w_b << std::endl;
     if (bodyPose.getError() > errorLimit) {
-      ROS_WARN_STREAM("no body pose for " << rb->name << " due to high error!");
+      if (!deadline.isExpired()) {
+        ROS_WARN_STREAM("no body pose for " << rb->name << " due to high error!");
+      }
       bodyPose.setValid(false);
     }
     return (bodyPose);
   }
 
+  void TagSlam::initializeStaticBody(const RigidBodyPtr &rb,
+                                     const PoseEstimate &pe) {
+    rb->poseEstimate = pe;
+    ROS_INFO_STREAM("static body pose discovered for: " << rb->name);
+    // We encountered tags on a static body for the first time.
+    // Any of these tags that have a known pose estimate can
+    // be added to the graph and the global set of known tags.
+    TagVec tvec;
+    for (auto &t: rb->tags) {
+      if (t.second->poseEstimate.isValid()) {
+        tvec.push_back(t.second);
+        allTags_[t.second->id] = t.second;
+      }
+    }
+    addTagsToGraph(rb, tvec);
+  }
+
+  void TagSlam::addTagsToGraph(const RigidBodyPtr &rb, const TagVec &tags) {
+    // The back end holds the graph for a whole isam update. Rather
+    // than wait for it, queue the tags until it is idle again.
+    pendingTags_.push_back(std::make_pair(rb, tags));
+    if (!backEnd_.isBusy()) {
+      flushPendingTags();
+    }
+  }
+
+  void TagSlam::flushPendingTags() {
+    // only called while the back end is idle, so the
+    // lock is never contended
+    std::lock_guard<std::mutex> lock(graphMutex_);
+    for (const auto &pt: pendingTags_) {
+      tagGraph_.addTags(pt.first, pt.second);
+    }
+    pendingTags_.clear();
+  }
+
   void TagSlam::findInitialBodyPoses() {
-    for (auto &rb: allBodies_) {
-      if (rb->poseEstimate.isValid()) {
+    // With the camera poses known, the body poses can be
+    // estimated independently. Merge in body order.
+    std::vector<PoseEstimate> bodyPoses(allBodies_.size());
+    std::vector<gtsam::Pose3> startPoses(allBodies_.size());
+#pragma omp parallel for schedule(dynamic)
+    for (int body_idx = 0; body_idx < (int)allBodies_.size(); body_idx++) {
+      const auto &rb = allBodies_[body_idx];
+      if (!rb->poseEstimate.isValid() && deferredBodies_.count(rb->index) == 0) {
+        bodyPoses[body_idx] = estimateBodyPose(rb, deadline_,
+                                               &startPoses[body_idx]);
+      }
+    }
+    for (const auto body_idx: irange(0ul, allBodies_.size())) {
+      auto &rb = allBodies_[body_idx];
+      if (rb->poseEstimate.isValid() || deferredBodies_.count(rb->index) > 0) {
         continue;
       }
-      PoseEstimate pe = estimateBodyPose(rb);
+      const PoseEstimate &pe = bodyPoses[body_idx];
       if (pe.isValid()) {
-        rb->poseEstimate = pe;
-        if (!rb->isStatic) {
-          //std::cout << "updated dynamic body pose for " << rb->name << " to " << rb->poseEstimate << std::endl;
-        }
         if (rb->isStatic) {
-          ROS_INFO_STREAM("static body pose discovered for: " << rb->name);
-          // We encountered tags on a static body for the first time.
-          // Any of these tags that have a known pose estimate can
-          // be added to the graph and the global set of known tags.
-          TagVec tvec;
-          for (auto &t: rb->tags) {
-            if (t.second->poseEstimate.isValid()) {
-              tvec.push_back(t.second);
-              allTags_[t.second->id] = t.second;
-            }
-          }
-          tagGraph_.addTags(rb, tvec);
+          initializeStaticBody(rb, pe);
+        } else {
+          rb->poseEstimate = pe;
+          //std::cout << "updated dynamic body pose for " << rb->name << " to " << rb->poseEstimate << std::endl;
         }
+      } else if (rb->isStatic && deadline_.isExpired()) {
+        // Dynamic body poses are only good for this frame,
+        // but a static body pose can be found later.
+        deferStaticBodyPose(rb, startPoses[body_idx]);
       }
     }
     // Add new distance measurements if possible
@@ -965,6 +1851,10 @@ namespace tagslam {
     if (unappliedDistanceMeasurements_.empty()) {
       return;
     }
+    std::unique_lock<std::mutex> lock(graphMutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      return; // back end is busy, try again next frame
+    }
     DistanceMeasurementVec dmv;
     for (const auto &dm: unappliedDistanceMeasurements_) {
       bool used(false);
@@ -991,6 +1881,10 @@ namespace tagslam {
     if (unappliedPositionMeasurements_.empty()) {
       return;
     }
+    std::unique_lock<std::mutex> lock(graphMutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      return; // back end is busy, try again next frame
+    }
     PositionMeasurementVec mv;
     for (const auto &m: unappliedPositionMeasurements_) {
       bool used(false);
@@ -1037,68 +1931,134 @@ namespace tagslam {
     return (std::string("body_" + name));
   }
 
+  const std::string &TagSlam::getBodyFrameId(const RigidBodyConstPtr &rb) {
+    auto it = bodyFrameIds_.find(rb->index);
+    if (it == bodyFrameIds_.end()) {
+      it = bodyFrameIds_.emplace(rb->index, body_frame_id(rb->name)).first;
+    }
+    return (it->second);
+  }
+
+  const std::string &TagSlam::getTagFrameId(int tagId) {
+    auto it = tagFrameIds_.find(tagId);
+    if (it == tagFrameIds_.end()) {
+      it = tagFrameIds_.emplace(tagId, "tag_" + std::to_string(tagId)).first;
+    }
+    return (it->second);
+  }
+
   void TagSlam::broadcastCameraPoses(const ros::Time &t) {
+    // camera extrinsics only change when the optimizer moves them
     std::vector<PoseInfo> camPoseInfo;
     for (const auto cam_idx: irange(0ul, cameras_.size())) {
       const auto &cam = cameras_[cam_idx];
-      PoseEstimate pe = tagGraph_.getCameraPose(cam);
+      const PoseEstimate pe = (localizationOnly_ || backEnd_.isRunning()) ?
+        cam->poseEstimate : tagGraph_.getCameraPose(cam);
       if (pe.isValid()) {
-        camPoseInfo.push_back(PoseInfo(pe, t,body_frame_id(cam->rig->name), cam->frame_id));
-        camOdomPub_[cam_idx].publish(make_odom(t, body_frame_id(cam->rig->name),
+        const std::string &rig_frame_id = getBodyFrameId(cam->rig);
+        camPoseInfo.push_back(PoseInfo(pe, t, rig_frame_id, cam->frame_id));
+        camOdomPub_[cam_idx].publish(make_odom(t, rig_frame_id,
                                                cam->frame_id, pe.getPose()));
       }
     }
-    broadcastTransforms(camPoseInfo);
+    broadcastStaticTransforms(camPoseInfo);
   }
 
   
   void TagSlam::broadcastBodyPoses(const ros::Time &t) {
-    std::vector<PoseInfo> bodyPoseInfo;
+    std::vector<PoseInfo> bodyPoseInfo, staticBodyPoseInfo;
     for (const auto &rb: allBodies_) {
       const PoseEstimate &pe = rb->poseEstimate;
       if (pe.isValid()) {
-        const std::string frame_id = body_frame_id(rb->name);
-        bodyPoseInfo.push_back(PoseInfo(pe, t, fixedFrame_, frame_id));
+        (rb->isStatic ? staticBodyPoseInfo : bodyPoseInfo).push_back(
+          PoseInfo(pe, t, fixedFrame_, getBodyFrameId(rb)));
       }
     }
     broadcastTransforms(bodyPoseInfo);
+    broadcastStaticTransforms(staticBodyPoseInfo);
     // publish odom for dynamic bodies
     for (const auto body_idx : irange(0ul, dynamicBodies_.size())) {
       const auto rb = dynamicBodies_[body_idx];
       const PoseEstimate &pe = rb->poseEstimate;
       if (pe.isValid()) {
-        const std::string frame_id = body_frame_id(rb->name);
         bodyOdomPub_[body_idx].publish(
-          make_odom(t, fixedFrame_, frame_id, pe.getPose()));
+          make_odom(t, fixedFrame_, getBodyFrameId(rb), pe.getPose()));
+      }
+    }
+  }
+
+  void TagSlam::publishRefinedPoses(unsigned int frame, const ros::Time &t) {
+    // runs on the back end thread, must only read the graph
+    for (const auto body_idx : irange(0ul, dynamicBodies_.size())) {
+      const auto &rb = dynamicBodies_[body_idx];
+      PoseEstimate pe;
+      if (tagGraph_.getBodyPose(rb, &pe, frame)) {
+        refinedBodyOdomPub_[body_idx].publish(
+          make_odom(t, fixedFrame_, getBodyFrameId(rb), pe.getPose()));
       }
     }
   }
 
   void TagSlam::broadcastTagPoses(const ros::Time &t) {
+    // tag poses are relative to their body, so they are static
+    std::vector<PoseInfo> tagPoseInfo;
     for (const auto &rb: allBodies_) {
       if (rb->poseEstimate.isValid()) {
-        std::vector<PoseInfo> tagPoseInfo;
         for (auto &tg: rb->tags) {
           TagPtr tag = tg.second;
           if (tag->poseEstimate.isValid()) {
-            const std::string frame_id = "tag_" + std::to_string(tag->id);
             tagPoseInfo.push_back(PoseInfo(tag->poseEstimate, t,
-                                           body_frame_id(rb->name), frame_id));
+                                           getBodyFrameId(rb),
+                                           getTagFrameId(tag->id)));
           }
         }
-        broadcastTransforms(tagPoseInfo);
       }
     }
+    broadcastStaticTransforms(tagPoseInfo);
   }
 
   void TagSlam::broadcastTransforms(const std::vector<PoseInfo> &poses) {
     for (const auto &p: poses) {
       const auto &tf = gtsam_pose_to_tf(p.pose);
-      tfBroadcaster_.sendTransform(tf::StampedTransform(tf, p.time,
+      pendingTransforms_.push_back(tf::StampedTransform(tf, p.time,
                                                         p.parent_frame_id, p.frame_id));
     }
   }
 
+  void TagSlam::broadcastStaticTransforms(const std::vector<PoseInfo> &poses) {
+    for (const auto &p: poses) {
+      auto it = staticTransforms_.find(p.frame_id);
+      if (it != staticTransforms_.end()) {
+        const PoseChange pc = PoseChange::pose_change(it->second, p.pose);
+        if (pc.trans <= staticTfTransThresh_ && pc.rot <= staticTfRotThresh_) {
+          continue; // not worth republishing
+        }
+        it->second = p.pose;
+      } else {
+        staticTransforms_.emplace(p.frame_id, p.pose);
+      }
+      geometry_msgs::TransformStamped msg;
+      tf::transformStampedTFToMsg(
+        tf::StampedTransform(gtsam_pose_to_tf(p.pose), p.time,
+                             p.parent_frame_id, p.frame_id), msg);
+      pendingStaticTransforms_.push_back(msg);
+    }
+  }
+
+  void TagSlam::sendTransforms() {
+    // one tf message per frame for the dynamic transforms
+    if (!pendingTransforms_.empty()) {
+      tfBroadcaster_.sendTransform(pendingTransforms_);
+      pendingTransforms_.clear();
+    }
+    // the static broadcaster keeps and latches all transforms sent
+    // so far, replacing those with the same child frame id
+    if (!pendingStaticTransforms_.empty()) {
+      staticTfBroadcaster_.sendTransform(pendingStaticTransforms_);
+      pendingStaticTransforms_.clear();
+    }
+  }
+
   
   void TagSlam::writeBodyPoses(const std::string &poseFile) const {
     std::ofstream pf(poseFile);
@@ -1274,7 +2234,8 @@ namespace tagslam {
     std::ofstream f(fname);
     for (const auto &cam : cameras_) {
       f << cam->name << ":" << std::endl;
-      PoseEstimate pe = tagGraph_.getCameraPose(cam);
+      const PoseEstimate pe = localizationOnly_ ? cam->poseEstimate :
+        tagGraph_.getCameraPose(cam);
       if (pe.isValid()) {
         yaml_utils::write_pose_with_covariance(f, "  ", pe.getPose(), pe.getNoise());
       }
@@ -1282,47 +2243,84 @@ namespace tagslam {
   }
     
 
-  void TagSlam::callback1(TagArrayConstPtr const &tag0) {
+  void TagSlam::handleFrame(unsigned int group,
+                            const std::vector<TagArrayConstPtr> &msgvec) {
+    // expand to one entry per camera, cameras outside of
+    // the sync group have no observations in this frame
+    const auto &cams = syncGroups_[group]->cameras;
+    std::vector<TagArrayConstPtr> allCams(cameras_.size(), noTags_);
+    for (const auto i: irange(0ul, cams.size())) {
+      allCams[cams[i]] = msgvec[i];
+    }
+    // Frames from all groups go through the same front end. They
+    // share one graph, and static map variables are common to all
+    // rigs. The queue keeps the groups apart, so a fast rig does
+    // not crowd out the others.
+    if (inputQueue_) {
+      inputQueue_->push(allCams, group);
+    } else {
+      processTags(allCams);
+    }
+  }
+
+  void TagSlam::processQueuedFrame(const std::vector<TagArrayConstPtr> &msgvec) {
+    processTags(msgvec);
+    std_msgs::UInt32 depth, drops;
+    depth.data = inputQueue_->getDepth();
+    drops.data = inputQueue_->getNumDropped();
+    queueDepthPub_.publish(depth);
+    queueDropsPub_.publish(drops);
+    ROS_DEBUG_STREAM("input queue depth: " << depth.data
+                     << " dropped: " << drops.data);
+  }
+
+  void TagSlam::callback1(unsigned int group, TagArrayConstPtr const &tag0) {
     std::vector<TagArrayConstPtr> msg_vec = {tag0};
-    processTags(msg_vec);
+    handleFrame(group, msg_vec);
   }
 
-  void TagSlam::callback2(TagArrayConstPtr const &tag0,
+  void TagSlam::callback2(unsigned int group,
+                          TagArrayConstPtr const &tag0,
                           TagArrayConstPtr const &tag1) {
     std::vector<TagArrayConstPtr> msg_vec = {tag0, tag1};
-    processTags(msg_vec);
+    handleFrame(group, msg_vec);
   }
-  void TagSlam::callback3(TagArrayConstPtr const &tag0,
+  void TagSlam::callback3(unsigned int group,
+                          TagArrayConstPtr const &tag0,
                           TagArrayConstPtr const &tag1,
                           TagArrayConstPtr const &tag2) {
     std::vector<TagArrayConstPtr> msg_vec = {tag0, tag1, tag2};
-    processTags(msg_vec);
+    handleFrame(group, msg_vec);
   }
-  void TagSlam::callback4(TagArrayConstPtr const &tag0,
+  void TagSlam::callback4(unsigned int group,
+                          TagArrayConstPtr const &tag0,
                           TagArrayConstPtr const &tag1,
                           TagArrayConstPtr const &tag2,
                           TagArrayConstPtr const &tag3) {
     std::vector<TagArrayConstPtr> msg_vec = {tag0, tag1, tag2, tag3};
-    processTags(msg_vec);
+    handleFrame(group, msg_vec);
   }
-  void TagSlam::callback5(TagArrayConstPtr const &tag0,
+  void TagSlam::callback5(unsigned int group,
+                          TagArrayConstPtr const &tag0,
                           TagArrayConstPtr const &tag1,
                           TagArrayConstPtr const &tag2,
                           TagArrayConstPtr const &tag3,
                           TagArrayConstPtr const &tag4) {
     std::vector<TagArrayConstPtr> msg_vec = {tag0, tag1, tag2, tag3, tag4};
-    processTags(msg_vec);
+    handleFrame(group, msg_vec);
   }
-  void TagSlam::callback6(TagArrayConstPtr const &tag0,
+  void TagSlam::callback6(unsigned int group,
+                          TagArrayConstPtr const &tag0,
                           TagArrayConstPtr const &tag1,
                           TagArrayConstPtr const &tag2,
                           TagArrayConstPtr const &tag3,
                           TagArrayConstPtr const &tag4,
                           TagArrayConstPtr const &tag5) {
     std::vector<TagArrayConstPtr> msg_vec = {tag0, tag1, tag2, tag3, tag4, tag5};
-    processTags(msg_vec);
+    handleFrame(group, msg_vec);
   }
-  void TagSlam::callback7(TagArrayConstPtr const &tag0,
+  void TagSlam::callback7(unsigned int group,
+                          TagArrayConstPtr const &tag0,
                           TagArrayConstPtr const &tag1,
                           TagArrayConstPtr const &tag2,
                           TagArrayConstPtr const &tag3,
@@ -1330,9 +2328,10 @@ namespace tagslam {
                           TagArrayConstPtr const &tag5,
                           TagArrayConstPtr const &tag6) {
     std::vector<TagArrayConstPtr> msg_vec = {tag0, tag1, tag2, tag3, tag4, tag5, tag6};
-    processTags(msg_vec);
+    handleFrame(group, msg_vec);
   }
-  void TagSlam::callback8(TagArrayConstPtr const &tag0,
+  void TagSlam::callback8(unsigned int group,
+                          TagArrayConstPtr const &tag0,
                           TagArrayConstPtr const &tag1,
                           TagArrayConstPtr const &tag2,
                           TagArrayConstPtr const &tag3,
@@ -1341,7 +2340,7 @@ namespace tagslam {
                           TagArrayConstPtr const &tag6,
                           TagArrayConstPtr const &tag7) {
     std::vector<TagArrayConstPtr> msg_vec = {tag0, tag1, tag2, tag3, tag4, tag5, tag6, tag7};
-    processTags(msg_vec);
+    handleFrame(group, msg_vec);
   }
 
   template <typename T>
@@ -1367,7 +2366,13 @@ namespace tagslam {
   }
 
   void TagSlam::finalize() {
-    unsigned int frameNum = (unsigned int)std::max(0, (int)frameNum_ - 1);
+    if (localizationOnly_) {
+      writeBodyPoses(bodyPosesOutFile_);
+      return; // map is frozen, nothing else has changed
+    }
+    backEnd_.waitUntilIdle();
+    // the graph only has dynamic poses for keyframes
+    unsigned int frameNum = lastKeyFrameNum_;
     tagGraph_.computeMarginals();
     updatePosesFromGraph(frameNum);
     writeBodyPoses(bodyPosesOutFile_);
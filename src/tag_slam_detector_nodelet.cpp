@@ -0,0 +1,77 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/tag_slam.h"
+#include "tagslam/tag_detector.h"
+#include "tagslam/camera.h"
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace tagslam {
+  //
+  // Images in, poses out: runs one tag detector per camera in the
+  // same process as tagslam. The detections go to tagslam's tag
+  // topics via intra-process publishing, so neither images (when
+  // the camera driver lives in the same manager) nor tags are
+  // serialized.
+  //
+  class TagSlamDetectorNodelet : public nodelet::Nodelet {
+  public:
+    ~TagSlamDetectorNodelet() {
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+    }
+    void onInit() override {
+      ros::NodeHandle pnh = getPrivateNodeHandle();
+      std::string detectorType;
+      int borderWidth;
+      pnh.param<std::string>("detector_type", detectorType, "Mit");
+      pnh.param<int>("black_border_width", borderWidth, 1);
+      // each family costs a full detection pass, see TagDetector
+      std::vector<std::string> families;
+      if (!pnh.getParam("tag_families", families)) {
+        families.push_back("36h11");
+      }
+      // detectors for different cameras run in parallel
+      ros::NodeHandle mtnh = getMTPrivateNodeHandle();
+      for (const auto &cam: Camera::parse_cameras(pnh)) {
+        if (cam->tagtopic.empty()) {
+          NODELET_ERROR_STREAM("no tagtopic for camera " << cam->name);
+          return;
+        }
+        try {
+          detectors_.push_back(TagDetectorPtr(
+                                 new TagDetector(mtnh, cam->rostopic,
+                                                 cam->tagtopic, detectorType,
+                                                 families, borderWidth)));
+        } catch (const std::runtime_error &e) {
+          NODELET_ERROR_STREAM("cannot make detector for camera "
+                               << cam->name << ": " << e.what());
+          return;
+        }
+      }
+      node_.reset(new TagSlam(pnh));
+      // same as TagSlamNodelet: a bag must not block the manager
+      thread_ = std::thread([this]() {
+          if (!node_->initialize()) {
+            NODELET_ERROR("tagslam initialization failed!");
+          } else if (node_->isBagMode()) {
+            NODELET_INFO("tagslam finished playing bag");
+          }
+        });
+    }
+  private:
+    std::vector<TagDetectorPtr> detectors_;
+    std::unique_ptr<TagSlam>    node_;
+    std::thread                 thread_;
+  };
+}
+
+PLUGINLIB_EXPORT_CLASS(tagslam::TagSlamDetectorNodelet, nodelet::Nodelet)
@@ -12,7 +12,11 @@ int main(int argc, char** argv) {
   try {
     tagslam::TagSlam node(pnh);
     node.initialize();
-    ros::spin();
+    if (node.isBagMode()) {
+      ros::shutdown(); // done with the bag
+    } else {
+      ros::spin();
+    }
   } catch (const std::exception& e) {
     ROS_ERROR("%s: %s", pnh.getNamespace().c_str(), e.what());
   }
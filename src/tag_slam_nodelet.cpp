@@ -0,0 +1,37 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/tag_slam.h"
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <memory>
+#include <thread>
+
+namespace tagslam {
+  class TagSlamNodelet : public nodelet::Nodelet {
+  public:
+    ~TagSlamNodelet() {
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+    }
+    void onInit() override {
+      node_.reset(new TagSlam(getPrivateNodeHandle()));
+      // in bag mode, initialize() plays the whole
+      // bag, which must not block the manager
+      thread_ = std::thread([this]() {
+          if (!node_->initialize()) {
+            NODELET_ERROR("tagslam initialization failed!");
+          } else if (node_->isBagMode()) {
+            NODELET_INFO("tagslam finished playing bag");
+          }
+        });
+    }
+  private:
+    std::unique_ptr<TagSlam> node_;
+    std::thread              thread_;
+  };
+}
+
+PLUGINLIB_EXPORT_CLASS(tagslam::TagSlamNodelet, nodelet::Nodelet)
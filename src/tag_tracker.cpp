@@ -0,0 +1,110 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/tag_tracker.h"
+#include <boost/range/irange.hpp>
+#include <algorithm>
+#include <cmath>
+#include <set>
+#include <utility>
+
+namespace tagslam {
+  using boost::irange;
+
+  TagTracker::TagTracker(int fullFrameInterval, double padding,
+                         int minPadding) :
+    fullFrameInterval_(fullFrameInterval), padding_(padding),
+    minPadding_(minPadding) {
+  }
+
+  bool TagTracker::needsFullFrame() const {
+    return (lost_ || last_.empty() || framesSinceFull_ >= fullFrameInterval_);
+  }
+
+  std::vector<cv::Rect>
+  TagTracker::predictRois(const cv::Size &imageSize) const {
+    std::vector<cv::Rect> rois;
+    const cv::Rect image(cv::Point(0, 0), imageSize);
+    for (const auto &tag: last_) {
+      // pixel velocity, if the tag was seen in the previous frame, too
+      double dx(0), dy(0);
+      for (const auto &p: previous_) {
+        if (p.id == tag.id && p.bits == tag.bits) {
+          dx = tag.center.x - p.center.x;
+          dy = tag.center.y - p.center.y;
+          break;
+        }
+      }
+      double xmin(1e10), xmax(-1e10), ymin(1e10), ymax(-1e10);
+      for (const auto &c: tag.corners) {
+        xmin = std::min(xmin, c.x + dx);
+        xmax = std::max(xmax, c.x + dx);
+        ymin = std::min(ymin, c.y + dy);
+        ymax = std::max(ymax, c.y + dy);
+      }
+      // pad more for fast moving tags
+      const double pad = std::max((double) minPadding_,
+                                  padding_ * std::max(xmax - xmin, ymax - ymin)) +
+        std::max(std::abs(dx), std::abs(dy));
+      cv::Rect r(cv::Point((int)(xmin - pad), (int)(ymin - pad)),
+                 cv::Point((int)(xmax + pad) + 1, (int)(ymax + pad) + 1));
+      r &= image;
+      if (r.area() > 0) {
+        rois.push_back(r);
+      }
+    }
+    // merge overlapping regions so no tag is detected twice
+    bool merged(true);
+    while (merged) {
+      merged = false;
+      for (size_t i = 0; i < rois.size() && !merged; i++) {
+        for (size_t j = i + 1; j < rois.size(); j++) {
+          if ((rois[i] & rois[j]).area() > 0) {
+            rois[i] |= rois[j];
+            rois.erase(rois.begin() + j);
+            merged = true;
+            break;
+          }
+        }
+      }
+    }
+    return (rois);
+  }
+
+  void TagTracker::update(const TagVec &detections, bool wasFullFrame) {
+    if (!wasFullFrame) {
+      // lost track if any of the predicted tags has not been found
+      std::set<std::pair<int, int>> found; // (bits, id)
+      for (const auto &tag: detections) {
+        found.insert(std::make_pair(tag.bits, tag.id));
+      }
+      lost_ = false;
+      for (const auto &tag: last_) {
+        lost_ = lost_ ||
+          (found.count(std::make_pair(tag.bits, tag.id)) == 0);
+      }
+      framesSinceFull_++;
+    } else {
+      lost_ = false;
+      framesSinceFull_ = 0;
+    }
+    previous_ = last_;
+    last_ = detections;
+  }
+
+  void TagTracker::shift(const cv::Point &offset, apriltag_msgs::Apriltag *tag) {
+    const double dx(offset.x), dy(offset.y);
+    tag->center.x += dx;
+    tag->center.y += dy;
+    for (auto &c: tag->corners) {
+      c.x += dx;
+      c.y += dy;
+    }
+    // homography: H' = [1 0 dx; 0 1 dy; 0 0 1] * H
+    for (const auto i: irange(0, 3)) {
+      tag->H[i]     += dx * tag->H[6 + i];
+      tag->H[3 + i] += dy * tag->H[6 + i];
+    }
+  }
+}  // namespace
@@ -0,0 +1,136 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/undistortion_table.h"
+#include <boost/range/irange.hpp>
+#include <stdexcept>
+#include <limits>
+#include <cmath>
+
+namespace tagslam {
+  using boost::irange;
+  // tolerances are in normalized coordinates, i.e. roughly
+  // pixels divided by focal length
+  static const double BUILD_TOL   = 1e-12;
+  static const double LOOKUP_TOL  = 1e-10;
+  static const int    BUILD_ITER  = 50;
+  static const int    LOOKUP_ITER = 3;
+  static const int    FALLBACK_ITER = 50;
+
+  UndistortionTable::UndistortionTable(const ProjectorConstPtr &proj,
+                                       int width, int height, int spacing) :
+    proj_(proj), spacing_(spacing) {
+    if (spacing_ <= 0 || width <= 0 || height <= 0) {
+      throw std::runtime_error("invalid undistortion table dimensions!");
+    }
+    // one extra node on each axis so the grid covers the
+    // far image border as well
+    nx_ = width  / spacing_ + 2;
+    ny_ = height / spacing_ + 2;
+    tx_.resize(nx_ * ny_, std::numeric_limits<double>::quiet_NaN());
+    ty_.resize(nx_ * ny_, std::numeric_limits<double>::quiet_NaN());
+    for (const auto j: irange(0, ny_)) {
+      // seed each node with its left neighbor's solution,
+      // which is always close by
+      gtsam::Point2 guess = toNormalized(gtsam::Point2(0, j * spacing_));
+      for (const auto i: irange(0, nx_)) {
+        const gtsam::Point2 xd =
+          toNormalized(gtsam::Point2(i * spacing_, j * spacing_));
+        gtsam::Point2 xn = guess;
+        if (!invert(xd, &xn, BUILD_ITER, BUILD_TOL)) {
+          xn = xd; // try again from scratch
+          if (!invert(xd, &xn, BUILD_ITER, BUILD_TOL)) {
+            guess = xd;
+            continue;
+          }
+        }
+        tx_[j * nx_ + i] = xn.x();
+        ty_[j * nx_ + i] = xn.y();
+        guess = xn;
+      }
+    }
+  }
+
+  gtsam::Point2
+  UndistortionTable::toNormalized(const gtsam::Point2 &pix) const {
+    return (gtsam::Point2((pix.x() - proj_->cx()) / proj_->fx(),
+                          (pix.y() - proj_->cy()) / proj_->fy()));
+  }
+
+  bool UndistortionTable::invert(const gtsam::Point2 &xd,
+                                 gtsam::Point2 *xn,
+                                 int maxIter, double tol) const {
+    gtsam::Point2 x = *xn;
+    for (int iter = 0; iter <= maxIter; iter++) {
+      Eigen::Matrix2d J;
+      const gtsam::Point2 d = proj_->distort(x, J);
+      const double ex = d.x() - xd.x(), ey = d.y() - xd.y();
+      if (ex * ex + ey * ey < tol * tol) {
+        *xn = x;
+        return (true);
+      }
+      const double det = J(0, 0) * J(1, 1) - J(0, 1) * J(1, 0);
+      if (iter == maxIter || !std::isnormal(det)) {
+        break;
+      }
+      // x -= J^-1 * e
+      x = gtsam::Point2(x.x() - ( J(1, 1) * ex - J(0, 1) * ey) / det,
+                        x.y() - (-J(1, 0) * ex + J(0, 0) * ey) / det);
+    }
+    return (false);
+  }
+
+  bool UndistortionTable::interpolate(const gtsam::Point2 &pix,
+                                      gtsam::Point2 *xn) const {
+    const double gx = pix.x() / spacing_;
+    const double gy = pix.y() / spacing_;
+    const int i0 = (int) std::floor(gx);
+    const int j0 = (int) std::floor(gy);
+    if (i0 < 0 || j0 < 0 || i0 >= nx_ - 1 || j0 >= ny_ - 1) {
+      return (false);
+    }
+    const double ax = gx - i0, ay = gy - j0;
+    const int k00 = j0 * nx_ + i0, k01 = k00 + 1;
+    const int k10 = k00 + nx_,     k11 = k10 + 1;
+    const double w00 = (1 - ax) * (1 - ay), w01 = ax * (1 - ay);
+    const double w10 = (1 - ax) * ay,       w11 = ax * ay;
+    const double x = w00 * tx_[k00] + w01 * tx_[k01] + w10 * tx_[k10] + w11 * tx_[k11];
+    const double y = w00 * ty_[k00] + w01 * ty_[k01] + w10 * ty_[k10] + w11 * ty_[k11];
+    if (std::isnan(x) || std::isnan(y)) {
+      return (false); // at least one node is invalid
+    }
+    *xn = gtsam::Point2(x, y);
+    return (true);
+  }
+
+  bool UndistortionTable::undistort(const gtsam::Point2 &pix,
+                                    gtsam::Point2 *xn) const {
+    const gtsam::Point2 xd = toNormalized(pix);
+    gtsam::Point2 x;
+    if (interpolate(pix, &x) && invert(xd, &x, LOOKUP_ITER, LOOKUP_TOL)) {
+      *xn = x;
+      return (true);
+    }
+    // outside of grid or refinement failed: full Newton solve
+    x = xd;
+    if (invert(xd, &x, FALLBACK_ITER, LOOKUP_TOL)) {
+      *xn = x;
+      return (true);
+    }
+    return (false);
+  }
+
+  bool UndistortionTable::undistort(const std::vector<gtsam::Point2> &pix,
+                                    std::vector<gtsam::Point2> *xn) const {
+    bool allGood(true);
+    xn->resize(pix.size());
+    for (const auto i: irange(0ul, pix.size())) {
+      if (!undistort(pix[i], &(*xn)[i])) {
+        (*xn)[i] = toNormalized(pix[i]);
+        allGood = false;
+      }
+    }
+    return (allGood);
+  }
+}  // namespace
@@ -52,44 +52,41 @@ namespace utils {
     *TT = TT->t();
   }
 
-  // computes a pose (rotation vector, translation) via homography
-  // from world and image points. Distortion is not taken into account
-  // but the projection model (i.e fisheye) is.
+  //
+  // Uses the camera's undistortion table to map image points
+  // to undistorted normalized coordinates.
+  //
+  static void undistort_points(const std::vector<cv::Point2d> &ip,
+                               const UndistortionTable &undist,
+                               std::vector<gtsam::Point2> *ipu) {
+    std::vector<gtsam::Point2> ipg;
+    ipg.reserve(ip.size());
+    for (const auto &i: ip) {
+      ipg.push_back(gtsam::Point2(i.x, i.y));
+    }
+    undist.undistort(ipg, ipu);
+  }
 
+  // computes a pose (rotation vector, translation) via homography
+  // from world and undistorted image points.
   bool get_init_pose(const std::vector<cv::Point3d> &world_points,
                      const std::vector<cv::Point2d> &image_points,
                      const cv::Mat &K,
-                     const std::string &distModel,
-                     const cv::Mat &D,
+                     const UndistortionTable &undist,
                      cv::Mat *rvec,
                      cv::Mat *tvec) {
     std::vector<cv::Point2f> wp, // world points
-      ip,  // image points
-      ipu; // undistorted image points
+      ipu; // undistorted, normalized image points
 
     // world points
-    //std::cout << "   world points: " << std::endl;
     for (const auto &w : world_points) {
       wp.push_back(cv::Point2f(w.x, w.y));
-      //std::cout << w.x << " " << w.y << std::endl;
     }
-    // image points
-    //std::cout << "   image points: " << std::endl;
-    for (const auto &i : image_points) {
-      ip.push_back(cv::Point2f(i.x, i.y));
-      //std::cout << i.x << " " << i.y << std::endl;
+    std::vector<gtsam::Point2> xn;
+    undistort_points(image_points, undist, &xn);
+    for (const auto &x : xn) {
+      ipu.push_back(cv::Point2f(x.x(), x.y()));
     }
-    if (distModel == "equidistant") {
-      cv::fisheye::undistortPoints(ip, ipu, K, D);
-    } else if (distModel == "radtan" || distModel == "plumb_bob") {
-      cv::undistortPoints(ip, ipu, K, D);
-      //std::cout << "using radtan!" << std::endl;
-    } else {
-      std::cout << "WARNING: unknown distortion model: " << distModel << std::endl;
-      ipu = ip;
-    }
-    std::cout << "   image undist: " << std::endl;
-    std::cout << ipu << std::endl;
     // Use opencv to calculate the homography matrix.
     cv::Mat H = cv::findHomography(wp, ipu);
 
@@ -106,75 +103,31 @@ namespace utils {
   bool get_init_pose_pnp(const std::vector<cv::Point3d> &world_points,
                          const std::vector<cv::Point2d> &image_points,
                          const cv::Mat &K,
-                         const std::string &distModel,
-                         const cv::Mat &D,
+                         const UndistortionTable &undist,
                          cv::Mat *rvec,
                          cv::Mat *tvec) {
-    //std::cout << "init pose pnp: K: " << K <<std::endl;
-    //std::cout << "D: " << D << std::endl;
-    bool status(false);
-    if (distModel == "plumb_bob" || distModel == "radtan") {
-      status = cv::solvePnP(world_points, image_points, K, D,
-                            *rvec, *tvec, false);
-    } else {
-      cv::Mat im_undist;
-      cv::fisheye::undistortPoints(image_points, im_undist, K, D, K);
+    // undistort via lookup table, then map back to pixels
+    // such that pnp runs on an ideal pinhole camera
+    std::vector<gtsam::Point2> xn;
+    undistort_points(image_points, undist, &xn);
+    const double fx = K.at<double>(0, 0), fy = K.at<double>(1, 1);
+    const double cx = K.at<double>(0, 2), cy = K.at<double>(1, 2);
+    std::vector<cv::Point2d> im_undist;
+    im_undist.reserve(xn.size());
+    for (const auto &x: xn) {
+      im_undist.push_back(cv::Point2d(fx * x.x() + cx, fy * x.y() + cy));
+    }
+    bool status = cv::solvePnP(world_points, im_undist, K, cv::Mat(),
+                               *rvec, *tvec, false);
+    if (!status && (image_points.size() == 4)) { // indicates failure
+      *tvec = (cv::Mat_<double>(3, 1) << 0, 0, 1);
+      *rvec = (cv::Mat_<double>(3, 1) << 3.141, 0, 0);
       status = cv::solvePnP(world_points, im_undist, K, cv::Mat(),
-                            *rvec, *tvec, false);
-      if (!status && (image_points.size() == 4)) { // indicates failure
-        *tvec = (cv::Mat_<double>(3, 1) << 0, 0, 1);
-        *rvec = (cv::Mat_<double>(3, 1) << 3.141, 0, 0);
-        status = cv::solvePnP(world_points, im_undist, K, cv::Mat(),
-                              *rvec, *tvec, true, CV_P3P);
-      }
+                            *rvec, *tvec, true, CV_P3P);
     }
     return (status);
   }
 
-  
-  void project_points(const std::vector<cv::Point3d> &wp,
-                      const cv::Mat &rvec,
-                      const cv::Mat &tvec,
-                      const cv::Mat &K,
-                      const std::string &distModel,
-                      const cv::Mat &D, 
-                      std::vector<cv::Point2d> *ip) {
-    if (wp.empty()) {
-      *ip = std::vector<cv::Point2d>();
-      return;
-    }
-    if (distModel == "equidistant") {
-      cv::Affine3d::Vec3 arvec = rvec;
-      cv::Affine3d::Vec3 atvec = tvec;
-      cv::fisheye::projectPoints(wp, *ip, arvec, atvec, K, D);
-    } else if (distModel == "radtan" || distModel == "plumb_bob") {
-      cv::projectPoints(wp, rvec, tvec, K, D, *ip);
-    } else {
-      std::cout << "WARNING: unknown distortion model: " << distModel << " using radtan!" << std::endl;
-      cv::projectPoints(wp, rvec, tvec, K, D, *ip);
-    }
-  }
-
-  double reprojection_error(const std::vector<cv::Point3d> &wp,
-                            const std::vector<cv::Point2d> &ip,
-                            const cv::Mat &rvec,
-                            const cv::Mat &tvec,
-                            const cv::Mat &K,
-                            const std::string &distModel,
-                            const cv::Mat &D) {
-    if (wp.empty()) {
-      return (0.0);
-    }
-    std::vector<cv::Point2d> ipp;
-    project_points(wp, rvec, tvec, K, distModel, D, &ipp);
-    double err(0);
-    for (unsigned int i = 0; i < ipp.size(); i++) {
-      cv::Point diff = ipp[i] - ip[i];
-      err += sqrt(diff.x * diff.x + diff.y * diff.y);
-    }
-    return (err / (double) ipp.size());
-  }
-  
   double get_pixel_range(const std::vector<gtsam::Point2> &ip) {
     double min_pix[2] = {1e30, 1e30};
     double max_pix[2] = {-1e30, -1e30};
@@ -0,0 +1,56 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/work_queue.h"
+
+namespace tagslam {
+  WorkQueue::~WorkQueue() {
+    stop();
+  }
+
+  void WorkQueue::start() {
+    if (isRunning()) {
+      return;
+    }
+    keepRunning_ = true;
+    thread_ = std::thread(&WorkQueue::run, this);
+  }
+
+  void WorkQueue::stop() {
+    if (!isRunning()) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      keepRunning_ = false;
+      jobs_.clear();
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  void WorkQueue::push(const Job &job) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      jobs_.push_back(job);
+    }
+    cv_.notify_all();
+  }
+
+  void WorkQueue::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] { return (!jobs_.empty() || !keepRunning_); });
+      if (!keepRunning_) {
+        break;
+      }
+      Job job;
+      job.swap(jobs_.front());
+      jobs_.pop_front();
+      lock.unlock();
+      job();
+      lock.lock();
+    }
+  }
+}  // namespace
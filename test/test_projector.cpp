@@ -0,0 +1,130 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/projector.h"
+#include <gtest/gtest.h>
+#include <boost/range/irange.hpp>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace tagslam;
+using boost::irange;
+
+struct CameraConfig {
+  std::string         name;
+  std::string         model;
+  std::vector<double> K;
+  std::vector<double> D;
+};
+
+static std::vector<double> parse_list(const std::string &line) {
+  std::vector<double> v;
+  const size_t b = line.find('['), e = line.find(']');
+  if (b == std::string::npos || e == std::string::npos) {
+    return (v);
+  }
+  std::string s = line.substr(b + 1, e - b - 1);
+  for (auto &c: s) {
+    if (c == ',') c = ' ';
+  }
+  std::istringstream is(s);
+  double x;
+  while (is >> x) {
+    v.push_back(x);
+  }
+  return (v);
+}
+
+// just enough yaml for the cameras.yaml files in examples/
+static std::vector<CameraConfig> read_cameras(const std::string &fname) {
+  std::vector<CameraConfig> cams;
+  std::ifstream f(fname);
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    if (line[0] != ' ') {
+      cams.push_back(CameraConfig());
+      cams.back().name = line.substr(0, line.find(':'));
+      continue;
+    }
+    if (cams.empty()) {
+      continue;
+    }
+    const size_t p = line.find_first_not_of(' ');
+    if (line.compare(p, 17, "distortion_model:") == 0) {
+      std::istringstream is(line.substr(p + 17));
+      is >> cams.back().model;
+    } else if (line.compare(p, 18, "distortion_coeffs:") == 0) {
+      cams.back().D = parse_list(line);
+    } else if (line.compare(p, 11, "intrinsics:") == 0) {
+      cams.back().K = parse_list(line);
+    }
+  }
+  return (cams);
+}
+
+TEST(Projector, ExampleConfigs) {
+  // example_4 has 5 plumb_bob coefficients
+  int numCams(0), numFiveCoeff(0);
+  for (const auto ex: irange(1, 10)) {
+    const std::string fname = std::string(TAGSLAM_SOURCE_DIR) + "/examples/example_" +
+      std::to_string(ex) + "/config/cameras.yaml";
+    for (const auto &cam: read_cameras(fname)) {
+      ProjectorPtr proj;
+      EXPECT_NO_THROW(proj = Projector::make(cam.model, cam.K, cam.D))
+        << fname << " " << cam.name;
+      ASSERT_TRUE(proj != NULL);
+      const gtsam::Point2 uv = proj->projectPoint(gtsam::Point3(0.1, -0.2, 1.0));
+      EXPECT_TRUE(Projector::is_projected(uv)) << fname << " " << cam.name;
+      numCams++;
+      numFiveCoeff += (cam.D.size() == 5);
+    }
+  }
+  EXPECT_GT(numCams, 0);
+  EXPECT_GT(numFiveCoeff, 0);
+}
+
+TEST(Projector, RadTanK3) {
+  const std::vector<double> K = {500, 510, 320, 240};
+  const std::vector<double> D = {-0.2, 0.15, 0.001, -0.0005, 0.05};
+  ProjectorPtr proj = Projector::make("plumb_bob", K, D);
+  const gtsam::Point3 X(0.3, -0.2, 1.2);
+  gtsam::Matrix23 H;
+  const gtsam::Point2 uv = proj->projectPoint(X, H);
+  // opencv plumb_bob
+  const double x = X.x() / X.z(), y = X.y() / X.z(), r2 = x * x + y * y;
+  const double g = 1 + D[0] * r2 + D[1] * r2 * r2 + D[4] * r2 * r2 * r2;
+  const double xd = x * g + 2 * D[2] * x * y + D[3] * (r2 + 2 * x * x);
+  const double yd = y * g + D[2] * (r2 + 2 * y * y) + 2 * D[3] * x * y;
+  EXPECT_NEAR(uv.x(), K[0] * xd + K[2], 1e-9);
+  EXPECT_NEAR(uv.y(), K[1] * yd + K[3], 1e-9);
+  // jacobian against central differences
+  const double eps = 1e-6;
+  for (const auto j: irange(0, 3)) {
+    gtsam::Vector3 dX = gtsam::Vector3::Zero();
+    dX(j) = eps;
+    const gtsam::Point2 up = proj->projectPoint(gtsam::Point3(X.x() + dX(0), X.y() + dX(1), X.z() + dX(2)));
+    const gtsam::Point2 um = proj->projectPoint(gtsam::Point3(X.x() - dX(0), X.y() - dX(1), X.z() - dX(2)));
+    EXPECT_NEAR(H(0, j), (up.x() - um.x()) / (2 * eps), 1e-4);
+    EXPECT_NEAR(H(1, j), (up.y() - um.y()) / (2 * eps), 1e-4);
+  }
+}
+
+TEST(Projector, TooManyCoefficients) {
+  const std::vector<double> K = {500, 510, 320, 240};
+  EXPECT_THROW(Projector::make("equidistant", K, {0.1, 0.01, 0, 0, 0.02}),
+               std::runtime_error);
+  EXPECT_NO_THROW(Projector::make("equidistant", K, {0.1, 0.01, 0, 0, 0}));
+  EXPECT_THROW(Projector::make("radtan", K, {0, 0, 0, 0, 0, 0.1}),
+               std::runtime_error);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return (RUN_ALL_TESTS());
+}
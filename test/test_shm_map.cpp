@@ -0,0 +1,155 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/shm_map.h"
+#include <gtest/gtest.h>
+#include <boost/range/irange.hpp>
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace tagslam;
+using boost::irange;
+
+static const char *SHM_NAME = "tagslam_test_shm_map";
+static const int NUM_CLIENTS = 4;
+static const int NUM_FRAMES  = 200; // per client, more than the ring holds
+
+static MapSnapshot make_map() {
+  MapSnapshot s;
+  s.frameNum = 7;
+  s.time.fromNSec(123456789);
+  s.tags[3] = MapSnapshot::Entry(
+    gtsam::Pose3(gtsam::Rot3::Expmap(gtsam::Vector3(0, 0, 0.5)), gtsam::Point3(1, 2, 3)));
+  s.tags[3].size = 0.1;
+  s.bodies["board"] = MapSnapshot::Entry(
+    gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(-1, 0, 0)));
+  return (s);
+}
+
+// runs in the forked client, exit code != 0 on failure
+static int run_client(int clientIdx) {
+  try {
+    ShmMapClient client(SHM_NAME);
+    MapSnapshot m;
+    if (!client.readMap(&m)) {
+      return (1);
+    }
+    if (m.frameNum != 7 || m.tags.size() != 1 || m.bodies.size() != 1 ||
+        m.tags[3].size != 0.1 ||
+        !m.tags[3].pose.equals(make_map().tags[3].pose, 1e-12)) {
+      return (2);
+    }
+    for (const auto k: irange(0, NUM_FRAMES)) {
+      auto fill = [clientIdx, k](shm::DetectionFrame *f) {
+        f->camera  = clientIdx;
+        f->stamp   = k;
+        f->numTags = 1;
+        f->tags[0].id = clientIdx * 1000 + k;
+      };
+      while (!client.pushDetections(fill)) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+  } catch (const std::exception &) {
+    return (3);
+  }
+  return (0);
+}
+
+TEST(ShmMap, MultipleClients) {
+  ShmMapServer server(SHM_NAME);
+  server.writeMap(make_map());
+  std::vector<pid_t> pids;
+  for (const auto c: irange(0, NUM_CLIENTS)) {
+    const pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+      _exit(run_client(c));
+    }
+    pids.push_back(pid);
+  }
+  // drain the ring until every frame has arrived, each client's
+  // frames must come in the order they were pushed
+  std::map<uint32_t, int64_t> lastStamp;
+  int numReceived(0);
+  bool inOrder(true), tagsOk(true);
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (numReceived < NUM_CLIENTS * NUM_FRAMES &&
+         std::chrono::steady_clock::now() < deadline) {
+    auto check = [&](const shm::DetectionFrame &f) {
+      auto it = lastStamp.find(f.camera);
+      if (it != lastStamp.end() && f.stamp != it->second + 1) {
+        inOrder = false;
+      }
+      lastStamp[f.camera] = f.stamp;
+      tagsOk = tagsOk && f.numTags == 1 &&
+        f.tags[0].id == (int32_t)(f.camera * 1000 + f.stamp);
+      numReceived++;
+    };
+    if (!server.popDetections(check)) {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+  for (const auto pid: pids) {
+    int status(0);
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0) << "client pid " << pid;
+  }
+  EXPECT_EQ(numReceived, NUM_CLIENTS * NUM_FRAMES);
+  EXPECT_EQ((int)lastStamp.size(), NUM_CLIENTS);
+  EXPECT_TRUE(inOrder);
+  EXPECT_TRUE(tagsOk);
+  EXPECT_FALSE(server.popDetections([](const shm::DetectionFrame &) {}));
+}
+
+TEST(ShmMap, MapUpdateSeenByClient) {
+  ShmMapServer server(SHM_NAME);
+  ShmMapClient client(SHM_NAME);
+  MapSnapshot m;
+  EXPECT_FALSE(client.readMap(&m)); // nothing written yet
+  MapSnapshot s = make_map();
+  server.writeMap(s);
+  const uint64_t v = client.getMapVersion();
+  s.frameNum = 8;
+  server.writeMap(s);
+  EXPECT_GT(client.getMapVersion(), v);
+  ASSERT_TRUE(client.readMap(&m));
+  EXPECT_EQ(m.frameNum, 8u);
+  EXPECT_EQ(m.time.toNSec(), 123456789u);
+}
+
+TEST(ShmMap, DeadClientDoesNotBlockRing) {
+  ShmMapServer server(SHM_NAME, 0.05);
+  ShmMapClient client(SHM_NAME);
+  // the first client dies between claiming and publishing its slot
+  auto die = [](shm::DetectionFrame *) { throw std::runtime_error("died"); };
+  EXPECT_THROW(client.pushDetections(die), std::runtime_error);
+  auto fill = [](shm::DetectionFrame *f) {
+    f->camera  = 1;
+    f->stamp   = 2;
+    f->numTags = 0;
+  };
+  ASSERT_TRUE(client.pushDetections(fill));
+  int numReceived(0);
+  auto count = [&numReceived](const shm::DetectionFrame &f) {
+    EXPECT_EQ(f.stamp, 2);
+    numReceived++;
+  };
+  EXPECT_FALSE(server.popDetections(count)); // blocked until timeout
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_TRUE(server.popDetections(count));
+  EXPECT_EQ(numReceived, 1);
+  EXPECT_EQ(server.getNumStaleSlots(), 1u);
+  EXPECT_FALSE(server.popDetections(count));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return (RUN_ALL_TESTS());
+}
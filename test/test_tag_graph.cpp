@@ -0,0 +1,111 @@
+/* -*-c++-*--------------------------------------------------------------------
+ * 2018 Bernd Pfrommer bernd.pfrommer@gmail.com
+ */
+
+#include "tagslam/tag_graph.h"
+#include "tagslam/simple_body.h"
+#include <geometry_msgs/Point.h>
+#include <gtest/gtest.h>
+#include <boost/range/irange.hpp>
+#include <vector>
+
+using namespace tagslam;
+using boost::irange;
+
+static PoseEstimate make_prior(const gtsam::Pose3 &pose) {
+  return (PoseEstimate(pose, 0.0, 0, makePoseNoise(0.01, 0.01)));
+}
+
+// static camera rig looking at a static board one meter away
+struct StaticScene {
+  StaticScene() {
+    rig.reset(new SimpleBody("rig", true));
+    rig->index = 0;
+    rig->hasPosePrior = true;
+    rig->poseEstimate = make_prior(gtsam::Pose3());
+    board.reset(new SimpleBody("board", true));
+    board->index = 1;
+    board->hasPosePrior = true;
+    board->poseEstimate = make_prior(
+      gtsam::Pose3(gtsam::Rot3(), gtsam::Point3(0, 0, 1.0)));
+    cam.reset(new Camera());
+    cam->name = "cam0";
+    cam->index = 0;
+    cam->hasPosePrior = true;
+    cam->poseEstimate = make_prior(gtsam::Pose3());
+    cam->rig = rig;
+    cam->projector = Projector::make("radtan", {600, 600, 320, 240},
+                                     {0, 0, 0, 0});
+  }
+  // sets the image corners of the tags as seen in frame
+  void observe(const TagVec &tags, unsigned int frame) const {
+    for (const auto &tag: tags) {
+      geometry_msgs::Point corners[4];
+      for (const auto i: irange(0, 4)) {
+        const gtsam::Point3 X_c = board->poseEstimate.transform_from(
+          tag->poseEstimate.transform_from(tag->getObjectCorner(i)));
+        const gtsam::Point2 uv = cam->projector->projectPoint(X_c);
+        // a bit of jitter so the aggregated factors change
+        corners[i].x = uv.x() + 0.1 * (frame % 3);
+        corners[i].y = uv.y() - 0.1 * (frame % 2);
+      }
+      tag->setImageCorners(corners);
+    }
+  }
+  RigidBodyPtr rig;
+  RigidBodyPtr board;
+  CameraPtr    cam;
+};
+
+TEST(TagGraph, StaticFramesReuseFactorSlots) {
+  StaticScene scene;
+  TagGraph graph;
+  const TagVec tags = {
+    Tag::makeTag(0, 6, 0.2, make_prior(gtsam::Pose3()), true)};
+  graph.addCamera(scene.cam);
+  graph.addTags(scene.board, tags);
+  size_t numSlots(0);
+  for (const auto frame: irange(0u, 20u)) {
+    scene.observe(tags, frame);
+    graph.observedTags(scene.cam, scene.board, tags, frame);
+    graph.optimize();
+    // the first replacement leaves empty slots, after that
+    // they are reused
+    if (frame == 1) {
+      numSlots = graph.getNumFactorSlots();
+    } else if (frame > 1) {
+      EXPECT_EQ(graph.getNumFactorSlots(), numSlots) << "frame " << frame;
+    }
+  }
+}
+
+TEST(TagGraph, StaticFramesWithSmartTag) {
+  StaticScene scene;
+  TagGraph graph;
+  graph.setUseSmartTagFactors(true);
+  const TagVec tags = {
+    Tag::makeTag(0, 6, 0.2, make_prior(gtsam::Pose3()), true),
+    Tag::makeTag(1, 6, 0.2, make_prior(gtsam::Pose3(
+                                         gtsam::Rot3(), gtsam::Point3(0.3, 0, 0))))};
+  graph.addCamera(scene.cam);
+  graph.addTags(scene.board, tags);
+  size_t numSlots(0);
+  for (const auto frame: irange(0u, 20u)) {
+    scene.observe(tags, frame);
+    graph.observedTags(scene.cam, scene.board, tags, frame);
+    graph.optimize();
+    if (frame == 1) {
+      numSlots = graph.getNumFactorSlots();
+    } else if (frame > 1) {
+      EXPECT_EQ(graph.getNumFactorSlots(), numSlots) << "frame " << frame;
+    }
+  }
+  gtsam::Pose3 T_b_o;
+  ASSERT_TRUE(graph.getTagRelPose(scene.board, 1, &T_b_o));
+  EXPECT_NEAR(T_b_o.translation().x(), 0.3, 0.01);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return (RUN_ALL_TESTS());
+}